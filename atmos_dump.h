@@ -0,0 +1,319 @@
+//Density field dump format for atmos_sim
+/*
+ |  A dump file holds one frame of the atmospheric density field, so
+ |  that other tools can work with the actual values instead of the
+ |  color-mapped images. The layout is:
+ |
+ |    [header]   struct atmos_dump_header, padded out to `data_offset`
+ |    [data]     `height` rows of `width` samples each, top row first,
+ |               stored as float64 or float32 (see `type`)
+ |
+ |  `data_offset` is a multiple of the page size on the machine that
+ |  wrote the file, so the field data can be memory-mapped and used
+ |  in place. Numbers are stored in the byte order of the machine
+ |  that wrote the file; `byte_order` lets a reader detect a mismatch.
+ */
+
+#ifndef __ATMOS_DUMP_HEADER
+#define __ATMOS_DUMP_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define ATMOS_DUMP_MAGIC "ATMSFELD"
+#define ATMOS_DUMP_VERSION 1
+#define ATMOS_DUMP_BYTE_ORDER 0x01020304
+
+typedef enum {
+  ATMOS_DUMP_F64 = 0,
+  ATMOS_DUMP_F32 = 1
+} atmos_dump_type;
+
+struct atmos_dump_header {
+  char magic[8]; // ATMOS_DUMP_MAGIC
+  uint32_t version; // ATMOS_DUMP_VERSION
+  uint32_t byte_order; // ATMOS_DUMP_BYTE_ORDER, as written by this machine
+  uint64_t data_offset; // start of field data, in bytes from beginning of file
+  uint64_t data_size; // length of field data, in bytes
+  uint32_t type; // atmos_dump_type
+  int32_t frame; // frame index
+  int32_t width, height; // samples per row & number of rows
+  //window geometry
+  double image_res; // pixels per kilometer
+  double window_arc_length, window_altitude, window_angle; // kilometers, kilometers, degrees
+  double window_top, window_bottom, window_left, window_right; // kilometers
+  double earth_radius; // kilometers
+};
+
+//an opened dump file
+struct atmos_dump {
+  void *map; // whole file, memory-mapped read-only
+  size_t map_size;
+  const struct atmos_dump_header *header;
+  const void *data; // field data, inside `map`
+};
+
+//bytes per field sample for the given type
+size_t atmos_dump_sample_size(uint32_t type) {
+  return (type == ATMOS_DUMP_F32 ? sizeof(float) : sizeof(double));
+}
+
+//fill in the magic number, version & data layout of a header
+void atmos_dump_layout(struct atmos_dump_header *h) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  memcpy(h->magic, ATMOS_DUMP_MAGIC, 8);
+  h->version = ATMOS_DUMP_VERSION;
+  h->byte_order = ATMOS_DUMP_BYTE_ORDER;
+  h->data_offset = ((sizeof(struct atmos_dump_header) + page - 1) / page) * page;
+  h->data_size = (size_t)h->width * (size_t)h->height * atmos_dump_sample_size(h->type);
+  return;
+}
+
+/*
+ |  Write a dump file. `h` must have the geometry, frame index &
+ |  sample type filled in; the rest is filled here. `data` is the
+ |  whole field as one contiguous array of doubles, which gets
+ |  converted if float32 output was asked for.
+ |
+ |  The file is written to a temp name and then renamed, so a
+ |  partial dump never carries the final name.
+ */
+int atmos_dump_write(const char *file, struct atmos_dump_header *h, const double *data) {
+  char temp[1024];
+  struct iovec iov[2];
+  unsigned char *head;
+  float *conv = NULL;
+  size_t count = (size_t)h->width * (size_t)h->height;
+  size_t i, total, done;
+  ssize_t res;
+  int fd;
+
+  //fill in layout
+  atmos_dump_layout(h);
+  if ((head = (unsigned char *)calloc(1, h->data_offset)) == NULL) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  memcpy(head, h, sizeof(struct atmos_dump_header));
+  iov[0].iov_base = head;
+  iov[0].iov_len = h->data_offset;
+  if (h->type == ATMOS_DUMP_F32) {
+    if ((conv = (float *)malloc(h->data_size)) == NULL) {
+      fprintf(stderr, "malloc(): %s\n", strerror(errno));
+      free(head);
+      return -1;
+    }
+    for (i=0; i < count; i++) {
+      conv[i] = (float)data[i];
+    }
+    iov[1].iov_base = conv;
+  } else {
+    iov[1].iov_base = (void *)data;
+  }
+  iov[1].iov_len = h->data_size;
+
+  //one big write (only repeated if the system hands us a short one)
+  snprintf(temp, 1024, "%s.tmp", file);
+  if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    fprintf(stderr, "open() on '%s': %s\n", temp, strerror(errno));
+    free(head);
+    free(conv);
+    return -1;
+  }
+  total = iov[0].iov_len + iov[1].iov_len;
+  done = 0;
+  while (done < total) {
+    if ((res = writev(fd, iov, 2)) <= 0) {
+      if (res == -1 && errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "writev() on '%s': %s\n", temp, strerror(errno));
+      close(fd);
+      unlink(temp);
+      free(head);
+      free(conv);
+      return -1;
+    }
+    done += (size_t)res;
+    //skip past whatever was written
+    for (i=0; i < 2 && res > 0; i++) {
+      if ((size_t)res >= iov[i].iov_len) {
+        res -= iov[i].iov_len;
+        iov[i].iov_base = (char *)iov[i].iov_base + iov[i].iov_len;
+        iov[i].iov_len = 0;
+      } else {
+        iov[i].iov_base = (char *)iov[i].iov_base + res;
+        iov[i].iov_len -= res;
+        res = 0;
+      }
+    }
+  }
+  free(head);
+  free(conv);
+  if (close(fd) != 0 || rename(temp, file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+
+//write a whole buffer, even if the system hands us short writes
+int atmos_dump_write_all(int fd, const void *buf, size_t len) {
+  ssize_t res;
+  while (len > 0) {
+    if ((res = write(fd, buf, len)) <= 0) {
+      if (res == -1 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf = (const char *)buf + res;
+    len -= (size_t)res;
+  }
+  return 0;
+}
+
+/*
+ |  Same as `atmos_dump_write()`, but the field is fetched one row at
+ |  a time by `row()`, for fields that aren't stored as one array.
+ */
+int atmos_dump_write_rows(const char *file, struct atmos_dump_header *h, void (*row)(int y, double *out)) {
+  char temp[1024];
+  unsigned char *head;
+  double *buff;
+  float *conv;
+  int fd, x, y, res;
+
+  atmos_dump_layout(h);
+  if (
+    (head = (unsigned char *)calloc(1, h->data_offset)) == NULL ||
+    (buff = (double *)calloc(sizeof(double), h->width)) == NULL ||
+    (conv = (float *)calloc(sizeof(float), h->width)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  memcpy(head, h, sizeof(struct atmos_dump_header));
+
+  snprintf(temp, 1024, "%s.tmp", file);
+  if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    fprintf(stderr, "open() on '%s': %s\n", temp, strerror(errno));
+    free(head);
+    free(buff);
+    free(conv);
+    return -1;
+  }
+  res = atmos_dump_write_all(fd, head, h->data_offset);
+  for (y=0; y < h->height && res == 0; y++) {
+    row(y, buff);
+    if (h->type == ATMOS_DUMP_F32) {
+      for (x=0; x < h->width; x++) {
+        conv[x] = (float)buff[x];
+      }
+      res = atmos_dump_write_all(fd, conv, sizeof(float)*h->width);
+    } else {
+      res = atmos_dump_write_all(fd, buff, sizeof(double)*h->width);
+    }
+  }
+  free(head);
+  free(buff);
+  free(conv);
+  if (res != 0) {
+    fprintf(stderr, "write() on '%s': %s\n", temp, strerror(errno));
+    close(fd);
+    unlink(temp);
+    return -1;
+  }
+  if (close(fd) != 0 || rename(temp, file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+
+//map a dump file into memory and check that it's intact
+int atmos_dump_open(const char *file, struct atmos_dump *d) {
+  struct stat st;
+  const struct atmos_dump_header *h;
+  int fd;
+  memset(d, 0, sizeof(struct atmos_dump));
+  if ((fd = open(file, O_RDONLY)) == -1) {
+    fprintf(stderr, "open() on '%s': %s\n", file, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "fstat() on '%s': %s\n", file, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(struct atmos_dump_header)) {
+    fprintf(stderr, "'%s' is too short to be a density field dump\n", file);
+    close(fd);
+    return -1;
+  }
+  d->map_size = (size_t)st.st_size;
+  if ((d->map = mmap(NULL, d->map_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "mmap() on '%s': %s\n", file, strerror(errno));
+    d->map = NULL;
+    close(fd);
+    return -1;
+  }
+  //the mapping stays valid after closing
+  close(fd);
+  h = (const struct atmos_dump_header *)d->map;
+  if (memcmp(h->magic, ATMOS_DUMP_MAGIC, 8) != 0 || h->version != ATMOS_DUMP_VERSION) {
+    fprintf(stderr, "'%s' is not a version %d density field dump\n", file, ATMOS_DUMP_VERSION);
+    munmap(d->map, d->map_size);
+    d->map = NULL;
+    return -1;
+  }
+  if (h->byte_order != ATMOS_DUMP_BYTE_ORDER) {
+    fprintf(stderr, "'%s' was written with a different byte order\n", file);
+    munmap(d->map, d->map_size);
+    d->map = NULL;
+    return -1;
+  }
+  if (
+    h->width <= 0 || h->height <= 0 ||
+    h->data_size != (uint64_t)h->width * (uint64_t)h->height * atmos_dump_sample_size(h->type) ||
+    h->data_offset + h->data_size > d->map_size
+  ) {
+    fprintf(stderr, "'%s' is truncated or corrupt\n", file);
+    munmap(d->map, d->map_size);
+    d->map = NULL;
+    return -1;
+  }
+  d->header = h;
+  d->data = (const char *)d->map + h->data_offset;
+  return 0;
+}
+
+//read one sample, whatever the storage type
+double atmos_dump_val(const struct atmos_dump *d, int x, int y) {
+  size_t i = (size_t)y * (size_t)d->header->width + (size_t)x;
+  if (d->header->type == ATMOS_DUMP_F32) {
+    return (double)((const float *)d->data)[i];
+  }
+  return ((const double *)d->data)[i];
+}
+
+//release a dump file
+void atmos_dump_close(struct atmos_dump *d) {
+  if (d->map != NULL) {
+    munmap(d->map, d->map_size);
+  }
+  memset(d, 0, sizeof(struct atmos_dump));
+  return;
+}
+
+#endif
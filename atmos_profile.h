@@ -0,0 +1,292 @@
+//Sounding profile database format for atmos_sim
+/*
+ |  A profile database holds many measured density profiles (such as
+ |  radiosonde soundings), so that atmos_sim can use any of them as the
+ |  baseline atmosphere without parsing text. The layout is:
+ |
+ |    [header]   struct atmos_profile_header
+ |    [index]    `count` entries of struct atmos_profile_entry, sorted
+ |               by `id` (so a profile can be found by binary search)
+ |    [data]     each profile's levels, as struct atmos_profile_level,
+ |               lowest altitude first
+ |
+ |  Everything is 8-byte aligned, so the whole file can be memory-
+ |  mapped and used in place. Numbers are stored in the byte order of
+ |  the machine that wrote the file; `byte_order` lets a reader detect
+ |  a mismatch.
+ |
+ |  `atmos_profile_build()` makes a database from a text file with one
+ |  block per profile:
+ |
+ |    # comments & blank lines are skipped
+ |    profile ID
+ |    ALTITUDE DENSITY      (kilometers & kg/m^3, one line per level,
+ |    ...                    altitude increasing)
+ */
+
+#ifndef __ATMOS_PROFILE_HEADER
+#define __ATMOS_PROFILE_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ATMOS_PROFILE_MAGIC "ATMSPROF"
+#define ATMOS_PROFILE_VERSION 1
+#define ATMOS_PROFILE_BYTE_ORDER 0x01020304
+
+struct atmos_profile_header {
+  char magic[8]; // ATMOS_PROFILE_MAGIC
+  uint32_t version; // ATMOS_PROFILE_VERSION
+  uint32_t byte_order; // ATMOS_PROFILE_BYTE_ORDER, as written by this machine
+  uint64_t count; // number of profiles
+  uint64_t index_offset; // start of index, in bytes from beginning of file
+  uint64_t data_offset; // start of level data, in bytes from beginning of file
+  uint64_t data_size; // length of level data, in bytes
+};
+struct atmos_profile_entry {
+  uint64_t id; // profile ID (e.g. station & launch time, packed by whoever built the file)
+  uint64_t offset; // start of this profile's levels, in bytes from `data_offset`
+  uint64_t levels; // number of levels
+};
+struct atmos_profile_level {
+  double alt; // altitude in kilometers
+  double density; // density in kg/m^3
+};
+
+//an opened profile database
+struct atmos_profile_db {
+  void *map; // whole file, memory-mapped read-only
+  size_t map_size;
+  const struct atmos_profile_header *header;
+  const struct atmos_profile_entry *index; // inside `map`
+};
+
+//order index entries by ID
+int atmos_profile_compare(const void *a, const void *b) {
+  uint64_t ia = ((const struct atmos_profile_entry *)a)->id;
+  uint64_t ib = ((const struct atmos_profile_entry *)b)->id;
+  return (ia > ib) - (ia < ib);
+}
+
+/*
+ |  Convert a text file of profiles (see above) into a database. Each
+ |  profile needs at least two levels, with altitude increasing and
+ |  density above zero, and no ID may appear twice.
+ |
+ |  The file is written to a temp name and then renamed, so a partial
+ |  database never carries the final name.
+ */
+int atmos_profile_build(const char *text, const char *file) {
+  struct atmos_profile_header h;
+  struct atmos_profile_entry *index = NULL, *entry;
+  struct atmos_profile_level *levels = NULL, *level;
+  char line[1024], temp[1024], word[16];
+  unsigned long long id;
+  size_t count = 0, index_size = 0, num = 0, levels_size = 0, i;
+  int line_num = 0, res = -1;
+  FILE *in, *out;
+
+  if ((in = fopen(text, "r")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", text, strerror(errno));
+    return -1;
+  }
+  while (fgets(line, 1024, in) != NULL) {
+    line_num++;
+    if (sscanf(line, "%15s", word) != 1 || word[0] == '#') {
+      continue;
+    }
+    if (strcmp(word, "profile") == 0) {
+      if (sscanf(line, "%*s %llu", &id) != 1) {
+        fprintf(stderr, "%s:%d: `profile` needs a numeric ID\n", text, line_num);
+        goto done;
+      }
+      //start a new index entry
+      if (count == index_size) {
+        index_size = (index_size == 0 ? 64 : index_size*2);
+        if ((entry = (struct atmos_profile_entry *)realloc(index, sizeof(struct atmos_profile_entry)*index_size)) == NULL) {
+          fprintf(stderr, "realloc(): %s\n", strerror(errno));
+          goto done;
+        }
+        index = entry;
+      }
+      entry = &(index[count++]);
+      entry->id = (uint64_t)id;
+      entry->offset = num*sizeof(struct atmos_profile_level);
+      entry->levels = 0;
+      continue;
+    }
+    if (count == 0) {
+      fprintf(stderr, "%s:%d: level before the first `profile` line\n", text, line_num);
+      goto done;
+    }
+    if (num == levels_size) {
+      levels_size = (levels_size == 0 ? 4096 : levels_size*2);
+      if ((level = (struct atmos_profile_level *)realloc(levels, sizeof(struct atmos_profile_level)*levels_size)) == NULL) {
+        fprintf(stderr, "realloc(): %s\n", strerror(errno));
+        goto done;
+      }
+      levels = level;
+    }
+    level = &(levels[num]);
+    if (sscanf(line, "%lf %lf", &(level->alt), &(level->density)) != 2 || !(level->density > 0.0)) {
+      fprintf(stderr, "%s:%d: expected an altitude & a density above zero\n", text, line_num);
+      goto done;
+    }
+    entry = &(index[count-1]);
+    if (entry->levels > 0 && !(level->alt > levels[num-1].alt)) {
+      fprintf(stderr, "%s:%d: altitude has to increase within a profile\n", text, line_num);
+      goto done;
+    }
+    entry->levels++;
+    num++;
+  }
+  for (i=0; i < count; i++) {
+    if (index[i].levels < 2) {
+      fprintf(stderr, "'%s': profile %llu needs at least two levels\n", text, (unsigned long long)index[i].id);
+      goto done;
+    }
+  }
+  qsort(index, count, sizeof(struct atmos_profile_entry), atmos_profile_compare);
+  for (i=1; i < count; i++) {
+    if (index[i].id == index[i-1].id) {
+      fprintf(stderr, "'%s': profile %llu appears more than once\n", text, (unsigned long long)index[i].id);
+      goto done;
+    }
+  }
+
+  //write it all out
+  memset(&h, 0, sizeof(struct atmos_profile_header));
+  memcpy(h.magic, ATMOS_PROFILE_MAGIC, 8);
+  h.version = ATMOS_PROFILE_VERSION;
+  h.byte_order = ATMOS_PROFILE_BYTE_ORDER;
+  h.count = count;
+  h.index_offset = sizeof(struct atmos_profile_header);
+  h.data_offset = h.index_offset + count*sizeof(struct atmos_profile_entry);
+  h.data_size = num*sizeof(struct atmos_profile_level);
+  snprintf(temp, 1024, "%s.tmp", file);
+  if ((out = fopen(temp, "wb")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    goto done;
+  }
+  if (
+    fwrite(&h, sizeof(struct atmos_profile_header), 1, out) != 1 ||
+    (count > 0 && fwrite(index, sizeof(struct atmos_profile_entry), count, out) != count) ||
+    (num > 0 && fwrite(levels, sizeof(struct atmos_profile_level), num, out) != num) ||
+    fclose(out) != 0 ||
+    rename(temp, file) != 0
+  ) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    goto done;
+  }
+  fprintf(stdout, "Saved %llu profile(s) with %llu level(s) to '%s'\n", (unsigned long long)count, (unsigned long long)num, file);
+  res = 0;
+
+done:
+  fclose(in);
+  free(index);
+  free(levels);
+  return res;
+}
+
+//map a profile database into memory and check that it's intact
+int atmos_profile_open(const char *file, struct atmos_profile_db *db) {
+  struct stat st;
+  const struct atmos_profile_header *h;
+  const struct atmos_profile_entry *entry;
+  uint64_t i;
+  int fd;
+  memset(db, 0, sizeof(struct atmos_profile_db));
+  if ((fd = open(file, O_RDONLY)) == -1) {
+    fprintf(stderr, "open() on '%s': %s\n", file, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "fstat() on '%s': %s\n", file, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(struct atmos_profile_header)) {
+    fprintf(stderr, "'%s' is too short to be a profile database\n", file);
+    close(fd);
+    return -1;
+  }
+  db->map_size = (size_t)st.st_size;
+  if ((db->map = mmap(NULL, db->map_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "mmap() on '%s': %s\n", file, strerror(errno));
+    db->map = NULL;
+    close(fd);
+    return -1;
+  }
+  //the mapping stays valid after closing
+  close(fd);
+  h = (const struct atmos_profile_header *)db->map;
+  if (memcmp(h->magic, ATMOS_PROFILE_MAGIC, 8) != 0 || h->version != ATMOS_PROFILE_VERSION) {
+    fprintf(stderr, "'%s' is not a version %d profile database\n", file, ATMOS_PROFILE_VERSION);
+    munmap(db->map, db->map_size);
+    db->map = NULL;
+    return -1;
+  }
+  if (h->byte_order != ATMOS_PROFILE_BYTE_ORDER) {
+    fprintf(stderr, "'%s' was written with a different byte order\n", file);
+    munmap(db->map, db->map_size);
+    db->map = NULL;
+    return -1;
+  }
+  if (
+    h->index_offset != sizeof(struct atmos_profile_header) ||
+    h->data_offset != h->index_offset + h->count*sizeof(struct atmos_profile_entry) ||
+    h->data_offset + h->data_size != db->map_size
+  ) {
+    fprintf(stderr, "'%s' is truncated or corrupt\n", file);
+    munmap(db->map, db->map_size);
+    db->map = NULL;
+    return -1;
+  }
+  entry = (const struct atmos_profile_entry *)((const char *)db->map + h->index_offset);
+  for (i=0; i < h->count; i++) {
+    if (
+      entry[i].levels < 2 || entry[i].offset % sizeof(struct atmos_profile_level) != 0 ||
+      entry[i].offset + entry[i].levels*sizeof(struct atmos_profile_level) > h->data_size ||
+      (i > 0 && entry[i].id <= entry[i-1].id)
+    ) {
+      fprintf(stderr, "'%s' has a corrupt index\n", file);
+      munmap(db->map, db->map_size);
+      db->map = NULL;
+      return -1;
+    }
+  }
+  db->header = h;
+  db->index = entry;
+  return 0;
+}
+
+//find a profile by ID (NULL if there's none)
+const struct atmos_profile_entry *atmos_profile_find(const struct atmos_profile_db *db, uint64_t id) {
+  struct atmos_profile_entry key;
+  key.id = id;
+  return (const struct atmos_profile_entry *)bsearch(&key, db->index, db->header->count, sizeof(struct atmos_profile_entry), atmos_profile_compare);
+}
+
+//levels of the given profile, inside the mapping
+const struct atmos_profile_level *atmos_profile_levels(const struct atmos_profile_db *db, const struct atmos_profile_entry *entry) {
+  return (const struct atmos_profile_level *)((const char *)db->map + db->header->data_offset + entry->offset);
+}
+
+//release a profile database
+void atmos_profile_close(struct atmos_profile_db *db) {
+  if (db->map != NULL) {
+    munmap(db->map, db->map_size);
+  }
+  memset(db, 0, sizeof(struct atmos_profile_db));
+  return;
+}
+
+#endif
@@ -1,14 +1,31 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <dirent.h>
+#include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <math.h>
+#include <float.h>
 #include <string.h>
 #include "SDL2/SDL_image.h"
 #include "SDL2/SDL.h"
 #include "spb.h"
 #include "vector3D.h"
+#include "atmos_dump.h"
+#include "atmos_profile.h"
 
 /*
  |  ========================
@@ -17,6 +34,15 @@
  */
 #define MAX_STR 1024
 #define ATMOS_STOP_NUM 100
+#define CHECKPOINT_FILE "atmos_sim.ckpt" // generated bloops & RNG state, for resuming an interrupted run
+#define CHECKPOINT_VERSION 1
+#define CACHE_VERSION 3
+#define MANIFEST_VERSION 2
+#define CHECKSUM_INIT 14695981039346656037ULL // FNV-1a offset basis (see `checksum_update()`)
+#define TILE_SHIFT 6 // tiles of the density field are 2^TILE_SHIFT pixels square (see `--tiles`)
+#define TILE_SIZE (1<<TILE_SHIFT)
+#define TILE_CACHE_DEFAULT 4096 // tiles kept in memory if we have to fall back to the tiled field
+#define TILE_SCRATCH "atmos_sim.tiles.XXXXXX" // scratch file for the tiled field (deleted as soon as it's opened)
 
 /*
  |  =====================
@@ -26,22 +52,43 @@
 #define WINDOW_ARC_LENGTH 900.0 // kilometers
 #define WINDOW_ALTITUDE 35.0 // kilometers
 #define IMAGE_RES 20.0 // pixels per kilometer
+//resolution of the polar field (see `--polar`)
+#define POLAR_RES_GROUND IMAGE_RES // samples per kilometer along the ground
+#define POLAR_RES_ALT IMAGE_RES // samples per kilometer of altitude (at ground level, if stretched)
+#define POLAR_STRETCH 0.0 // 0 for evenly spaced altitude rows; larger values make rows finer near the ground & coarser aloft
 
 #define FRAME_FOLDER "frames"
+#define DUMP_FRAME_FOLDER "frames-dump" // raw density fields, if enabled with `--dump`
+#define CACHE_FRAME_FOLDER "frames-cache" // simulated state of each frame, if enabled with `--cache` (see `--replay`)
+#define MANIFEST_FOLDER "frames-manifest" // one manifest per shard of frames (see `--frames` & `--merge`)
 #define FRAMES 50
 #define RNG_SEED 6651
 #define ENABLE_TURBULENCE 1
 #define BLOOPS_PER_FRAME 10.0
+#define OBSERVER_ALT 0.1 // kilometers
+#define OBSERVER_GROUND 0.4 // kilometers
+#define SERVE_MAX_FRAMES 100000 // most frames a `--serve` request may ask for
+#define SERVE_MAX_BLOOPS 10000000 // most bloops (over all its frames) a `--serve` request may ask for
 #define CONTOUR_NUM 18 // number of contour lines on density map
 #define DENSITY_MAX 1.8 // top of heat map color ramp, in kg/m^3
+#define OUTPUT_SUPERSAMPLE 4 // subsamples each way for output pixels crossed by contour lines or the window's edge (see `--output-size`)
+#define SVG_HEAT_SCALE 4 // simulation pixels per heat map pixel each way, for SVG frames (see `--svg`)
+#define SVG_TOLERANCE 0.1 // how far (in pixels) SVG contour lines may stray from the exact line, to save points
 #define RAY_STEP 1.0 // step size for raytracing through continuously refractive medium
 #define RAY_MIN_SAMPLES 15 // minimum sample count while searching for refraction surface
 #define RAY_MAX_SAMPLES 100 // maximum sample count while searching for refraction surface
 #define RAY_MAX_NODES 16383 // maximum length of ray
 #define RAY_SAMPLE_TOLERANCE 1e-10 // maximum difference which is considered the same density (used in binary search algorithm)
+#define RAY_MAX_LANES 8 // most rays traced together as one packet (see `--dispersion`)
+#define RAY_WARM_SAMPLES 9 // samples in the window around the last step's surface, if starting from there (see `--cold-search`)
+#define RAY_WARM_DEGRADE 0.5 // fraction of the last step's score the window has to match, or else we scatter all the way around
+#define RAY_RETRACE_MARGIN 2 // pixels around a ray node which the step there can sample (RAY_STEP, plus a pixel for interpolation)
+#define RAY_MAX_CONSUMERS 4 // most things which can take the sight line node by node as it's traced (see `ray_consume()`)
+#define RAY_PACKET_SHARE 0.3 // lanes closer than this (in pixels) to the packet's reference lane reuse its refraction surface (about the surface search's own sample spacing)
 
 //params for "Angular Anomaly" chart
 #define ANOM_FRAME_FOLDER "frames-anom"
+#define ANOM_DATA_FOLDER "frames-anom-data" // sight line & anomaly numbers, if enabled with `--headless`
 #define ANOM_CHART_BASE "art/ang_anom-chart-base.png"
 #define ANOM_IMAGE_WIDTH 1204
 #define ANOM_IMAGE_HEIGHT 742
@@ -52,13 +99,93 @@
 #define ANOM_WINDOW_WIDTH 902.978723404 // kilometers
 #define ANOM_WINDOW_HEIGHT 4.0 // degrees
 
+//params for ensemble statistics (see `--ensemble`)
+#define ENSEMBLE_FILE "ensemble.csv"
+#define ENSEMBLE_BIN_WIDTH 10.0 // kilometers of distance per anomaly bin
+#define ENSEMBLE_PCT_NUM 3
+const double ENSEMBLE_PCT[ENSEMBLE_PCT_NUM] = {0.05, 0.50, 0.95}; // percentiles to estimate
+
+//params for dispersion curves (see `--dispersion`)
+#define DISPERSION_FOLDER "frames-dispersion"
+#define DISPERSION_REF_WAVELENGTH 589.3 // nanometers; the wavelength which `GLADSTONEDALE_CONST` is taken to stand for
+#define DISPERSION_NUM 5
+const double DISPERSION_WAVELENGTHS[DISPERSION_NUM] = {400.0, 486.1, 589.3, 656.3, 700.0}; // nanometers
+
+//params for aiming at a target (see `--target`)
+#define TARGET_FOLDER "frames-target"
+#define TARGET_BRACKET_STEP 0.05 // degrees; first step away from the straight line while bracketing the launch angle
+#define TARGET_MAX_ELEVATION 10.0 // degrees; how far from the straight line to look before giving up
+#define TARGET_TOLERANCE 1e-3 // kilometers; how close to the target counts as a hit
+#define TARGET_ANGLE_TOLERANCE 1e-7 // degrees; narrowest launch angle bracket worth splitting
+#define TARGET_MAX_TRACES 50 // most traces for one solve
+
+//params for sounding profiles (see `--profile`)
+#define PROFILE_BATCH_FILE "profiles.csv" // anomaly curves of every profile, if enabled with `--profile-batch`
+
+//params for regression checks (see `--regress`)
+#define REGRESS_VERSION 2
+#define REGRESS_FRAMES 3 // frames in the fixed scenario (with the usual seed & bloops per frame)
+#define REGRESS_ANOM_TOL 1e-3 // degrees; largest difference allowed in any bin of any anomaly curve
+#define REGRESS_FIELD_TOL 1e-6 // largest relative difference allowed in the density field's mean & RMS
+
 typedef enum {
   ATMOS_WEIGHTED_AVERAGE = 0, // (i actually think current implementation of this has identical results to bilinear, except it's probably a tiny bit slower ...)
   ATMOS_BILINEAR = 1 // probably better than weighted average (currently)
 } atmos_interpolation_type;
 atmos_interpolation_type INTERPOLATION_TYPE = ATMOS_BILINEAR;
+typedef enum {
+  ATMOS_FIELD_CARTESIAN = 0, // density field stored on the pixel grid of the window image
+  ATMOS_FIELD_POLAR = 1 // density field stored on an altitude/ground grid, and resampled for rendering
+} atmos_field_type;
+atmos_field_type FIELD_TYPE = ATMOS_FIELD_CARTESIAN;
+typedef enum {
+  REGRESS_OFF = 0,
+  REGRESS_WRITE = 1, // save golden results
+  REGRESS_CHECK = 2 // compare against golden results
+} regress_mode;
+
+//settings which can change from one run to the next (see `--serve`); they start out as the parameters above
+struct atmos_scenario {
+  unsigned int seed;
+  double bloops_per_frame;
+  int frames;
+  double observer_alt, observer_ground; // kilometers
+} scenario = {RNG_SEED, BLOOPS_PER_FRAME, FRAMES, OBSERVER_ALT, OBSERVER_GROUND};
 
 int debug = 0;
+int resume = 0; // skip frames which were already rendered by a previous run (see `--resume`)
+int dump = 0; // save raw density field of each frame (see `--dump`)
+int headless = 0; // skip all image rendering, and only save sight line & anomaly numbers (see `--headless`)
+int cache = 0; // save each frame's density field & sight line for re-rendering later (see `--cache`)
+int replay = 0; // render frames from a previous run's cache instead of simulating (see `--replay`)
+int frame_first = 0, frame_last = 0; // range of frames for this shard (see `--frames`), or 0 for all of them
+int shard_index = 0, shard_count = 0; // which of how many even shards to render (see `--shard`), or 0 for `--frames`
+int merge = 0; // check that the shards' manifests add up to the whole animation (see `--merge`)
+int dispersion = 0; // trace several wavelengths per sight line & save their anomaly curves (see `--dispersion`)
+int target = 0; // find the launch angle which hits a target, for every frame (see `--target`)
+double target_ground, target_alt; // kilometers
+const char *profile_file = NULL; // sounding profile database (see `--profile`)
+unsigned long long profile_id; // which profile to use as the baseline
+int profile_batch = 0; // run every profile in the database back to back (see `--profile-batch`)
+const char *profile_text = NULL; // text profiles to convert into a database (see `--profile-build`)
+size_t mem_limit = 0; // bytes which tracked allocations may add up to (see `--mem-limit`), or 0 for no limit
+int fps_mult = 1; // output frames per simulated time step (see `--fps-mult`)
+int keyframe_step = 1; // simulate every Nth output frame in full, and blend the ones in between (see `--keyframe-step`)
+int keyframe_check = 0; // also simulate the blended frames in full, and report how far off they were (see `--keyframe-check`)
+int full_retrace = 0; // trace the whole sight line every frame, instead of only from where the field changed (see `--full-retrace`)
+int cold_search = 0; // scatter all the way around for every refraction surface, instead of starting from the last one (see `--cold-search`)
+int perf = 0; // count cycles, instructions & misses for each stage of the frame loop (see `--perf`)
+int ensemble = 0; // number of turbulence realizations for ensemble statistics (see `--ensemble`)
+int jobs = 0; // number of worker processes (see `--jobs`), or 0 for one per CPU
+int bloop_table_size = 0; // entries in the precomputed bloop profile table (see `--stamp-table`), or 0 to use `bloop_calc()`
+int output_width = 0, output_height = 0; // size of the rendered density map (see `--output-size`), or 0 for the simulation's pixel grid
+int svg = 0; // save density maps as SVG with only the heat map as raster (see `--svg`)
+char *serve = NULL; // Unix domain socket to take scenario requests on (see `--serve`)
+regress_mode regress = REGRESS_OFF; // run the fixed regression scenario instead of an animation (see `--regress`)
+char *regress_file = NULL;
+char *isa = NULL; // instruction set for the hot kernels (see `--isa`), or NULL for the best one this CPU has
+int tile_cache = 0; // tiles of the density field to keep in memory (see `--tiles`), or 0 to keep the whole field in memory
+atmos_dump_type DUMP_TYPE = ATMOS_DUMP_F64;
 
 /*
  |  ==================
@@ -82,6 +209,15 @@ int debug = 0;
 //let's caculate some global variables based on the simulation parameters
 double WINDOW_ANGLE, WINDOW_TOP, WINDOW_RIGHT, WINDOW_LEFT, WINDOW_BOTTOM;
 int IMAGE_WIDTH, IMAGE_HEIGHT, BLOOP_NUM;
+int POLAR_WIDTH, POLAR_HEIGHT;
+int OUTPUT_WIDTH, OUTPUT_HEIGHT;
+int OUTPUT_FRAMES;
+int ENSEMBLE_BINS;
+double RETRACE_REACH;
+//number of bloops for the whole animation
+int bloop_count() {
+  return (int)round(((double)scenario.frames) * scenario.bloops_per_frame);
+}
 void global_init() {
   WINDOW_ANGLE = (WINDOW_ARC_LENGTH/EARTH_CIRCUMFERENCE) * 360.0; // degrees
   WINDOW_TOP = EARTH_RADIUS + WINDOW_ALTITUDE; // kilometers
@@ -90,7 +226,24 @@ void global_init() {
   WINDOW_BOTTOM = cos((WINDOW_ANGLE/2.0) * (PI/180.0)) * EARTH_RADIUS; // kilometers
   IMAGE_WIDTH = (int)ceil( (WINDOW_RIGHT-WINDOW_LEFT) * IMAGE_RES ); // pixels
   IMAGE_HEIGHT = (int)ceil( (WINDOW_TOP-WINDOW_BOTTOM) * IMAGE_RES ); // pixels
-  BLOOP_NUM = (int)round(((double)FRAMES) * ((double)BLOOPS_PER_FRAME));
+  BLOOP_NUM = bloop_count();
+  OUTPUT_FRAMES = (scenario.frames-1)*fps_mult + 1; // frames
+  ENSEMBLE_BINS = (int)ceil( ANOM_WINDOW_WIDTH / ENSEMBLE_BIN_WIDTH ); // distance bins of an anomaly curve (see `ensemble_curve()`)
+  RETRACE_REACH = RAY_RETRACE_MARGIN * (cos((WINDOW_ANGLE/2.0) * (PI/180.0)) + sin((WINDOW_ANGLE/2.0) * (PI/180.0))) / IMAGE_RES; // kilometers of altitude or ground (see `retrace_hit()`)
+  OUTPUT_WIDTH = (output_width > 0 ? output_width : IMAGE_WIDTH); // pixels
+  OUTPUT_HEIGHT = (output_height > 0 ? output_height : IMAGE_HEIGHT); // pixels
+  if (svg && output_width == 0) {
+    //heat map under the SVG paths doesn't need the full resolution
+    OUTPUT_WIDTH = (int)ceil( ((double)IMAGE_WIDTH) / SVG_HEAT_SCALE ); // pixels
+    OUTPUT_HEIGHT = (int)ceil( ((double)IMAGE_HEIGHT) / SVG_HEAT_SCALE ); // pixels
+  }
+  POLAR_WIDTH = (int)ceil( WINDOW_ARC_LENGTH * POLAR_RES_GROUND ) + 1; // samples
+  if (POLAR_STRETCH > 0.0) {
+    //enough rows that the bottom one is 1/POLAR_RES_ALT thick (see `polar_row_alt()`)
+    POLAR_HEIGHT = (int)ceil( WINDOW_ALTITUDE * POLAR_RES_ALT * POLAR_STRETCH / expm1(POLAR_STRETCH) ) + 1; // samples
+  } else {
+    POLAR_HEIGHT = (int)ceil( WINDOW_ALTITUDE * POLAR_RES_ALT ) + 1; // samples
+  }
 }
 
 /*
@@ -111,7 +264,11 @@ struct atmos_coord {
 struct atmos_grade_stop {
   double alt; // altitude in kilometers
   double density; // density in kg/m^3
-} atmos_grade[ATMOS_STOP_NUM];
+} atmos_standard[ATMOS_STOP_NUM]; // the standard atmosphere
+struct atmos_grade_stop *atmos_grade = atmos_standard; // current baseline: the standard atmosphere, or a profile's table (see `profile_grade()`)
+int atmos_grade_num = ATMOS_STOP_NUM; // stops in `atmos_grade`
+struct atmos_profile_db profile_db; // opened with `--profile` or `--profile-batch`
+uint64_t profile_sum = 0; // checksum of the whole database, to tell which one a cache or shard was made with
 //discrete primitives for simulating turbulence
 struct atmos_bloop {
   double x, y; //window coordinate
@@ -135,16 +292,6 @@ struct grade_stop {
 struct ray_node {
   double x, y;
 };
-struct atmos_ray {
-  struct ray_node *nodes;
-  int buffsize; //memory buffer size
-  int num; //actual number used so far
-  struct ray_node *end; //this should point to the end node
-  struct vectorC3D dir_c;
-  struct vectorP3D dir_p;
-  struct vectorP3D start_p;
-  double density;
-} sight;
 struct ray_surface {
   /*
    |  These are all angles measured in degrees, saved straight from
@@ -170,9 +317,185 @@ struct ray_search_unit {
   double norm[2];
   double score;
 };
+struct atmos_ray {
+  struct ray_node *nodes;
+  int buffsize; //memory buffer size
+  int num; //actual number used so far
+  struct ray_node *end; //this should point to the end node
+  struct vectorC3D dir_c;
+  struct vectorP3D dir_p;
+  struct vectorP3D start_p;
+  double density;
+  struct ray_search_unit last; //refraction surface found at the last step (see `ray_find_surfaces()`)
+  int warm; //whether `last` is worth starting the next search from
+} sight;
+//several rays traced side by side, each with its own refractive index (see `--dispersion`)
+struct ray_packet {
+  int lanes;
+  int ref; // lane traced with `GLADSTONEDALE_CONST`, which becomes the sight line
+  double elevation; // launch angle of every lane, in degrees above the observer's horizon
+  long double gd[RAY_MAX_LANES]; // Gladstone-Dale constant for each lane
+  struct atmos_ray ray[RAY_MAX_LANES];
+  int retrace; // pick up from the last frame's sight line (see `retrace_check()`)
+  int stream; // hand the reference lane's nodes to `ray_consumers` as they're traced
+} packet;
+//something which takes the sight line node by node, as it's traced (see `ray_consume()`)
+struct ray_consumer {
+  void (*node)(const struct atmos_ray *ray, const struct ray_node *node, int index, void *data);
+  void *data;
+} ray_consumers[RAY_MAX_CONSUMERS];
+int ray_consumer_num = 0;
+//where a bloop was stamped onto the field (see `retrace_hit()`)
+struct ray_stamp {
+  struct atmos_coord coord; // center
+  double radv, radh; // radii
+  int stamped; // 0 if it was outside the window
+};
+struct ray_stamp *bloop_stamps; // each bloop's stamp in the current field, if we're keeping track (see `bloop_apply()`)
+//what it takes to carry on tracing from a node
+struct ray_step {
+  struct vectorC3D dir_c;
+  struct vectorP3D dir_p;
+  double density;
+  struct ray_search_unit last;
+  int warm;
+};
+//the last frame's sight line, step by step (see `retrace_check()`)
+struct ray_history {
+  struct ray_node *nodes;
+  struct ray_step *steps;
+  struct ray_stamp *stamps; // `bloop_stamps` of the field it was traced through
+  int num; // nodes, or 0 if there's nothing to go on
+  int keep; // nodes still good in the current field
+  long reused, traced; // nodes over the whole run
+} history;
+
+//atmspheric density field, in kg/m^3 (see `atmos_index()` for the layout)
+double *atmos_data;
+double *atmos_base; //copy of the baseline field, if kept (see `atmos_reset()`)
+double *baseline_alt; //scratch row of altitudes (see `atmos_fill_baseline()`)
+/*
+ |  Same field on the altitude/ground grid, when enabled. Column `i`
+ |  is at ground point `i/POLAR_RES_GROUND`, and row `j` is at
+ |  altitude `polar_alt[j]` (see `polar_row_alt()`), so row 0 is
+ |  ground level.
+ */
+double **polar;
+double *polar_data;
+double *polar_alt; //altitude of each row
+double *polar_base; //baseline density for each row
+
+/*
+ |  =================
+ |  MEMORY ACCOUNTING
+ |  =================
+ */
 
-//atmspheric density field, in kg/m^3
-double **atmos;
+/*
+ |  The big allocations are tagged by the subsystem they belong to, so
+ |  we can report current & peak usage of each (see `mem_report()`),
+ |  and refuse allocations past `--mem-limit` instead of finding out
+ |  by crashing. Heap blocks carry their size & tag in a small header
+ |  in front, so `mem_free()` knows what to take off the books; memory
+ |  from elsewhere (mapped tiles, SDL surfaces) is counted with
+ |  `mem_count()` directly.
+ */
+typedef enum {
+  MEM_FIELD = 0, // density fields & their scratch rows (see `atmos_init()`)
+  MEM_IMAGE = 1, // overlay buffers for rendering (see `img_init()`)
+  MEM_RAY = 2, // sight line nodes (see `ray_init()`)
+  MEM_BLOOP = 3, // bloops & their profile table (see `bloop_init()`)
+  MEM_SURFACE = 4, // SDL surfaces
+  MEM_TAGS = 5
+} mem_tag;
+const char *MEM_TAG_NAMES[MEM_TAGS] = {"field", "images", "ray", "bloops", "surfaces"};
+struct mem_tally {
+  size_t current, peak; // bytes
+} mem_tally[MEM_TAGS], mem_total;
+//header in front of every tracked heap block (16 bytes, so the block behind it stays aligned)
+struct mem_block {
+  size_t size;
+  size_t tag;
+};
+//add (or take off) the given number of bytes
+void mem_count(mem_tag tag, long long delta) {
+  mem_tally[tag].current += delta;
+  mem_tally[tag].peak = MAX(mem_tally[tag].peak, mem_tally[tag].current);
+  mem_total.current += delta;
+  mem_total.peak = MAX(mem_total.peak, mem_total.current);
+  return;
+}
+//would this many more bytes go past the limit?
+int mem_over(size_t bytes) {
+  return (mem_limit > 0 && mem_total.current + bytes > mem_limit);
+}
+//tracked `calloc()`, which fails with ENOMEM past the limit
+void *mem_calloc(mem_tag tag, size_t size, size_t num) {
+  struct mem_block *b;
+  size_t bytes = size*num;
+  if (mem_over(bytes)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if ((b = (struct mem_block *)calloc(1, sizeof(struct mem_block) + bytes)) == NULL) {
+    return NULL;
+  }
+  b->size = bytes;
+  b->tag = tag;
+  mem_count(tag, bytes);
+  return (void *)(b+1);
+}
+//tracked `realloc()` of a block from `mem_calloc()` (the old block is kept if it fails)
+void *mem_realloc(void *ptr, size_t bytes) {
+  struct mem_block *b = ((struct mem_block *)ptr)-1;
+  size_t old = b->size;
+  if (bytes > old && mem_over(bytes - old)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if ((b = (struct mem_block *)realloc(b, sizeof(struct mem_block) + bytes)) == NULL) {
+    return NULL;
+  }
+  b->size = bytes;
+  mem_count((mem_tag)b->tag, (long long)bytes - (long long)old);
+  return (void *)(b+1);
+}
+//tracked `free()` of a block from `mem_calloc()`
+void mem_free(void *ptr) {
+  struct mem_block *b;
+  if (ptr == NULL) {
+    return;
+  }
+  b = ((struct mem_block *)ptr)-1;
+  mem_count((mem_tag)b->tag, -(long long)b->size);
+  free(b);
+  return;
+}
+//count a new SDL surface (passed through, so it can wrap the call that made it)
+SDL_Surface *mem_surface(SDL_Surface *s) {
+  if (s != NULL) {
+    mem_count(MEM_SURFACE, (long long)s->pitch*s->h);
+  }
+  return s;
+}
+//free an SDL surface counted with `mem_surface()`
+void mem_surface_free(SDL_Surface *s) {
+  if (s != NULL) {
+    mem_count(MEM_SURFACE, -(long long)s->pitch*s->h);
+  }
+  SDL_FreeSurface(s);
+  return;
+}
+//print current & peak usage of every subsystem
+void mem_report(FILE *fp) {
+  int t;
+  fprintf(fp, "Memory (MiB)    current       peak\n");
+  for (t=0; t < MEM_TAGS; t++) {
+    fprintf(fp, "  %-10s %10.1lf %10.1lf\n", MEM_TAG_NAMES[t], mem_tally[t].current/1048576.0, mem_tally[t].peak/1048576.0);
+  }
+  fprintf(fp, "  %-10s %10.1lf %10.1lf\n", "total", mem_total.current/1048576.0, mem_total.peak/1048576.0);
+  return;
+}
 
 /*
  |  ===================
@@ -180,9 +503,68 @@ double **atmos;
  |  ===================
  */
 
+/*
+ |  Random numbers come from Philox4x32-10, a counter-based
+ |  generator. Every number is a pure function of (key, counter), so
+ |  independent streams can be handed out by key and give the same
+ |  results no matter how many processes share the work, or which C
+ |  library they were built against. Seed, stream & count of numbers
+ |  drawn are enough to restore a stream. See:
+ |    - https://www.thesalmons.org/john/random123/papers/random123sc11.pdf
+ */
+unsigned long rng_draws = 0;
+uint32_t rng_key[2]; // philox key: seed & stream index
+//one Philox4x32-10 block: 4 random words for the given counter & key
+void philox4x32(uint32_t ctr[4], const uint32_t key[2]) {
+  uint32_t k0 = key[0], k1 = key[1];
+  uint32_t hi0, lo0, hi1, lo1;
+  uint64_t prod;
+  int round;
+  for (round=0; round < 10; round++) {
+    prod = (uint64_t)0xD2511F53 * ctr[0];
+    hi0 = (uint32_t)(prod >> 32);
+    lo0 = (uint32_t)prod;
+    prod = (uint64_t)0xCD9E8D57 * ctr[2];
+    hi1 = (uint32_t)(prod >> 32);
+    lo1 = (uint32_t)prod;
+    ctr[0] = hi1 ^ ctr[1] ^ k0;
+    ctr[1] = lo1;
+    ctr[2] = hi0 ^ ctr[3] ^ k1;
+    ctr[3] = lo0;
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+  return;
+}
 //generate a random floating point between 0 and 1
 long double rng(void) {
-  return ((long double)rand())/((long double)RAND_MAX);
+  uint32_t ctr[4];
+  uint64_t bits;
+  //each block gives two draws of 53 bits
+  ctr[0] = (uint32_t)(rng_draws >> 1);
+  ctr[1] = (uint32_t)((uint64_t)rng_draws >> 33);
+  ctr[2] = ctr[3] = 0;
+  philox4x32(ctr,rng_key);
+  if (rng_draws & 1) {
+    bits = ((uint64_t)ctr[2] << 32) | ctr[3];
+  } else {
+    bits = ((uint64_t)ctr[0] << 32) | ctr[1];
+  }
+  rng_draws++;
+  return ((long double)(bits >> 11))/((long double)(((uint64_t)1 << 53) - 1));
+}
+//restore random number stream to the given seed & position (on the stream we're already on)
+void rng_seek(unsigned int seed, unsigned long draws) {
+  rng_key[0] = seed;
+  rng_draws = draws;
+  return;
+}
+//switch to the stream with the given seed & stream index
+void rng_stream(unsigned int seed, unsigned int stream) {
+  rng_key[0] = seed;
+  rng_key[1] = stream;
+  rng_draws = 0;
+  return;
 }
 /*
  |  We're using this for approximating a standard atmospheric
@@ -206,12 +588,13 @@ void pixel_insert(struct SDL_Surface *s, struct pixel p, int x, int y) {
   ((Uint8 *)s->pixels)[y*s->pitch+x*3+(s->format->Gshift/8)] = (Uint8)(255.0*fmax(0,fmin(1,p.g)));
   ((Uint8 *)s->pixels)[y*s->pitch+x*3+(s->format->Bshift/8)] = (Uint8)(255.0*fmax(0,fmin(1,p.b)));
 }
-//calculate color ramp for density heat map
-void density_to_color(struct pixel *pix, double density, int x, int y) {
-  int stop_num = 5;
-  struct grade_stop grade[stop_num], *floor, *ceil;
-  int i;
-  double frac;
+//color ramp for density heat map
+#define COLOR_STOP_NUM 5
+struct grade_stop color_ramp[COLOR_STOP_NUM];
+//fill in the color ramp (once, at startup)
+void color_ramp_init() {
+  int stop_num = COLOR_STOP_NUM;
+  struct grade_stop *grade = color_ramp;
   /*
    | This color ramp data is a bit hard-wired, but hey it works.
    */
@@ -225,12 +608,19 @@ void density_to_color(struct pixel *pix, double density, int x, int y) {
   grade[3].color.r = 0.20; grade[3].color.g = 0.20; grade[3].color.b = 0.00;
   grade[4].val = (4.0/(stop_num-1))*DENSITY_MAX;
   grade[4].color.r = 0.20; grade[4].color.g = 0.04; grade[4].color.b = 0.00;
-  for (i=0; i < stop_num; i++) {
-    floor = &(grade[i]);
-    if (i == (stop_num-1)) {
-      ceil = &(grade[i]);
+  return;
+}
+//calculate color ramp for density heat map
+void density_to_color(struct pixel *pix, double density, int x, int y) {
+  struct grade_stop *floor, *ceil;
+  int i;
+  double frac;
+  for (i=0; i < COLOR_STOP_NUM; i++) {
+    floor = &(color_ramp[i]);
+    if (i == (COLOR_STOP_NUM-1)) {
+      ceil = &(color_ramp[i]);
     } else {
-      ceil = &(grade[i+1]);
+      ceil = &(color_ramp[i+1]);
     }
     if (density >= floor->val && density <= ceil->val) {
       frac = (density - floor->val)/(ceil->val - floor->val);
@@ -271,17 +661,38 @@ int vector_compare(double r, double a, double b) {
     return 1;
   }
 }
+//halfway between two angles in degrees, the short way around (so 350 & 10 give 0, not 180)
+double angle_midpoint(double a, double b) {
+  double mid = (a+b)/2.0;
+  if (fabs(a-b) > 180.0) {
+    mid += (mid >= 180.0 ? -180.0 : 180.0);
+  }
+  return mid;
+}
+//free temporary image buffer (if there is one)
+void img_free(double **img, int height) {
+  int y;
+  if (img == NULL) {
+    return;
+  }
+  for (y=0; y < height; y++) {
+    mem_free(img[y]);
+  }
+  mem_free(img);
+  return;
+}
 //allocate temporary image buffer
 double **img_init(int width, int height) {
   double **img;
   int x, y;
-  if ((img = (double **)calloc(sizeof(double *), height)) == NULL) {
+  if ((img = (double **)mem_calloc(MEM_IMAGE, sizeof(double *), height)) == NULL) {
     fprintf(stderr, "calloc(): %s\n", strerror(errno));
     return NULL;
   }
   for (y=0; y < height; y++) {
-    if ((img[y] = (double *)calloc(sizeof(double), width)) == NULL) {
+    if ((img[y] = (double *)mem_calloc(MEM_IMAGE, sizeof(double), width)) == NULL) {
       fprintf(stderr, "calloc(): %s\n", strerror(errno));
+      img_free(img,y);
       return NULL;
     }
     for (x=0; x < width; x++) {
@@ -290,15 +701,6 @@ double **img_init(int width, int height) {
   }
   return img;
 }
-//free temporary image buffer
-void img_free(double **img, int height) {
-  int y;
-  for (y=0; y < height; y++) {
-    free(img[y]);
-  }
-  free(img);
-  return;
-}
 //make sure the given folder exists
 int mkdir_safe(const char *folder) {
   struct stat dir;
@@ -320,120 +722,922 @@ int mkdir_safe(const char *folder) {
   }
   return 0;
 }
+/*
+ |  Check whether the given PNG file was completely written, by
+ |  looking for the IEND chunk that has to close every PNG file.
+ |  - returns 1 for complete, 0 for missing or truncated
+ */
+int png_complete(const char *file) {
+  const unsigned char iend[12] = {0x00,0x00,0x00,0x00,'I','E','N','D',0xAE,0x42,0x60,0x82};
+  unsigned char tail[12];
+  FILE *fp;
+  int ok = 0;
+  if ((fp = fopen(file, "rb")) == NULL) {
+    return 0;
+  }
+  if (fseek(fp, -12L, SEEK_END) == 0 && fread(tail, 1, 12, fp) == 12) {
+    ok = (memcmp(tail, iend, 12) == 0);
+  }
+  fclose(fp);
+  return ok;
+}
+//save SDL image as PNG file, via temp file so that a partial image never carries the final name
+int png_save(struct SDL_Surface *s, const char *file) {
+  char temp[MAX_STR];
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if (IMG_SavePNG(s,temp) != 0) {
+    fprintf(stderr, "IMG_SavePNG() on '%s' failed\n", temp);
+    unlink(temp);
+    return -1;
+  }
+  if (rename(temp,file) != 0) {
+    fprintf(stderr, "rename() on '%s': %s\n", temp, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+
+//64-bit FNV-1a hash of some bytes, continuing from `hash` (start from CHECKSUM_INIT)
+uint64_t checksum_update(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  size_t i;
+  for (i=0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+//checksum & size of a whole file
+int checksum_file(const char *file, uint64_t *hash, long *size) {
+  unsigned char buff[65536];
+  size_t len;
+  FILE *fp;
+  if ((fp = fopen(file, "rb")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", file, strerror(errno));
+    return -1;
+  }
+  hash[0] = CHECKSUM_INIT;
+  size[0] = 0;
+  while ((len = fread(buff, 1, sizeof(buff), fp)) > 0) {
+    hash[0] = checksum_update(hash[0],buff,len);
+    size[0] += (long)len;
+  }
+  fclose(fp);
+  return 0;
+}
+//seconds on a monotonic clock
+double clock_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
 
 /*
- |  ======================
- |  RENDER SPACE UTILITIES
- |  ======================
+ |  ====================
+ |  PERFORMANCE COUNTERS
+ |  ====================
  */
 
-//calculate altitude & ground point of the given window point
-void atmos_coords(double x, double y, struct atmos_coord *coord) {
-  struct vectorC3D c;
-  struct vectorP3D p;
-  c.x = (x/IMAGE_WIDTH)*(WINDOW_RIGHT-WINDOW_LEFT) + WINDOW_LEFT;
-  c.y = 0.0;
-  c.z = ((IMAGE_HEIGHT-y)/IMAGE_HEIGHT)*(WINDOW_TOP-WINDOW_BOTTOM) + WINDOW_BOTTOM;
-  vectorP3D_assign(&p,vectorC3D_polar(c));
-  coord->alt = p.l - EARTH_RADIUS;
-  coord->ground = ( (90.0 - p.y + (WINDOW_ANGLE/2.0)) / WINDOW_ANGLE ) * WINDOW_ARC_LENGTH;
-  return;
+/*
+ |  With `--perf`, each stage of the frame loop is wrapped in
+ |  `perf_start()` & `perf_stop()`, which read the CPU's counters for
+ |  this process (user space only) and add up the difference. The
+ |  report gives instructions per cycle, plus cache & branch misses
+ |  per unit of work: field samples for the stages which sweep the
+ |  field, ray nodes for the sight line and output pixels for
+ |  rendering.
+ |
+ |  Counters are often not permitted (`perf_event_paranoid`, or a
+ |  virtual machine without a PMU). Whichever can't be opened are
+ |  left out, and if none can, we still report wall time.
+ */
+typedef enum {
+  PERF_RESET = 0, // back to the baseline field (see `atmos_reset()`)
+  PERF_BLOOPS = 1, // stamping turbulence (see `bloop_apply_all()`)
+  PERF_RESAMPLE = 2, // polar field back to the pixel grid (see `polar_resample()`)
+  PERF_TRACE = 3, // sampling the field along the sight line (see `ray_trace()`)
+  PERF_RENDER = 4, // compositing & saving output (see `frame_render()`)
+  PERF_STAGES = 5
+} perf_stage;
+typedef enum {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS = 1,
+  PERF_LLC_MISSES = 2,
+  PERF_BRANCH_MISSES = 3,
+  PERF_COUNTERS = 4
+} perf_counter;
+const char *PERF_STAGE_NAMES[PERF_STAGES] = {"reset", "bloops", "resample", "trace", "render"};
+const char *PERF_STAGE_UNITS[PERF_STAGES] = {"sample", "sample", "pixel", "node", "pixel"};
+const char *PERF_COUNTER_NAMES[PERF_COUNTERS] = {"cycles", "instructions", "LLC misses", "branch misses"};
+const unsigned long long PERF_COUNTER_CONFIG[PERF_COUNTERS] = {
+  PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+int perf_fd[PERF_COUNTERS]; // -1 if not available
+struct perf_tally {
+  double seconds, count[PERF_COUNTERS];
+  double units; // work done, in PERF_STAGE_UNITS
+  int runs;
+  //readings at `perf_start()`
+  double start_seconds, start[PERF_COUNTERS];
+} perf_tally[PERF_STAGES];
+
+//current value of a counter, scaled up if the kernel had to share it with others
+double perf_read(int fd) {
+  uint64_t v[3]; // value, time enabled, time running
+  if (read(fd, v, sizeof(v)) != sizeof(v) || v[2] == 0) {
+    return 0.0;
+  }
+  return (double)v[0] * ((double)v[1] / (double)v[2]);
 }
-//calculate window point from altitude & ground point (and save vectors if non-null pointers are provided)
-void atmos_window(double *x, double *y, struct atmos_coord *coord, struct vectorC3D *res_c, struct vectorP3D *res_p) {
-  struct vectorC3D c;
-  struct vectorP3D p;
-  p.l = coord->alt + EARTH_RADIUS;
-  p.x = 0.0;
-  p.y = 90.0 - ( (coord->ground/WINDOW_ARC_LENGTH) * WINDOW_ANGLE ) + (WINDOW_ANGLE/2.0);
-  vectorC3D_assign(&c,vectorP3D_cartesian(p));
-  x[0] = ((c.x-WINDOW_LEFT)/(WINDOW_RIGHT-WINDOW_LEFT)) * IMAGE_WIDTH;
-  y[0] = (1.0 - (c.z-WINDOW_BOTTOM)/(WINDOW_TOP-WINDOW_BOTTOM)) * IMAGE_HEIGHT;
-  //optionally save intermediate vectors
-  if (res_c != NULL) {
-    vectorC3D_assign(res_c,c);
+//open whichever counters we're allowed to (returns how many)
+int perf_init() {
+  struct perf_event_attr attr;
+  int c, num = 0, err[PERF_COUNTERS];
+  memset(perf_tally, 0, sizeof(perf_tally));
+  for (c=0; c < PERF_COUNTERS; c++) {
+    memset(&attr, 0, sizeof(struct perf_event_attr));
+    attr.size = sizeof(struct perf_event_attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNTER_CONFIG[c];
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    if ((perf_fd[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)) == -1) {
+      err[c] = errno;
+    } else {
+      num++;
+    }
   }
-  if (res_p != NULL) {
-    vectorP3D_assign(res_p,p);
+  if (num == 0) {
+    fprintf(stderr, "No performance counters available (%s); reporting wall time only\n", strerror(err[PERF_CYCLES]));
+    return 0;
   }
+  for (c=0; c < PERF_COUNTERS; c++) {
+    if (perf_fd[c] == -1) {
+      fprintf(stderr, "Leaving out %s: %s\n", PERF_COUNTER_NAMES[c], strerror(err[c]));
+    }
+  }
+  return num;
+}
+//a stage is starting
+void perf_start(perf_stage stage) {
+  struct perf_tally *t = &(perf_tally[stage]);
+  int c;
+  if (!perf) {
+    return;
+  }
+  for (c=0; c < PERF_COUNTERS; c++) {
+    t->start[c] = (perf_fd[c] != -1 ? perf_read(perf_fd[c]) : 0.0);
+  }
+  t->start_seconds = clock_seconds();
   return;
 }
-//interpolate values for fractional window coordinates
-double atmos_val(double x, double y, atmos_interpolation_type type) {
-  double tl, tr, bl, br;
-  int top, left, bottom, right;
-  double fracx, fracy;
-  double wtl, wtr, wbl, wbr;
-  double end_left, end_right;
-  double final;
-  //sanity check
-  if (x < 0.5 || x > IMAGE_WIDTH-0.5 || y < 0.5 || y > IMAGE_WIDTH-0.5) {
-    return 0.0;
+//a stage is done, having worked on the given number of units
+void perf_stop(perf_stage stage, double units) {
+  struct perf_tally *t = &(perf_tally[stage]);
+  int c;
+  if (!perf) {
+    return;
   }
-  //check for lucky cases when we can skip the fancy math
-  if (x == (double)((int)x) && y == (double)((int)y)) {
-    return atmos[(int)y][(int)x];
+  t->seconds += clock_seconds() - t->start_seconds;
+  for (c=0; c < PERF_COUNTERS; c++) {
+    if (perf_fd[c] != -1) {
+      t->count[c] += perf_read(perf_fd[c]) - t->start[c];
+    }
   }
-  
-  //okay, gotta do the work ...
-  
-  //safe array indices
-  top = MAX(0,MIN((IMAGE_HEIGHT-1), (int)floor(y) ));
-  left = MAX(0,MIN((IMAGE_WIDTH-1), (int)floor(x) ));
-  bottom = MAX(0,MIN((IMAGE_HEIGHT-1), (int)ceil(y) ));
-  right = MAX(0,MIN((IMAGE_WIDTH-1), (int)ceil(x) ));
-  //values for corners of fractional region
-  tl = atmos[top][left];
-  tr = atmos[top][right];
-  bl = atmos[bottom][left];
-  br = atmos[bottom][right];
-  //components of position in fractional region
-  fracx = x-floor(x);
-  fracy = y-floor(y);
-  //which interpolation type are we using?
-  switch (type) {
-    case ATMOS_WEIGHTED_AVERAGE:
-      wtl = (1.0-fracx)*(1.0-fracy);
-      wtr = fracx*(1.0-fracy);
-      wbl = (1.0-fracx)*fracy;
-      wbr = fracx*fracy;
-      final = tl*wtl + tr*wtr + bl*wbl + br*wbr;
-    break;
-    case ATMOS_BILINEAR:
-      end_left = (bl-tl)*fracy + tl;
-      end_right = (br-tr)*fracy + tr;
-      final = (end_right - end_left)*fracx + end_left;
-    break;
+  t->units += units;
+  t->runs++;
+  return;
+}
+//print a table of what each stage cost
+void perf_report(FILE *fp) {
+  struct perf_tally *t;
+  int s, c;
+  fprintf(fp, "Stage        runs    seconds      IPC  LLC miss/unit  branch miss/unit\n");
+  for (s=0; s < PERF_STAGES; s++) {
+    t = &(perf_tally[s]);
+    if (t->runs == 0) {
+      continue;
+    }
+    fprintf(fp, "  %-9s %5d %10.3lf", PERF_STAGE_NAMES[s], t->runs, t->seconds);
+    if (perf_fd[PERF_CYCLES] != -1 && perf_fd[PERF_INSTRUCTIONS] != -1 && t->count[PERF_CYCLES] > 0.0) {
+      fprintf(fp, " %8.2lf", t->count[PERF_INSTRUCTIONS]/t->count[PERF_CYCLES]);
+    } else {
+      fprintf(fp, " %8s", "-");
+    }
+    for (c=PERF_LLC_MISSES; c <= PERF_BRANCH_MISSES; c++) {
+      if (perf_fd[c] != -1 && t->units > 0.0) {
+        fprintf(fp, " %14.4lf", t->count[c]/t->units);
+      } else {
+        fprintf(fp, " %14s", "-");
+      }
+    }
+    fprintf(fp, "  (per %s)\n", PERF_STAGE_UNITS[s]);
   }
-  return final;
+  return;
 }
-//are we in bounds?
-int atmos_bounds(double x, double y) {
-  struct atmos_coord coord;
-  atmos_coords(x,y,&coord);
-  if (coord.ground < 0.0 || coord.ground > WINDOW_ARC_LENGTH ||
-      coord.alt < 0.0 || coord.alt > WINDOW_ALTITUDE) {
-    return 0;
+//close the counters
+void perf_free() {
+  int c;
+  for (c=0; c < PERF_COUNTERS; c++) {
+    if (perf_fd[c] != -1) {
+      close(perf_fd[c]);
+      perf_fd[c] = -1;
+    }
   }
-  return 1;
+  return;
 }
 
 /*
- |  =====================
- |  SIMULATING TURBULENCE
- |  =====================
+ |  ===========
+ |  HOT KERNELS
+ |  ===========
+ */
+/*
+ |  The innermost loops of the simulation are each written once, as
+ |  the `*_kernel()` bodies below, and then compiled several times
+ |  over for different instruction sets (see `KERNEL_VARIANT()`). The
+ |  binary as a whole is still built for the baseline instruction
+ |  set, so it runs anywhere; `kernels_init()` asks the CPU at startup
+ |  which variants it can run, and points `kernels` at the widest one
+ |  (or at the one asked for with `--isa`).
+ |  
+ |  All variants give bit-for-bit the same results. The bodies are
+ |  element-wise loops without any reordered sums, and contraction
+ |  of multiply & add into one fused instruction is turned off, so a
+ |  wider instruction set only changes how many elements go through
+ |  at once.
+ |  
+ |  Clamping is written as comparisons rather than `fmin()` &
+ |  `fmax()`, which would be library calls in the middle of the loop;
+ |  the comparisons give the same results (NaN included), and map
+ |  straight onto vector min & max instructions. Whatever gets
+ |  assigned through a pointer is kept in a local first, or GCC won't
+ |  turn the branches into selects.
  */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_DISPATCH 1
+#else
+#define KERNEL_DISPATCH 0
+#endif
+#if defined(__GNUC__) && !defined(__clang__)
+#define KERNEL_OPTIMIZE __attribute__((optimize("O3", "fp-contract=off", "no-trapping-math")))
+#define KERNEL_BODY static inline __attribute__((always_inline)) KERNEL_OPTIMIZE
+#elif defined(__GNUC__)
+#pragma STDC FP_CONTRACT OFF
+#define KERNEL_BODY static inline __attribute__((always_inline))
+#define KERNEL_OPTIMIZE
+#else
+#define KERNEL_BODY static inline
+#define KERNEL_OPTIMIZE
+#endif
 
-//generate random bloops
-int bloop_init() {
-  struct atmos_bloop *bloop;
-  struct atmos_coord coord, coord_start, coord_end;
-  double temp;
-  int i;
-  if ((bloop_list = (struct atmos_bloop *)calloc(sizeof(struct atmos_bloop), BLOOP_NUM)) == NULL) {
-    fprintf(stderr, "calloc(): %s\n", strerror(errno));
-    return -1;
-  }
+//set a row of the field to the baseline gradient, for the given altitudes (see `atmos_baseline_alt()`)
+KERNEL_BODY void baseline_row_kernel(double *restrict out, const double *restrict alt, int num, const struct atmos_grade_stop *grade, int stops) {
+  const struct atmos_grade_stop *floor, *ceil;
+  double a, frac, val;
+  int x, i, k;
+  for (x=0; x < num; x++) {
+    a = alt[x];
+    //the stop just below, counted instead of searched for
+    i = 0;
+    for (k=1; k < stops-1; k++) {
+      i += (a > grade[k].alt);
+    }
+    floor = &(grade[i]);
+    ceil = &(grade[i+1]);
+    frac = (a - floor->alt)/(ceil->alt - floor->alt);
+    val = (ceil->density - floor->density)*frac + floor->density;
+    out[x] = (a < grade[0].alt ? grade[0].density : (a > grade[stops-1].alt ? grade[stops-1].density : val));
+  }
+  return;
+}
+//multiply a row of the field by the bloop profile at the given squared distances (see `bloop_profile()`)
+KERNEL_BODY void bloop_stamp_kernel(double *restrict row, const double *restrict q, int num, double amp, const double *restrict table, int size) {
+  double f;
+  int x, k;
+  for (x=0; x < num; x++) {
+    f = q[x];
+    f = (f < 1.0 ? f : 1.0)*(size-1);
+    k = (int)f;
+    row[x] *= fma((table[k+1] - table[k])*(f-k) + table[k], amp, 1.0);
+  }
+  return;
+}
+//bilinear samples of a flat `w` x `h` field at many points (see `atmos_val_batch()`)
+KERNEL_BODY void bilinear_kernel(const double *restrict data, long w, long h, const double *restrict xs, const double *restrict ys, double *restrict out, int num) {
+  double fx, fy, fracx, fracy;
+  double tl, tr, bl, br;
+  double end_left, end_right, val;
+  int w1 = (int)w-1, h1 = (int)h-1;
+  int top, left, bottom, right;
+  int i, inside;
+  for (i=0; i < num; i++) {
+    fx = xs[i];
+    fy = ys[i];
+    inside = (fx >= 0.5) & (fx <= w-0.5) & (fy >= 0.5) & (fy <= h-0.5);
+    fx = (fx > 0.0 ? fx : 0.0);
+    fx = (fx < w1 ? fx : w1);
+    fy = (fy > 0.0 ? fy : 0.0);
+    fy = (fy < h1 ? fy : h1);
+    left = (int)fx;
+    top = (int)fy;
+    right = left+1;
+    right = (right < w1 ? right : w1);
+    bottom = top+1;
+    bottom = (bottom < h1 ? bottom : h1);
+    fracx = fx - trunc(fx);
+    fracy = fy - trunc(fy);
+    tl = data[top*w+left];
+    tr = data[top*w+right];
+    bl = data[bottom*w+left];
+    br = data[bottom*w+right];
+    end_left = (bl-tl)*fracy + tl;
+    end_right = (br-tr)*fracy + tr;
+    val = (end_right - end_left)*fracx + end_left;
+    out[i] = (inside ? val : 0.0);
+  }
+  return;
+}
+/*
+ |  Density interval (between contour lines) of each value, or -1 if
+ |  none. Since the lines are in increasing order, the interval is
+ |  just how many of them the value is above.
+ */
+KERNEL_BODY void contour_band_kernel(const double *restrict vals, int *restrict bands, int num, const struct atmos_contour *lines, int line_num) {
+  int i, k, count;
+  for (i=0; i < num; i++) {
+    count = 0;
+    for (k=0; k < line_num; k++) {
+      count += (vals[i] > lines[k].density);
+    }
+    bands[i] = ((vals[i] > -1.0) & (count < line_num) ? count : -1);
+  }
+  return;
+}
+/*
+ |  Composite one row of the density map into 24-bit pixels (see
+ |  `density_map_render()` for the layers). `offset` gives the byte
+ |  offset of red, green & blue within each pixel.
+ */
+KERNEL_BODY void composite_row_kernel(uint8_t *restrict dst, const int *restrict offset, const double *restrict density, const int *restrict inside, const int *restrict contour, const double *restrict line, const double *restrict ray, int num, const struct grade_stop *ramp, int stops) {
+  const struct grade_stop *floor, *ceil;
+  double d, frac, r, g, b;
+  int x, i, k, valid;
+  for (x=0; x < num; x++) {
+    //density colors, or warning color if out of range (see `density_to_color()`)
+    d = density[x];
+    i = 0;
+    for (k=1; k < stops-1; k++) {
+      i += (d > ramp[k].val);
+    }
+    floor = &(ramp[i]);
+    ceil = &(ramp[i+1]);
+    frac = (d - floor->val)/(ceil->val - floor->val);
+    valid = (d >= ramp[0].val) & (d <= ramp[stops-1].val);
+    r = (valid ? (ceil->color.r-floor->color.r)*frac + floor->color.r : 1.0);
+    g = (valid ? (ceil->color.g-floor->color.g)*frac + floor->color.g : 0.0);
+    b = (valid ? (ceil->color.b-floor->color.b)*frac + floor->color.b : 1.0);
+    //contour lines
+    r = (contour[x] ? r + 0.3 : r);
+    g = (contour[x] ? g + 0.3 : g);
+    b = (contour[x] ? b + 0.3 : b);
+    //straight line reference
+    r += line[x]*1.0;
+    g += line[x]*0.3;
+    b += line[x]*0.0;
+    //sight line
+    r += ray[x];
+    g += ray[x];
+    b += ray[x];
+    //outside window, everything is black
+    r = (inside[x] ? r : 0.0);
+    g = (inside[x] ? g : 0.0);
+    b = (inside[x] ? b : 0.0);
+    //clamp to [0,1] like `pixel_insert()`
+    r = (r < 1.0 ? r : 1.0);
+    g = (g < 1.0 ? g : 1.0);
+    b = (b < 1.0 ? b : 1.0);
+    dst[x*3+offset[0]] = (uint8_t)(255.0*(r > 0.0 ? r : 0.0));
+    dst[x*3+offset[1]] = (uint8_t)(255.0*(g > 0.0 ? g : 0.0));
+    dst[x*3+offset[2]] = (uint8_t)(255.0*(b > 0.0 ? b : 0.0));
+  }
+  return;
+}
+
+//one compiled set of the kernels above
+struct atmos_kernels {
+  const char *name;
+  void (*baseline_row)(double *out, const double *alt, int num, const struct atmos_grade_stop *grade, int stops);
+  void (*bloop_stamp)(double *row, const double *q, int num, double amp, const double *table, int size);
+  void (*bilinear)(const double *data, long w, long h, const double *xs, const double *ys, double *out, int num);
+  void (*contour_band)(const double *vals, int *bands, int num, const struct atmos_contour *lines, int line_num);
+  void (*composite_row)(uint8_t *dst, const int *offset, const double *density, const int *inside, const int *contour, const double *line, const double *ray, int num, const struct grade_stop *ramp, int stops);
+};
+//compile every kernel with the given function attributes, as `kernels_<isa>`
+#define KERNEL_VARIANT(isa, attr) \
+  attr void baseline_row_##isa(double *out, const double *alt, int num, const struct atmos_grade_stop *grade, int stops) { \
+    baseline_row_kernel(out,alt,num,grade,stops); \
+  } \
+  attr void bloop_stamp_##isa(double *row, const double *q, int num, double amp, const double *table, int size) { \
+    bloop_stamp_kernel(row,q,num,amp,table,size); \
+  } \
+  attr void bilinear_##isa(const double *data, long w, long h, const double *xs, const double *ys, double *out, int num) { \
+    bilinear_kernel(data,w,h,xs,ys,out,num); \
+  } \
+  attr void contour_band_##isa(const double *vals, int *bands, int num, const struct atmos_contour *lines, int line_num) { \
+    contour_band_kernel(vals,bands,num,lines,line_num); \
+  } \
+  attr void composite_row_##isa(uint8_t *dst, const int *offset, const double *density, const int *inside, const int *contour, const double *line, const double *ray, int num, const struct grade_stop *ramp, int stops) { \
+    composite_row_kernel(dst,offset,density,inside,contour,line,ray,num,ramp,stops); \
+  } \
+  const struct atmos_kernels kernels_##isa = { \
+    #isa, baseline_row_##isa, bloop_stamp_##isa, bilinear_##isa, contour_band_##isa, composite_row_##isa \
+  };
+KERNEL_VARIANT(generic, KERNEL_OPTIMIZE)
+#if KERNEL_DISPATCH
+KERNEL_VARIANT(avx2, __attribute__((target("avx2,fma"))) KERNEL_OPTIMIZE)
+KERNEL_VARIANT(avx512, __attribute__((target("avx512f"))) KERNEL_OPTIMIZE)
+#endif
+//every variant in this build, narrowest first
+const struct atmos_kernels *kernel_variants[] = {
+  &kernels_generic,
+#if KERNEL_DISPATCH
+  &kernels_avx2,
+  &kernels_avx512,
+#endif
+  NULL
+};
+struct atmos_kernels kernels; //the variant in use (see `kernels_init()`)
+//can this CPU run the given variant?
+int kernels_supported(const struct atmos_kernels *k) {
+#if KERNEL_DISPATCH
+  __builtin_cpu_init();
+  if (k == &kernels_avx2) {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  }
+  if (k == &kernels_avx512) {
+    return __builtin_cpu_supports("avx512f");
+  }
+#endif
+  return 1;
+}
+//pick the named kernel variant, or the widest one this CPU can run if `name` is NULL
+int kernels_init(const char *name) {
+  int i;
+  if (name == NULL) {
+    for (i=0; kernel_variants[i] != NULL; i++) {
+      if (kernels_supported(kernel_variants[i])) {
+        kernels = *(kernel_variants[i]);
+      }
+    }
+    return 0;
+  }
+  for (i=0; kernel_variants[i] != NULL; i++) {
+    if (strcmp(kernel_variants[i]->name, name) == 0) {
+      if (!kernels_supported(kernel_variants[i])) {
+        fprintf(stderr, "This CPU can't run the '%s' kernels\n", name);
+        return -1;
+      }
+      kernels = *(kernel_variants[i]);
+      return 0;
+    }
+  }
+  fprintf(stderr, "No '%s' kernels in this build; try:", name);
+  for (i=0; kernel_variants[i] != NULL; i++) {
+    fprintf(stderr, " %s", kernel_variants[i]->name);
+  }
+  fprintf(stderr, "\n");
+  return -1;
+}
+
+/*
+ |  =====================
+ |  DENSITY FIELD STORAGE
+ |  =====================
+ */
+/*
+ |  Normally the Cartesian field is one block of rows in memory. For
+ |  windows too big for that, the field can instead be cut into
+ |  square tiles, stored one after another in a memory-mapped scratch
+ |  file. We keep track of which tiles were used most recently, and
+ |  once more than `tile_cache` of them are in memory, we tell the
+ |  kernel it can drop the oldest one. Nothing is lost that way: the
+ |  tile stays in the page cache or gets written out to the scratch
+ |  file, and comes back in whenever it's touched again.
+ |  
+ |  Everything that reads or writes the field goes through
+ |  `atmos_index()`, `atmos_at()` or `atmos_span()`, so it doesn't
+ |  matter which layout is in use.
+ */
+int tiles_x, tiles_y; //number of tiles across & down
+size_t tiles_size; //bytes of scratch file mapped
+int *tile_prev, *tile_next; //tiles in memory, as a linked list from most to least recently used
+char *tile_resident; //whether each tile is on that list
+int tile_head = -1, tile_tail = -1, tile_count = 0;
+
+//offset of the given pixel within the field's storage
+size_t atmos_index(long x, long y) {
+  if (tile_cache > 0) {
+    return (
+      (((size_t)(y >> TILE_SHIFT)*tiles_x + (x >> TILE_SHIFT)) << (2*TILE_SHIFT)) +
+      ((y & (TILE_SIZE-1)) << TILE_SHIFT) + (x & (TILE_SIZE-1))
+    );
+  }
+  return (size_t)y*IMAGE_WIDTH + x;
+}
+//mark tile as just used, and let go of the least recently used one if there are too many in memory
+void atmos_tile_touch(int t) {
+  int old;
+  if (t == tile_head) {
+    return;
+  }
+  if (tile_resident[t]) {
+    //take it out of the list (it's not the head, so it has a previous one)
+    tile_next[tile_prev[t]] = tile_next[t];
+    if (tile_next[t] != -1) {
+      tile_prev[tile_next[t]] = tile_prev[t];
+    } else {
+      tile_tail = tile_prev[t];
+    }
+  } else {
+    tile_resident[t] = 1;
+    tile_count++;
+  }
+  //put it at the front
+  tile_prev[t] = -1;
+  tile_next[t] = tile_head;
+  if (tile_head != -1) {
+    tile_prev[tile_head] = t;
+  } else {
+    tile_tail = t;
+  }
+  tile_head = t;
+  //too many?
+  if (tile_count > tile_cache) {
+    old = tile_tail;
+    tile_tail = tile_prev[old];
+    tile_next[tile_tail] = -1;
+    tile_resident[old] = 0;
+    tile_count--;
+    madvise(&(atmos_data[(size_t)old << (2*TILE_SHIFT)]), sizeof(double) << (2*TILE_SHIFT), MADV_DONTNEED);
+  }
+  return;
+}
+//read one pixel of the field
+double atmos_at(int x, int y) {
+  size_t i = atmos_index(x,y);
+  if (tile_cache > 0) {
+    atmos_tile_touch((int)(i >> (2*TILE_SHIFT)));
+  }
+  return atmos_data[i];
+}
+/*
+ |  Pointer to the field at the given pixel, and how many pixels from
+ |  there to the right are stored contiguously: up to the edge of the
+ |  tile, or of the whole row if the field isn't tiled.
+ */
+double *atmos_span(int x, int y, int *len) {
+  size_t i = atmos_index(x,y);
+  if (tile_cache > 0) {
+    atmos_tile_touch((int)(i >> (2*TILE_SHIFT)));
+    len[0] = MIN(TILE_SIZE - (x & (TILE_SIZE-1)), IMAGE_WIDTH - x);
+  } else {
+    len[0] = IMAGE_WIDTH - x;
+  }
+  return &(atmos_data[i]);
+}
+//copy one row of the field
+void atmos_row(int y, double *out) {
+  double *span;
+  int x, len;
+  for (x=0; x < IMAGE_WIDTH; x += len) {
+    span = atmos_span(x,y,&len);
+    memcpy(&(out[x]), span, sizeof(double)*len);
+  }
+  return;
+}
+//set every pixel of the field from the given function, one tile at a time
+void atmos_fill(double (*f)(double x, double y)) {
+  double *span;
+  int x0, y0, x, y, len;
+  for (y0=0; y0 < IMAGE_HEIGHT; y0 += TILE_SIZE) {
+    for (x0=0; x0 < IMAGE_WIDTH; x0 += len) {
+      for (y=y0; y < MIN(y0+TILE_SIZE, IMAGE_HEIGHT); y++) {
+        span = atmos_span(x0,y,&len);
+        for (x=0; x < len; x++) {
+          span[x] = f(x0+x,y);
+        }
+      }
+    }
+  }
+  return;
+}
+//set up the tiled field in a fresh scratch file
+int atmos_tiles_alloc() {
+  char scratch[MAX_STR];
+  int fd;
+  tiles_x = (IMAGE_WIDTH + TILE_SIZE-1) >> TILE_SHIFT;
+  tiles_y = (IMAGE_HEIGHT + TILE_SIZE-1) >> TILE_SHIFT;
+  //passes over whole rows (like contour detection) work on two rows of tiles at a time
+  tile_cache = MAX(tile_cache, 2*tiles_x);
+  tiles_size = ((size_t)tiles_x*tiles_y*sizeof(double)) << (2*TILE_SHIFT);
+  //in the working directory, since /tmp is often kept in memory
+  strcpy(scratch, TILE_SCRATCH);
+  if ((fd = mkstemp(scratch)) == -1) {
+    fprintf(stderr, "mkstemp(): %s\n", strerror(errno));
+    return -1;
+  }
+  unlink(scratch);
+  if (ftruncate(fd, tiles_size) != 0) {
+    fprintf(stderr, "ftruncate() on tile scratch file: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if ((atmos_data = (double *)mmap(NULL, tiles_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "mmap() on tile scratch file: %s\n", strerror(errno));
+    atmos_data = NULL;
+    close(fd);
+    return -1;
+  }
+  //the mapping stays valid after closing
+  close(fd);
+  //only the tiles kept in memory count
+  mem_count(MEM_FIELD, (long long)tile_cache*(sizeof(double) << (2*TILE_SHIFT)));
+  if (
+    (tile_prev = (int *)mem_calloc(MEM_FIELD, sizeof(int), tiles_x*tiles_y)) == NULL ||
+    (tile_next = (int *)mem_calloc(MEM_FIELD, sizeof(int), tiles_x*tiles_y)) == NULL ||
+    (tile_resident = (char *)mem_calloc(MEM_FIELD, sizeof(char), tiles_x*tiles_y)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  tile_head = tile_tail = -1;
+  tile_count = 0;
+  return 0;
+}
+//allocate the Cartesian field, falling back to tiles if it won't fit in memory
+int atmos_data_alloc() {
+  if (tile_cache == 0) {
+    if ((atmos_data = (double *)mem_calloc(MEM_FIELD, sizeof(double), (size_t)IMAGE_WIDTH*IMAGE_HEIGHT)) != NULL) {
+      return 0;
+    }
+    fprintf(stderr, "calloc(): %s; falling back to tiled density field\n", strerror(errno));
+    tile_cache = TILE_CACHE_DEFAULT;
+  }
+  return atmos_tiles_alloc();
+}
+//free the Cartesian field
+void atmos_data_free() {
+  if (tile_cache > 0) {
+    if (atmos_data != NULL) {
+      munmap(atmos_data, tiles_size);
+      mem_count(MEM_FIELD, -(long long)tile_cache*(sizeof(double) << (2*TILE_SHIFT)));
+    }
+    mem_free(tile_prev);
+    mem_free(tile_next);
+    mem_free(tile_resident);
+  } else {
+    mem_free(atmos_data);
+  }
+  atmos_data = NULL;
+  return;
+}
+
+/*
+ |  ======================
+ |  RENDER SPACE UTILITIES
+ |  ======================
+ */
+
+//calculate altitude & ground point of the given window point
+void atmos_coords(double x, double y, struct atmos_coord *coord) {
+  struct vectorC3D c;
+  struct vectorP3D p;
+  c.x = (x/IMAGE_WIDTH)*(WINDOW_RIGHT-WINDOW_LEFT) + WINDOW_LEFT;
+  c.y = 0.0;
+  c.z = ((IMAGE_HEIGHT-y)/IMAGE_HEIGHT)*(WINDOW_TOP-WINDOW_BOTTOM) + WINDOW_BOTTOM;
+  vectorP3D_assign(&p,vectorC3D_polar(c));
+  coord->alt = p.l - EARTH_RADIUS;
+  coord->ground = ( (90.0 - p.y + (WINDOW_ANGLE/2.0)) / WINDOW_ANGLE ) * WINDOW_ARC_LENGTH;
+  return;
+}
+//same as `atmos_coords()`, but in plain double precision (for hot loops)
+void atmos_coords_fast(double x, double y, struct atmos_coord *coord) {
+  double cx, cz;
+  cx = (x/IMAGE_WIDTH)*(WINDOW_RIGHT-WINDOW_LEFT) + WINDOW_LEFT;
+  cz = ((IMAGE_HEIGHT-y)/IMAGE_HEIGHT)*(WINDOW_TOP-WINDOW_BOTTOM) + WINDOW_BOTTOM;
+  coord->alt = sqrt(cx*cx + cz*cz) - EARTH_RADIUS;
+  coord->ground = ( (90.0 - atan2(cz,cx)*180.0/PI + (WINDOW_ANGLE/2.0)) / WINDOW_ANGLE ) * WINDOW_ARC_LENGTH;
+  return;
+}
+//calculate window point from altitude & ground point (and save vectors if non-null pointers are provided)
+void atmos_window(double *x, double *y, struct atmos_coord *coord, struct vectorC3D *res_c, struct vectorP3D *res_p) {
+  struct vectorC3D c;
+  struct vectorP3D p;
+  p.l = coord->alt + EARTH_RADIUS;
+  p.x = 0.0;
+  p.y = 90.0 - ( (coord->ground/WINDOW_ARC_LENGTH) * WINDOW_ANGLE ) + (WINDOW_ANGLE/2.0);
+  vectorC3D_assign(&c,vectorP3D_cartesian(p));
+  x[0] = ((c.x-WINDOW_LEFT)/(WINDOW_RIGHT-WINDOW_LEFT)) * IMAGE_WIDTH;
+  y[0] = (1.0 - (c.z-WINDOW_BOTTOM)/(WINDOW_TOP-WINDOW_BOTTOM)) * IMAGE_HEIGHT;
+  //optionally save intermediate vectors
+  if (res_c != NULL) {
+    vectorC3D_assign(res_c,c);
+  }
+  if (res_p != NULL) {
+    vectorP3D_assign(res_p,p);
+  }
+  return;
+}
+//convert window point to the output raster (see `--output-size`)
+void output_coords(double x, double y, double *ox, double *oy) {
+  ox[0] = (OUTPUT_WIDTH == IMAGE_WIDTH ? x : (x+0.5)*OUTPUT_WIDTH/IMAGE_WIDTH - 0.5);
+  oy[0] = (OUTPUT_HEIGHT == IMAGE_HEIGHT ? y : (y+0.5)*OUTPUT_HEIGHT/IMAGE_HEIGHT - 0.5);
+  return;
+}
+/*
+ |  Altitude of the given (fractional) row of the polar field. When
+ |  stretched, rows are spaced exponentially:
+ |  
+ |    alt = WINDOW_ALTITUDE * (e^(k*u) - 1) / (e^k - 1)
+ |  
+ |  ... where `u` goes from 0 at the bottom row to 1 at the top row,
+ |  and `k` is POLAR_STRETCH.
+ */
+double polar_row_alt(double row) {
+  double u = row/(POLAR_HEIGHT-1);
+  if (POLAR_STRETCH > 0.0) {
+    return WINDOW_ALTITUDE * expm1(POLAR_STRETCH*u) / expm1(POLAR_STRETCH);
+  }
+  return WINDOW_ALTITUDE * u;
+}
+//inverse of `polar_row_alt()`, clamped to the rows we have
+double polar_alt_row(double alt) {
+  double u;
+  alt = fmax(0.0, fmin(WINDOW_ALTITUDE, alt));
+  if (POLAR_STRETCH > 0.0) {
+    u = log1p(alt*expm1(POLAR_STRETCH)/WINDOW_ALTITUDE) / POLAR_STRETCH;
+  } else {
+    u = alt/WINDOW_ALTITUDE;
+  }
+  return u*(POLAR_HEIGHT-1);
+}
+//interpolate polar field at the given altitude & ground point (clamped to the edges of the window)
+double polar_val(double ground, double alt) {
+  double fx, fracx, fracy;
+  double end_left, end_right;
+  int left, top;
+  fx = fmax(0.0, fmin(POLAR_WIDTH-1, ground*POLAR_RES_GROUND));
+  alt = fmax(0.0, fmin(WINDOW_ALTITUDE, alt));
+  left = MIN(POLAR_WIDTH-2, (int)fx);
+  top = MIN(POLAR_HEIGHT-2, (int)polar_alt_row(alt));
+  fracx = fx - left;
+  //rows may be unevenly spaced, so interpolate by actual altitude
+  fracy = (alt - polar_alt[top]) / (polar_alt[top+1] - polar_alt[top]);
+  end_left = (polar[top+1][left] - polar[top][left])*fracy + polar[top][left];
+  end_right = (polar[top+1][left+1] - polar[top][left+1])*fracy + polar[top][left+1];
+  return (end_right - end_left)*fracx + end_left;
+}
+//interpolate polar field at the given window point
+double polar_val_at(double x, double y) {
+  struct atmos_coord coord;
+  atmos_coords_fast(x,y,&coord);
+  return polar_val(coord.ground,coord.alt);
+}
+//interpolate values for fractional window coordinates
+double atmos_val(double x, double y, atmos_interpolation_type type) {
+  double tl, tr, bl, br;
+  int top, left, bottom, right;
+  double fracx, fracy;
+  double wtl, wtr, wbl, wbr;
+  double end_left, end_right;
+  double final;
+  //sanity check
+  if (x < 0.5 || x > IMAGE_WIDTH-0.5 || y < 0.5 || y > IMAGE_HEIGHT-0.5) {
+    return 0.0;
+  }
+  if (FIELD_TYPE == ATMOS_FIELD_POLAR) {
+    return polar_val_at(x,y);
+  }
+  //check for lucky cases when we can skip the fancy math
+  if (x == (double)((int)x) && y == (double)((int)y)) {
+    return atmos_at((int)x,(int)y);
+  }
+  
+  //okay, gotta do the work ...
+  
+  //safe array indices
+  top = MAX(0,MIN((IMAGE_HEIGHT-1), (int)floor(y) ));
+  left = MAX(0,MIN((IMAGE_WIDTH-1), (int)floor(x) ));
+  bottom = MAX(0,MIN((IMAGE_HEIGHT-1), (int)ceil(y) ));
+  right = MAX(0,MIN((IMAGE_WIDTH-1), (int)ceil(x) ));
+  //values for corners of fractional region
+  tl = atmos_at(left,top);
+  tr = atmos_at(right,top);
+  bl = atmos_at(left,bottom);
+  br = atmos_at(right,bottom);
+  //components of position in fractional region
+  fracx = x-floor(x);
+  fracy = y-floor(y);
+  //which interpolation type are we using?
+  switch (type) {
+    case ATMOS_WEIGHTED_AVERAGE:
+      wtl = (1.0-fracx)*(1.0-fracy);
+      wtr = fracx*(1.0-fracy);
+      wbl = (1.0-fracx)*fracy;
+      wbr = fracx*fracy;
+      final = tl*wtl + tr*wtr + bl*wbl + br*wbr;
+    break;
+    case ATMOS_BILINEAR:
+      end_left = (bl-tl)*fracy + tl;
+      end_right = (br-tr)*fracy + tr;
+      final = (end_right - end_left)*fracx + end_left;
+    break;
+  }
+  return final;
+}
+/*
+ |  Batched version of `atmos_val()`, for sampling the density field
+ |  at many window points at once. The interpolation type is fixed
+ |  for the whole batch, and indices are clamped without branching,
+ |  so the compiler is free to turn the loop into SIMD gathers (the
+ |  bilinear loop is one of the hot kernels). Gives the same values
+ |  as calling `atmos_val()` for each point.
+ */
+void atmos_val_batch(const double *xs, const double *ys, double *out, int num, atmos_interpolation_type type) {
+  const double *data = atmos_data;
+  const long w = IMAGE_WIDTH, h = IMAGE_HEIGHT;
+  double fx, fy, fracx, fracy;
+  double tl, tr, bl, br;
+  long top, left, bottom, right;
+  int i, inside;
+  //the polar & tiled fields aren't one flat array to gather from, so take those one at a time
+  if (FIELD_TYPE == ATMOS_FIELD_POLAR || tile_cache > 0) {
+    for (i=0; i < num; i++) {
+      out[i] = atmos_val(xs[i],ys[i],type);
+    }
+    return;
+  }
+  switch (type) {
+    case ATMOS_WEIGHTED_AVERAGE:
+      for (i=0; i < num; i++) {
+        inside = (xs[i] >= 0.5) & (xs[i] <= w-0.5) & (ys[i] >= 0.5) & (ys[i] <= h-0.5);
+        fx = fmin(fmax(xs[i], 0.0), w-1.0);
+        fy = fmin(fmax(ys[i], 0.0), h-1.0);
+        left = (long)fx;
+        top = (long)fy;
+        right = MIN(left+1, w-1);
+        bottom = MIN(top+1, h-1);
+        fracx = fx - left;
+        fracy = fy - top;
+        tl = data[top*w+left];
+        tr = data[top*w+right];
+        bl = data[bottom*w+left];
+        br = data[bottom*w+right];
+        out[i] = (inside ? (
+          tl*(1.0-fracx)*(1.0-fracy) + tr*fracx*(1.0-fracy) +
+          bl*(1.0-fracx)*fracy + br*fracx*fracy
+        ) : 0.0);
+      }
+    break;
+    case ATMOS_BILINEAR:
+      kernels.bilinear(data,w,h,xs,ys,out,num);
+    break;
+  }
+  return;
+}
+//is the given coordinate inside the window?
+int atmos_coord_inside(struct atmos_coord *coord) {
+  if (coord->ground < 0.0 || coord->ground > WINDOW_ARC_LENGTH ||
+      coord->alt < 0.0 || coord->alt > WINDOW_ALTITUDE) {
+    return 0;
+  }
+  return 1;
+}
+//are we in bounds?
+int atmos_bounds(double x, double y) {
+  struct atmos_coord coord;
+  atmos_coords(x,y,&coord);
+  return atmos_coord_inside(&coord);
+}
+
+/*
+ |  =====================
+ |  SIMULATING TURBULENCE
+ |  =====================
+ */
+
+//generate random bloops
+int bloop_init() {
+  struct atmos_bloop *bloop;
+  struct atmos_coord coord, coord_start, coord_end;
+  double temp;
+  int i;
+  if ((bloop_list = (struct atmos_bloop *)mem_calloc(MEM_BLOOP, sizeof(struct atmos_bloop), BLOOP_NUM)) == NULL) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
   for (i=0; i < BLOOP_NUM; i++) {
     bloop = &(bloop_list[i]);
     //start position
@@ -448,8 +1652,8 @@ int bloop_init() {
     coord.alt = (coord_start.alt + coord_end.alt)/2.0;
     coord.ground = (coord_start.ground + coord_end.ground)/2.0;
     //other metrics
-    bloop->dur = rng()*FRAMES*1.0 + FRAMES*0.2;
-    bloop->startt = rng()*FRAMES - bloop->dur/2.0;
+    bloop->dur = rng()*scenario.frames*1.0 + scenario.frames*0.2;
+    bloop->startt = rng()*scenario.frames - bloop->dur/2.0;
     bloop->radv = rng()*10.0+2.0;
     bloop->radh = rng()*100.0+100.0;
     temp = pow(rng(),(coord.alt/WINDOW_ALTITUDE)*20.0+0.8); //introduce altitude bias
@@ -468,19 +1672,13 @@ void bloop_cycle(double t, struct atmos_bloop *bloop) {
   atmos_coords(bloop->x,bloop->y,&(bloop->coord));
   return;
 }
-//calculate the multiplier that this bloop applies to the density field at the given sample point
-double bloop_calc(double x, double y, double t, struct atmos_bloop *bloop) {
-  struct atmos_coord sample;
+//calculate the multiplier that this bloop applies to the density field at the given altitude & ground point
+double bloop_calc_coord(struct atmos_coord *sample, struct atmos_bloop *bloop) {
   double sv, sh, ratio;
   double dist, amp, val;
-  //sanity check
-  if (bloop->t <= 0.0 && bloop->t >= 1.0) {
-    return 1.0;
-  }
   //find sample in bloop-centered coordinate space
-  atmos_coords(x,y,&sample);
-  sh = sample.ground - bloop->coord.ground;
-  sv = sample.alt - bloop->coord.alt;
+  sh = sample->ground - bloop->coord.ground;
+  sv = sample->alt - bloop->coord.alt;
   //transform coordinate space into circle
   ratio = bloop->radh / bloop->radv;
   sv = sv*ratio;
@@ -495,604 +1693,4446 @@ double bloop_calc(double x, double y, double t, struct atmos_bloop *bloop) {
   val = (cos((dist/bloop->radh)*PI)*0.5+0.5) * (amp-1.0) + 1.0;
   return val;
 }
-//apply the bloop to the density field
-void bloop_apply(double t, struct atmos_bloop *bloop) {
-  int x, y;
-  int min_x, min_y, max_x, max_y;
-  bloop_cycle(t,bloop);
-  //sanity check
-  if (bloop->t <= 0.0 && bloop->t >= 1.0) {
+//calculate the multiplier that this bloop applies to the density field at the given sample point
+double bloop_calc(double x, double y, double t, struct atmos_bloop *bloop) {
+  struct atmos_coord sample;
+  //sanity check
+  if (bloop->t <= 0.0 && bloop->t >= 1.0) {
+    return 1.0;
+  }
+  atmos_coords(x,y,&sample);
+  return bloop_calc_coord(&sample,bloop);
+}
+/*
+ |  Every bloop has the same raised-cosine profile, just scaled. So
+ |  instead of calling `bloop_calc()` for every pixel, we can look
+ |  the profile up in a table indexed by the squared distance from
+ |  the center (as a fraction of the squared radius), which saves
+ |  the square root as well as the cosine:
+ |  
+ |    bloop_table[k] = cos(sqrt(k/(size-1))*PI)*0.5 + 0.5
+ |  
+ |  The last entry is 0, and so is the extra one after it, so any
+ |  point outside the bloop gets a multiplier of exactly 1.
+ */
+double *bloop_table;
+double *bloop_q; //scratch row of squared distances
+double *bloop_sh2; //scratch row of squared horizontal offsets
+//look up bloop profile for squared fractional distance from center
+double bloop_profile(double q) {
+  double f = fmin(q, 1.0)*(bloop_table_size-1);
+  int k = (int)f;
+  return (bloop_table[k+1] - bloop_table[k])*(f-k) + bloop_table[k];
+}
+//current peak amplitude of bloop, minus 1 (see `bloop_calc_coord()`)
+double bloop_amp(struct atmos_bloop *bloop) {
+  return (0.5 - cos(bloop->t*PI*2.0)*0.5) * (bloop->amp-1.0);
+}
+//build the profile table, and report how far it strays from `bloop_calc()`
+int bloop_table_init(int size) {
+  double dist, err, max_err, max_amp;
+  int i;
+  if (
+    (bloop_table = (double *)mem_calloc(MEM_BLOOP, sizeof(double), size+1)) == NULL ||
+    (bloop_q = (double *)mem_calloc(MEM_BLOOP, sizeof(double), MAX(IMAGE_WIDTH,POLAR_WIDTH))) == NULL ||
+    (bloop_sh2 = (double *)mem_calloc(MEM_BLOOP, sizeof(double), MAX(IMAGE_WIDTH,POLAR_WIDTH))) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  for (i=0; i < size; i++) {
+    bloop_table[i] = cos(sqrt(((double)i)/((double)(size-1)))*PI)*0.5+0.5;
+  }
+  bloop_table[size-1] = bloop_table[size] = 0.0;
+  //compare with analytic profile at many distances
+  max_err = 0.0;
+  for (i=0; i <= 100000; i++) {
+    dist = ((double)i)/100000.0;
+    err = fabs(bloop_profile(dist*dist) - (cos(dist*PI)*0.5+0.5));
+    max_err = fmax(max_err, err);
+  }
+  //strongest possible bloop (see `bloop_init()`)
+  max_amp = pow(2.0, 0.2) - 1.0;
+  fprintf(stdout, "Bloop stamp table: %d entries, max profile error %.3le (max density multiplier error %.3le)\n", size, max_err, max_err*max_amp);
+  return 0;
+}
+//multiply a row of the density field by the bloop profile at the given squared distances
+void bloop_stamp(double *row, const double *q, int num, double amp) {
+  kernels.bloop_stamp(row,q,num,amp,bloop_table,bloop_table_size);
+  return;
+}
+//apply the bloop to the density field
+void bloop_apply(double t, struct atmos_bloop *bloop) {
+  struct atmos_coord sample;
+  double sh, sv, ratio, inv_radh2, amp;
+  double *span;
+  int x, y, i, len;
+  int min_x, min_y, max_x, max_y;
+  bloop_cycle(t,bloop);
+  //sanity check
+  if (bloop->t <= 0.0 && bloop->t >= 1.0) {
+    return;
+  }
+  //calculate a bounding box
+  min_x = MAX(0, (int)(bloop->x - bloop->radh*IMAGE_RES));
+  max_x = MIN(IMAGE_WIDTH-1, (int)(bloop->x + bloop->radh*IMAGE_RES));
+  min_y = MAX(0, (int)(bloop->y - bloop->radv*IMAGE_RES));
+  max_y = MIN(IMAGE_HEIGHT-1, (int)(bloop->y + bloop->radv*IMAGE_RES));
+  if (bloop_stamps != NULL) {
+    bloop_stamps[bloop - bloop_list].coord = bloop->coord;
+    bloop_stamps[bloop - bloop_list].radv = bloop->radv;
+    bloop_stamps[bloop - bloop_list].radh = bloop->radh;
+    bloop_stamps[bloop - bloop_list].stamped = (min_x <= max_x && min_y <= max_y);
+  }
+  if (min_x > max_x) {
+    return;
+  }
+  //stamp from the profile table
+  if (bloop_table_size > 0) {
+    ratio = bloop->radh / bloop->radv;
+    inv_radh2 = 1.0/(bloop->radh*bloop->radh);
+    amp = bloop_amp(bloop);
+    for (y=min_y; y <= max_y; y++) {
+      for (x=min_x; x <= max_x; x++) {
+        atmos_coords_fast(x,y,&sample);
+        sh = sample.ground - bloop->coord.ground;
+        sv = (sample.alt - bloop->coord.alt)*ratio;
+        bloop_q[x-min_x] = (sh*sh + sv*sv)*inv_radh2;
+      }
+      for (x=min_x; x <= max_x; x += len) {
+        span = atmos_span(x,y,&len);
+        len = MIN(len, max_x-x+1);
+        bloop_stamp(span,&(bloop_q[x-min_x]),len,amp);
+      }
+    }
+    return;
+  }
+  //loop through pixels inside bounding box
+  for (y=min_y; y <= max_y; y++) {
+    for (x=min_x; x <= max_x; x += len) {
+      span = atmos_span(x,y,&len);
+      len = MIN(len, max_x-x+1);
+      for (i=0; i < len; i++) {
+        span[i] = span[i] * bloop_calc(x+i,y,t,bloop);
+      }
+    }
+  }
+  return;
+}
+/*
+ |  Apply the bloop to the polar field. On this grid the bloop's
+ |  footprint is simply an axis-aligned box in altitude & ground.
+ */
+void bloop_apply_polar(double t, struct atmos_bloop *bloop) {
+  struct atmos_coord sample;
+  double sh, sv, sv2, ratio, inv_radh2, amp;
+  int i, j;
+  int min_i, min_j, max_i, max_j;
+  bloop_cycle(t,bloop);
+  //sanity check
+  if (bloop->t <= 0.0 && bloop->t >= 1.0) {
+    return;
+  }
+  //bounding box
+  min_i = MAX(0, (int)ceil((bloop->coord.ground - bloop->radh)*POLAR_RES_GROUND));
+  max_i = MIN(POLAR_WIDTH-1, (int)floor((bloop->coord.ground + bloop->radh)*POLAR_RES_GROUND));
+  min_j = MAX(0, (int)ceil(polar_alt_row(bloop->coord.alt - bloop->radv)));
+  max_j = MIN(POLAR_HEIGHT-1, (int)floor(polar_alt_row(bloop->coord.alt + bloop->radv)));
+  if (min_i > max_i) {
     return;
   }
-  //calculate a bounding box
-  min_x = MAX(0, (int)(bloop->x - bloop->radh*IMAGE_RES));
-  max_x = MIN(IMAGE_WIDTH-1, (int)(bloop->x + bloop->radh*IMAGE_RES));
-  min_y = MAX(0, (int)(bloop->y - bloop->radv*IMAGE_RES));
-  max_y = MIN(IMAGE_HEIGHT-1, (int)(bloop->y + bloop->radv*IMAGE_RES));
-  //loop through pixels inside bounding box
-  for (y=min_y; y <= max_y; y++) {
-    for (x=min_x; x <= max_x; x++) {
-      atmos[y][x] = atmos[y][x] * bloop_calc(x,y,t,bloop);
+  //stamp from the profile table
+  if (bloop_table_size > 0) {
+    ratio = bloop->radh / bloop->radv;
+    inv_radh2 = 1.0/(bloop->radh*bloop->radh);
+    amp = bloop_amp(bloop);
+    //horizontal offsets are the same for every row
+    for (i=min_i; i <= max_i; i++) {
+      sh = i/POLAR_RES_GROUND - bloop->coord.ground;
+      bloop_sh2[i-min_i] = sh*sh;
+    }
+    for (j=min_j; j <= max_j; j++) {
+      sv = (polar_alt[j] - bloop->coord.alt)*ratio;
+      sv2 = sv*sv;
+      for (i=0; i <= max_i-min_i; i++) {
+        bloop_q[i] = (bloop_sh2[i] + sv2)*inv_radh2;
+      }
+      bloop_stamp(&(polar[j][min_i]),bloop_q,max_i-min_i+1,amp);
+    }
+    return;
+  }
+  for (j=min_j; j <= max_j; j++) {
+    sample.alt = polar_alt[j];
+    for (i=min_i; i <= max_i; i++) {
+      sample.ground = i/POLAR_RES_GROUND;
+      polar[j][i] = polar[j][i] * bloop_calc_coord(&sample,bloop);
+    }
+  }
+  return;
+}
+//apply every bloop to the density field (progress bar is optional)
+void bloop_apply_all(double t, struct spb_instance *spb) {
+  int i;
+  for (i=0; i < BLOOP_NUM; i++) {
+    if (FIELD_TYPE == ATMOS_FIELD_POLAR) {
+      bloop_apply_polar(t,&(bloop_list[i]));
+    } else {
+      bloop_apply(t,&(bloop_list[i]));
+    }
+    if (spb != NULL) {
+      spb->real_progress++;
+      spb_update(spb);
+    }
+  }
+  return;
+}
+
+/*
+ |  =============================
+ |  CONTOUR LINES FOR DENSITY MAP
+ |  =============================
+ */
+
+//initialize contour list
+int contour_init() {
+  struct atmos_contour *contour;
+  int i;
+  double interval = ((double)DENSITY_MAX) / ((double)CONTOUR_NUM);
+  double density;
+  if ((contour_list = (struct atmos_contour *)calloc(sizeof(struct atmos_contour), CONTOUR_NUM)) == NULL) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  fprintf(stdout,"Density contour lines (kg/m^3):\n");
+  for (i=0; i < CONTOUR_NUM; i++) {
+    density = ((double)(i+1)) * interval;
+    contour = &(contour_list[i]);
+    contour->density = density;
+    fprintf(stdout,"\t%02d)  %0.3lf\n",i,density);
+  }
+  return 0;
+}
+//sample the density field at the given points and find their density intervals
+void contour_sample_points(const double *xs, const double *ys, double *vals, int *bands, int num) {
+  atmos_val_batch(xs,ys,vals,num,INTERPOLATION_TYPE);
+  kernels.contour_band(vals,bands,num,contour_list,CONTOUR_NUM);
+  return;
+}
+//sample a row of pixel corners (halfway between pixels) and find their density intervals
+void contour_sample_row(double y, double *xs, double *ys, double *vals, int *bands) {
+  int x;
+  for (x=0; x <= IMAGE_WIDTH; x++) {
+    xs[x] = ((double)x)-0.5;
+    ys[x] = y;
+  }
+  contour_sample_points(xs,ys,vals,bands,IMAGE_WIDTH+1);
+  return;
+}
+/*
+ |  Mark which pixels of a row have a contour line running through
+ |  them (1 if so, otherwise 0). `above` & `below` are the density
+ |  intervals of the row's top & bottom corners, from
+ |  `contour_sample_row()`. If all four corners of a pixel lie within
+ |  the same interval, then no contour line runs through it.
+ */
+void contour_detect_row(const int *above, const int *below, int *out) {
+  int x;
+  for (x=0; x < IMAGE_WIDTH; x++) {
+    out[x] = !(
+      (above[x] == above[x+1])
+      && (below[x] == below[x+1])
+      && (above[x] == below[x])
+      //&& (above[x+1] == below[x+1]) //this last comparison can be inferred
+    );
+  }
+  return;
+}
+
+/*
+ |  ================
+ |  ATMOSPHERE LOGIC
+ |  ================
+ */
+
+//look up the given altitude in a table of gradient stops
+double atmos_grade_alt(const struct atmos_grade_stop *grade, int stops, double alt) {
+  double frac;
+  const struct atmos_grade_stop *floor, *ceil;
+  int i;
+  
+  //check for extremes
+  if (alt < grade[0].alt) {
+    return grade[0].density;
+  }
+  if (alt > grade[stops-1].alt) {
+    return grade[stops-1].density;
+  }
+  
+  //find place in gradient stops
+  for (i=0; i < stops; i++) {
+    floor = &(grade[i]);
+    if (i == (stops-1)) {
+      ceil = &(grade[i]);
+    } else {
+      ceil = &(grade[i+1]);
+    }
+    if (alt >= floor->alt && alt <= ceil->alt) {
+      frac = (alt - floor->alt)/(ceil->alt - floor->alt);
+      return (ceil->density - floor->density)*frac + floor->density;
+    }
+  }
+  //return 1.0 - (alt/WINDOW_ALTITUDE);
+  return 0.0;
+}
+//calculate baseline density gradient for the given altitude
+double atmos_baseline_alt(double alt) {
+  return atmos_grade_alt(atmos_grade,atmos_grade_num,alt);
+}
+//calculate standard density gradient for the given point
+double atmos_baseline(double x, double y) {
+  struct atmos_coord coord;
+  atmos_coords(x,y,&coord);
+  return atmos_baseline_alt(coord.alt);
+}
+//set the Cartesian field to the baseline gradient, one tile at a time (see `atmos_fill()`)
+void atmos_fill_baseline() {
+  struct atmos_coord coord;
+  double *span;
+  int x0, y0, x, y, len;
+  for (y0=0; y0 < IMAGE_HEIGHT; y0 += TILE_SIZE) {
+    for (x0=0; x0 < IMAGE_WIDTH; x0 += len) {
+      for (y=y0; y < MIN(y0+TILE_SIZE, IMAGE_HEIGHT); y++) {
+        span = atmos_span(x0,y,&len);
+        for (x=0; x < len; x++) {
+          atmos_coords(x0+x,y,&coord);
+          baseline_alt[x] = coord.alt;
+        }
+        kernels.baseline_row(span,baseline_alt,len,atmos_grade,atmos_grade_num);
+      }
+    }
+  }
+  return;
+}
+//go back to the standard atmosphere, if a profile's table was in use
+void profile_grade_free() {
+  if (atmos_grade != atmos_standard) {
+    mem_free(atmos_grade);
+  }
+  atmos_grade = atmos_standard;
+  atmos_grade_num = ATMOS_STOP_NUM;
+  return;
+}
+/*
+ |  Build the baseline table from a sounding profile in the database
+ |  (see `--profile`). Every level of the profile within the window's
+ |  altitudes (and the nearest one past each edge) becomes a stop, so
+ |  thin inversions & ducts come through as measured. Where the window
+ |  reaches past the profile's ends, the standard atmosphere's stops
+ |  take over, scaled to meet the profile.
+ */
+int profile_grade(unsigned long long id) {
+  const struct atmos_profile_entry *entry;
+  const struct atmos_profile_level *levels;
+  struct atmos_grade_stop *stops;
+  double scale;
+  int i, num, lo, hi, n;
+  if ((entry = atmos_profile_find(&profile_db,(uint64_t)id)) == NULL) {
+    fprintf(stderr, "No profile %llu in '%s'\n", id, profile_file);
+    return -1;
+  }
+  levels = atmos_profile_levels(&profile_db,entry);
+  num = (int)entry->levels;
+  //the levels that matter: from the last one at or below the ground to the first one at or above the window's top
+  for (lo=0; lo < num-1 && levels[lo+1].alt <= 0.0; lo++);
+  for (hi=num-1; hi > lo+1 && levels[hi-1].alt >= WINDOW_ALTITUDE; hi--);
+  if ((stops = (struct atmos_grade_stop *)mem_calloc(MEM_FIELD, sizeof(struct atmos_grade_stop), (size_t)(hi-lo+1) + 2*ATMOS_STOP_NUM)) == NULL) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  n = 0;
+  //below the profile
+  scale = levels[0].density/atmos_grade_alt(atmos_standard,ATMOS_STOP_NUM,levels[0].alt);
+  for (i=0; i < ATMOS_STOP_NUM && atmos_standard[i].alt < levels[0].alt; i++) {
+    stops[n].alt = atmos_standard[i].alt;
+    stops[n++].density = atmos_standard[i].density*scale;
+  }
+  for (i=lo; i <= hi; i++) {
+    stops[n].alt = levels[i].alt;
+    stops[n++].density = levels[i].density;
+  }
+  //above the profile, as far as the window goes
+  scale = levels[num-1].density/atmos_grade_alt(atmos_standard,ATMOS_STOP_NUM,levels[num-1].alt);
+  for (i=0; i < ATMOS_STOP_NUM && stops[n-1].alt < WINDOW_ALTITUDE; i++) {
+    if (atmos_standard[i].alt > levels[num-1].alt) {
+      stops[n].alt = atmos_standard[i].alt;
+      stops[n++].density = atmos_standard[i].density*scale;
+    }
+  }
+  profile_grade_free();
+  atmos_grade = stops;
+  atmos_grade_num = n;
+  return 0;
+}
+/*
+ |  Switch the baseline to another profile between runs, updating
+ |  whatever was computed from the old one.
+ */
+int profile_select(unsigned long long id) {
+  int y;
+  if (profile_grade(id) == -1) {
+    return -1;
+  }
+  if (FIELD_TYPE == ATMOS_FIELD_POLAR) {
+    for (y=0; y < POLAR_HEIGHT; y++) {
+      polar_base[y] = atmos_baseline_alt(polar_alt[y]);
+    }
+  }
+  if (atmos_base != NULL) {
+    atmos_fill_baseline();
+    memcpy(atmos_base, atmos_data, sizeof(double)*IMAGE_WIDTH*IMAGE_HEIGHT);
+  }
+  return 0;
+}
+/*
+ |  Do we need the density field on the window's pixel grid? With the
+ |  polar field, that's only for rendering images, dumps, the render
+ |  cache or regression checks.
+ */
+int atmos_cartesian() {
+  return (FIELD_TYPE == ATMOS_FIELD_CARTESIAN || dump || regress || cache || (!headless && !ensemble));
+}
+//can the sight line be picked up from the last frame's? (see `retrace_check()`)
+int retrace_enabled() {
+  return (!full_retrace && !dispersion && keyframe_step == 1 && FIELD_TYPE == ATMOS_FIELD_CARTESIAN);
+}
+/*
+ |  What the run will need of each subsystem at its peak, worked out
+ |  from the dimensions in `global_init()` before anything is
+ |  allocated. The ray buffer is taken at its full length, since a
+ |  sight line can run that long.
+ */
+size_t mem_estimate(size_t *bytes) {
+  size_t total = 0, tile = sizeof(double) << (2*TILE_SHIFT);
+  int t, tx, ty;
+  memset(bytes, 0, sizeof(size_t)*MEM_TAGS);
+  if (atmos_cartesian()) {
+    if (tile_cache > 0) {
+      tx = (IMAGE_WIDTH + TILE_SIZE-1) >> TILE_SHIFT;
+      ty = (IMAGE_HEIGHT + TILE_SIZE-1) >> TILE_SHIFT;
+      bytes[MEM_FIELD] += MAX((size_t)tile_cache, 2*(size_t)tx)*tile + (2*sizeof(int) + 1)*tx*ty;
+    } else {
+      //the server keeps a second copy to reset every frame from
+      bytes[MEM_FIELD] += sizeof(double)*IMAGE_WIDTH*IMAGE_HEIGHT * (serve != NULL && FIELD_TYPE == ATMOS_FIELD_CARTESIAN ? 2 : 1);
+    }
+    bytes[MEM_FIELD] += sizeof(double)*IMAGE_WIDTH;
+  }
+  if (FIELD_TYPE == ATMOS_FIELD_POLAR) {
+    bytes[MEM_FIELD] += sizeof(double)*POLAR_WIDTH*POLAR_HEIGHT + (sizeof(double *) + 2*sizeof(double))*POLAR_HEIGHT;
+  }
+  if (target) {
+    //the solver's shots have a buffer of their own (see `target_solve()`)
+    bytes[MEM_RAY] += sizeof(struct ray_node)*(RAY_MAX_NODES+1);
+  }
+  if (retrace_enabled()) {
+    bytes[MEM_RAY] += (sizeof(struct ray_node) + sizeof(struct ray_step))*RAY_MAX_NODES;
+    bytes[MEM_BLOOP] += 2*sizeof(struct ray_stamp)*BLOOP_NUM;
+  }
+  if (keyframe_step > 1) {
+    //two keyframes, plus the blended field while checking it (see `keyframe_init()`)
+    bytes[MEM_FIELD] += sizeof(double)*(FIELD_TYPE == ATMOS_FIELD_POLAR ? (size_t)POLAR_WIDTH*POLAR_HEIGHT : (size_t)IMAGE_WIDTH*IMAGE_HEIGHT) * (keyframe_check ? 3 : 2);
+  }
+  if (!headless && !ensemble && !regress && !profile_batch) {
+    //the sight line & straight line layers (not for SVG), and the chart's
+    bytes[MEM_IMAGE] = (svg ? 0 : 2*(sizeof(double)*OUTPUT_WIDTH + sizeof(double *))*OUTPUT_HEIGHT) + (sizeof(double)*ANOM_IMAGE_WIDTH + sizeof(double *))*ANOM_IMAGE_HEIGHT;
+    //the density map, and the chart art with a copy to draw on
+    bytes[MEM_SURFACE] = (size_t)3*OUTPUT_WIDTH*OUTPUT_HEIGHT + (size_t)2*4*ANOM_IMAGE_WIDTH*ANOM_IMAGE_HEIGHT;
+  }
+  bytes[MEM_RAY] += sizeof(struct ray_node)*(RAY_MAX_NODES+1) * (dispersion ? DISPERSION_NUM : 1);
+  bytes[MEM_BLOOP] += sizeof(struct atmos_bloop)*BLOOP_NUM;
+  if (bloop_table_size > 0) {
+    bytes[MEM_BLOOP] += sizeof(double)*(bloop_table_size+1) + 2*sizeof(double)*MAX(IMAGE_WIDTH,POLAR_WIDTH);
+  }
+  for (t=0; t < MEM_TAGS; t++) {
+    total += bytes[t];
+  }
+  return total;
+}
+/*
+ |  Check the estimate against `--mem-limit` before we start. If the
+ |  whole Cartesian field is what doesn't fit, fall back to the tiled
+ |  field with as many tiles in memory as the budget leaves room for;
+ |  otherwise there's nothing to give up, so refuse to run.
+ */
+int mem_preflight() {
+  size_t bytes[MEM_TAGS];
+  size_t total, rest, tile = sizeof(double) << (2*TILE_SHIFT);
+  int t, tx, ty;
+  if (mem_limit == 0) {
+    return 0;
+  }
+  total = mem_estimate(bytes);
+  if (total <= mem_limit) {
+    return 0;
+  }
+  if (atmos_cartesian() && tile_cache == 0) {
+    tx = (IMAGE_WIDTH + TILE_SIZE-1) >> TILE_SHIFT;
+    ty = (IMAGE_HEIGHT + TILE_SIZE-1) >> TILE_SHIFT;
+    rest = total - bytes[MEM_FIELD] + sizeof(double)*IMAGE_WIDTH + (2*sizeof(int) + 1)*tx*ty;
+    if (rest + 2*tx*tile <= mem_limit) {
+      tile_cache = (int)MIN((mem_limit - rest) / tile, (size_t)tx*ty);
+      fprintf(stdout, "Estimated %.1lf MiB is over the %.1lf MiB limit; using tiled density field\n", total/1048576.0, mem_limit/1048576.0);
+      return 0;
+    }
+  }
+  fprintf(stderr, "Estimated %.1lf MiB is over the %.1lf MiB limit (see `--mem-limit`):\n", total/1048576.0, mem_limit/1048576.0);
+  for (t=0; t < MEM_TAGS; t++) {
+    fprintf(stderr, "  %-10s %10.1lf MiB\n", MEM_TAG_NAMES[t], bytes[t]/1048576.0);
+  }
+  return -1;
+}
+//initialize stuff
+int atmos_init() {
+  int y, i, halfway;
+  double n1x, n1y, h1x, h1y, h2x, h2y, n2x, n2y;
+  double frac;
+  
+  //atmospheric density gradient
+  /*
+   |  This plot relates altitude vs. density of Earth's
+   |  atmosphere:
+   |  - https://commons.wikimedia.org/wiki/File:Comparison_US_standard_atmosphere_1962.svg
+   |  
+   |  This is the plot curve in SVG notation, if X axis
+   |  is altitude in km and Y axis is density in kg/m^3:
+   |  
+   |    d="M 0,1.28 C 5,0.60 11,0.31 15,0.20 19,0.08 22,0.02 37,0.00"
+   |  
+   |  ... or, in other words:
+   |  
+   |  node: 0,1.28
+   |    [handle]: 5,0.60
+   |    [handle]: 11,0.31
+   |  node: 15,0.20
+   |    [handle]: 19,0.08
+   |    [handle]: 22,0.02
+   |  node: 37,0.00
+   */
+  halfway = ATMOS_STOP_NUM/2;
+  for (i=0; i < ATMOS_STOP_NUM; i++) {
+    if (i < halfway) {
+      frac = (((double)i) / ((double)(halfway-1)));
+      n1x = 00.0; n1y = 1.28;
+      h1x = 05.0; h1y = 0.60;
+      h2x = 11.0; h2y = 0.31;
+      n2x = 15.0; n2y = 0.20;
+    } else {
+      frac = (((double)(i - halfway)) / ((double)(ATMOS_STOP_NUM-1-halfway)));
+      n1x = 15.0; n1y = 0.20;
+      h1x = 19.0; h1y = 0.08;
+      h2x = 22.0; h2y = 0.02;
+      n2x = 37.0; n2y = 0.00;
+    }
+    atmos_standard[i].alt = bezier_cubic(n1x,h1x,h2x,n2x,frac);
+    atmos_standard[i].density = bezier_cubic(n1y,h1y,h2y,n2y,frac);
+  }
+  if (profile_file != NULL && !profile_batch && profile_grade(profile_id) == -1) {
+    return -1;
+  }
+  
+  //atmospheric density field
+  if (atmos_cartesian()) {
+    if (atmos_data_alloc() == -1) {
+      return -1;
+    }
+    if ((baseline_alt = (double *)mem_calloc(MEM_FIELD, sizeof(double), IMAGE_WIDTH)) == NULL) {
+      fprintf(stderr, "calloc(): %s\n", strerror(errno));
+      return -1;
+    }
+    if (tile_cache > 0) {
+      fprintf(stdout, "Tiled density field: %d x %d tiles, up to %d in memory (%.1lf MiB)\n", tiles_x, tiles_y, tile_cache, (double)((size_t)tile_cache*sizeof(double) << (2*TILE_SHIFT))/1048576.0);
+    }
+    atmos_fill_baseline();
+  }
+  
+  //same thing on the altitude/ground grid
+  if (FIELD_TYPE == ATMOS_FIELD_POLAR) {
+    if (
+      (polar = (double **)mem_calloc(MEM_FIELD, sizeof(double *), POLAR_HEIGHT)) == NULL ||
+      (polar_data = (double *)mem_calloc(MEM_FIELD, sizeof(double), (size_t)POLAR_WIDTH*POLAR_HEIGHT)) == NULL ||
+      (polar_alt = (double *)mem_calloc(MEM_FIELD, sizeof(double), POLAR_HEIGHT)) == NULL ||
+      (polar_base = (double *)mem_calloc(MEM_FIELD, sizeof(double), POLAR_HEIGHT)) == NULL
+    ) {
+      fprintf(stderr, "calloc(): %s\n", strerror(errno));
+      return -1;
+    }
+    for (y=0; y < POLAR_HEIGHT; y++) {
+      polar[y] = &(polar_data[(size_t)y*POLAR_WIDTH]);
+      polar_alt[y] = polar_row_alt(y);
+      polar_base[y] = atmos_baseline_alt(polar_alt[y]);
+    }
+    fprintf(stdout, "POLAR_WIDTH: %d\nPOLAR_HEIGHT: %d\n", POLAR_WIDTH, POLAR_HEIGHT);
+  }
+  
+  return 0;
+}
+//reset density field to the baseline gradient
+void atmos_reset() {
+  int x, y;
+  if (FIELD_TYPE == ATMOS_FIELD_POLAR) {
+    //constant along each row
+    for (y=0; y < POLAR_HEIGHT; y++) {
+      for (x=0; x < POLAR_WIDTH; x++) {
+        polar[y][x] = polar_base[y];
+      }
+    }
+    return;
+  }
+  if (atmos_base != NULL) {
+    memcpy(atmos_data, atmos_base, sizeof(double)*IMAGE_WIDTH*IMAGE_HEIGHT);
+    return;
+  }
+  atmos_fill_baseline();
+  return;
+}
+//time coordinate of an output frame, in the animation's original frames (see `--fps-mult`)
+double frame_time(int frame) {
+  return 1.0 + ((double)(frame-1))/((double)fps_mult);
+}
+//simulate the atmosphere from scratch for the given output frame
+void frame_simulate(int frame, struct spb_instance *spb) {
+  perf_start(PERF_RESET);
+  atmos_reset();
+  perf_stop(PERF_RESET, (FIELD_TYPE == ATMOS_FIELD_POLAR ? (double)POLAR_WIDTH*POLAR_HEIGHT : (double)IMAGE_WIDTH*IMAGE_HEIGHT));
+  if (ENABLE_TURBULENCE) {
+    perf_start(PERF_BLOOPS);
+    bloop_apply_all(frame_time(frame),spb);
+    perf_stop(PERF_BLOOPS, (FIELD_TYPE == ATMOS_FIELD_POLAR ? (double)POLAR_WIDTH*POLAR_HEIGHT : (double)IMAGE_WIDTH*IMAGE_HEIGHT));
+  }
+  return;
+}
+//fill the window's pixel grid from the polar field (for rendering)
+void polar_resample() {
+  atmos_fill(polar_val_at);
+  return;
+}
+//free atmospheric density field
+void atmos_free() {
+  atmos_data_free();
+  mem_free(atmos_base);
+  mem_free(baseline_alt);
+  mem_free(polar_data);
+  mem_free(polar);
+  mem_free(polar_alt);
+  mem_free(polar_base);
+  profile_grade_free();
+}
+//save raw density field for the given frame
+int atmos_dump(const char *file, int frame) {
+  struct atmos_dump_header h;
+  memset(&h, 0, sizeof(struct atmos_dump_header));
+  h.type = DUMP_TYPE;
+  h.frame = frame;
+  h.width = IMAGE_WIDTH;
+  h.height = IMAGE_HEIGHT;
+  h.image_res = IMAGE_RES;
+  h.window_arc_length = WINDOW_ARC_LENGTH;
+  h.window_altitude = WINDOW_ALTITUDE;
+  h.window_angle = WINDOW_ANGLE;
+  h.window_top = WINDOW_TOP;
+  h.window_bottom = WINDOW_BOTTOM;
+  h.window_left = WINDOW_LEFT;
+  h.window_right = WINDOW_RIGHT;
+  h.earth_radius = EARTH_RADIUS;
+  if (tile_cache > 0) {
+    return atmos_dump_write_rows(file, &h, atmos_row);
+  }
+  return atmos_dump_write(file, &h, atmos_data);
+}
+//check whether the given dump file was completely written
+int atmos_dump_complete(const char *file) {
+  struct atmos_dump d;
+  if (access(file, F_OK) != 0 || atmos_dump_open(file, &d) == -1) {
+    return 0;
+  }
+  atmos_dump_close(&d);
+  return 1;
+}
+
+/*
+ |  ===============
+ |  OPTICAL PHYSICS
+ |  ===============
+ */
+
+/*
+ |  This function takes density and returns the absolute refractive
+ |  index for air. See:
+ |  - https://en.wikipedia.org/wiki/Gladstone%E2%80%93Dale_relation
+ |  - https://webmineral.com/help/Gladstone-Dale.shtml
+ |  - https://en.wikipedia.org/wiki/Refractive_index
+ |  
+ |  (See definition of `GLADSTONEDALE_CONST` in this code above for
+ |  a citation on that number.)
+ */
+long double density_to_ior(long double density, long double gd) {
+  return 1.0 + (density * gd);
+}
+/*
+ |  This function takes an incident angle & two densities, and
+ |  gives a refraction angle. See:
+ |  - https://en.wikipedia.org/wiki/Snell%27s_law
+ |  
+ |  Also note:
+ |  - d1 is the previous medium
+ |  - d2 is the new medium
+ |  - These are converted to refractive indices using the
+ |    Gladstone-Dale constant `gd` for air. See above.
+ */
+long double snells_law(long double th, long double d1, long double d2, long double gd) {
+  long double val;
+  long double n1, n2;
+  n1 = density_to_ior(d1,gd);
+  n2 = density_to_ior(d2,gd);
+  val = (n1/n2)*sinl(th*PI/180.0);
+  if (fabsl(val) <= 1.0) {
+    return asinl(val)*180.0/PI;
+  } else {
+    /*
+     |  Total internal reflection. See:
+     |  - https://en.wikipedia.org/wiki/Snell%27s_law#Total_internal_reflection_and_critical_angle
+     |  - https://en.wikipedia.org/wiki/Total_internal_reflection
+     */
+    return 180.0 - th;
+  }
+}
+/*
+ |  Refractivity (n-1) of standard air for the given wavelength in
+ |  nanometers, using Edlen's dispersion formula. See:
+ |  - https://doi.org/10.1088/0026-1394/2/2/002
+ */
+double edlen_refractivity(double wavelength) {
+  double s2 = 1.0/((wavelength/1000.0)*(wavelength/1000.0)); // wavenumber squared, 1/um^2
+  return (8342.13 + 2406030.0/(130.0-s2) + 15997.0/(38.9-s2))*1e-8;
+}
+/*
+ |  Gladstone-Dale constant for the given wavelength in nanometers.
+ |  The refractivity of air is proportional to density, so only its
+ |  shape across the spectrum is taken from Edlen's formula, scaled so
+ |  that `DISPERSION_REF_WAVELENGTH` gets `GLADSTONEDALE_CONST`.
+ */
+long double gladstone_dale(double wavelength) {
+  return (long double)GLADSTONEDALE_CONST * (edlen_refractivity(wavelength)/edlen_refractivity(DISPERSION_REF_WAVELENGTH));
+}
+
+/*
+ |  ==========
+ |  RAYTRACING
+ |  ==========
+ */
+
+//allocate memory buffer (unless the ray still has one) & start the ray at the observer, with the given launch angle
+int ray_init(struct atmos_ray *ray, double elevation) {
+  struct atmos_coord coord;
+  struct ray_node *node;
+  //initialize buffer
+  ray->num = 0;
+  if (ray->nodes == NULL) {
+    ray->buffsize = 256;
+    if ((ray->nodes = (struct ray_node *)mem_calloc(MEM_RAY, sizeof(struct ray_node), ray->buffsize)) == NULL) {
+      fprintf(stderr, "calloc(): %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  //drop first node
+  node = &(ray->nodes[ray->num++]);
+  ray->end = node;
+  coord.alt = scenario.observer_alt;
+  coord.ground = scenario.observer_ground;
+  atmos_window(&(node->x),&(node->y),&coord,NULL,NULL);
+  ray->dir_p.x = 0.0;
+  ray->dir_p.y = WINDOW_ANGLE*(0.5-(coord.ground/WINDOW_ARC_LENGTH)) + elevation;
+  ray->dir_p.l = 1.0;
+  vectorC3D_assign(&(ray->dir_c),vectorP3D_cartesian(ray->dir_p));
+  vectorP3D_assign(&(ray->start_p),ray->dir_p);
+  ray->density = atmos_val(node->x,node->y,INTERPOLATION_TYPE);
+  ray->warm = 0;
+  return 0;
+}
+//manage potentially growing buffer
+int ray_buff(struct atmos_ray *ray) {
+  struct ray_node *nodes;
+  if (ray->num == ray->buffsize) {
+    //the old buffer stays put if this fails
+    if ((nodes = (struct ray_node *)mem_realloc(ray->nodes, sizeof(struct ray_node) * ray->buffsize*2)) == NULL) {
+      fprintf(stderr, "realloc(): %s\n", strerror(errno));
+      return -1;
+    }
+    ray->nodes = nodes;
+    ray->buffsize = ray->buffsize*2;
+  }
+  return 0;
+}
+//clear given ray struct
+void ray_release(struct atmos_ray *ray) {
+  mem_free(ray->nodes);
+  ray->nodes = NULL;
+  ray->buffsize = 0;
+  ray->num = 0;
+  ray->end = NULL;
+  return;
+}
+//clear sight line
+void ray_free() {
+  ray_release(&sight);
+  return;
+}
+//clear the packet's other lanes (the reference lane belongs to the sight line)
+void packet_free() {
+  int l;
+  for (l=0; l < packet.lanes; l++) {
+    if (l != packet.ref) {
+      ray_release(&(packet.ray[l]));
+    }
+  }
+  packet.lanes = 0;
+  return;
+}
+/*
+ |  Have the given function called with each node of the sight line,
+ |  in order, as soon as it's traced. That way the sight line can be
+ |  drawn (and measured, and written out) in the same pass that traces
+ |  it, instead of walking the whole node list again for each job.
+ */
+int ray_consumer_add(void (*node)(const struct atmos_ray *ray, const struct ray_node *node, int index, void *data), void *data) {
+  if (ray_consumer_num == RAY_MAX_CONSUMERS) {
+    fprintf(stderr, "Too many sight line consumers (see `RAY_MAX_CONSUMERS`).\n");
+    return -1;
+  }
+  ray_consumers[ray_consumer_num].node = node;
+  ray_consumers[ray_consumer_num].data = data;
+  ray_consumer_num++;
+  return 0;
+}
+void ray_consumer_clear() {
+  ray_consumer_num = 0;
+  return;
+}
+//hand the ray's nodes from `first` onward to every consumer, and return how far that got
+int ray_consume(const struct atmos_ray *ray, int first) {
+  int i, c;
+  for (i=first; i < ray->num; i++) {
+    for (c=0; c < ray_consumer_num; c++) {
+      ray_consumers[c].node(ray,&(ray->nodes[i]),i,ray_consumers[c].data);
+    }
+  }
+  return ray->num;
+}
+//find window point at given distance & direction from given node point
+void ray_surface_point(double x, double y, double a, double dist, double *sx, double *sy) {
+  struct vectorP3D p;
+  struct vectorC3D c;
+  p.x = 0.0;
+  p.y = a;
+  p.l = dist;
+  vectorC3D_assign(&c,vectorP3D_cartesian(p));
+  sx[0] = x+c.x;
+  sy[0] = y-c.z;
+  return;
+}
+//take sample of density field at given distance & direction from given node point
+double ray_surface_sample(double x, double y, double a, double dist) {
+  double sx, sy;
+  ray_surface_point(x,y,a,dist,&sx,&sy);
+  return atmos_val(sx,sy,INTERPOLATION_TYPE);
+}
+//determine which side of contour the sample is on
+int ray_sample_compare(double contour, double sample) {
+  double diff = fabs(contour - sample);
+  if (diff <= RAY_SAMPLE_TOLERANCE) {
+    return 0;
+  } else if (sample < contour) {
+    return -1;
+  } else {
+    return +1;
+  }
+}
+/*
+ |  Build search unit structs from given thinner surface normals,
+ |  sampling the density field for all of them in one batch. Each run
+ |  of `per` units shares one search point (`x`, `y`) & the density
+ |  there, so several points can be searched at once (see
+ |  `ray_find_surfaces()`).
+ */
+void ray_search_build_units(const double *x, const double *y, const double *density, int per, struct ray_search_unit *units, const double *normals, int num) {
+  double xs[4*RAY_MAX_SAMPLES*RAY_MAX_LANES], ys[4*RAY_MAX_SAMPLES*RAY_MAX_LANES], vals[4*RAY_MAX_SAMPLES*RAY_MAX_LANES];
+  struct ray_search_unit *unit;
+  int i, n, o;
+  for (n=0; n < num; n++) {
+    unit = &(units[n]);
+    o = n/per;
+    unit->surf.norm[0] = normals[n];
+    unit->surf.tan[0] = normals[n]+90.0;
+    unit->surf.norm[1] = normals[n]+180.0;
+    unit->surf.tan[1] = normals[n]+270.0;
+    //let's make sure things don't get out of hand
+    for (i=0; i<2; i++) {
+      if (unit->surf.tan[i] > 360.0) {
+        unit->surf.tan[i] -= 360.0;
+      }
+      if (unit->surf.norm[i] > 360.0) {
+        unit->surf.norm[i] -= 360.0;
+      }
+    }
+    //where to sample
+    for (i=0; i<2; i++) {
+      ray_surface_point(x[o],y[o],unit->surf.tan[i],RAY_STEP/3.0,&(xs[n*4+i*2]),&(ys[n*4+i*2]));
+      ray_surface_point(x[o],y[o],unit->surf.norm[i],RAY_STEP/3.0,&(xs[n*4+i*2+1]),&(ys[n*4+i*2+1]));
+    }
+  }
+  atmos_val_batch(xs,ys,vals,num*4,INTERPOLATION_TYPE);
+  for (n=0; n < num; n++) {
+    unit = &(units[n]);
+    o = n/per;
+    //fill rest of values
+    for (i=0; i<2; i++) {
+      unit->tan[i] = vals[n*4+i*2];
+      unit->norm[i] = vals[n*4+i*2+1];
+    }
+    //give it a match score
+    unit->score = 0.0;
+    unit->score += density[o] - unit->norm[0]; //big neg. diff = more points
+    unit->score += unit->norm[1] - density[o]; //big pos. diff = more points
+    unit->score -= fabs(density[o] - unit->tan[0]); //any diff = less points
+    unit->score -= fabs(density[o] - unit->tan[1]); //any diff = less points
+  }
+  return;
+}
+/*
+ |  Find the surface angles at several points at once (`num` of them,
+ |  each with the density there). Every point goes through the same
+ |  search in lockstep, so each round of samples for all of them is
+ |  taken in one batch.
+ |
+ |  Consecutive steps of a ray are one pixel apart, so its surface
+ |  barely turns between them. If `warm[n]` is set, `last[n]` is the
+ |  surface found at the previous step, and we only take the few
+ |  samples of the full scatter in a narrow window around it. If
+ |  the best of the window is at its edge (the surface turned further
+ |  than that), or its score has dropped well below the last one, we
+ |  scatter all the way around after all. Either way, `last[n]` gets
+ |  the new surface.
+ |
+ |  Then we hone in by probing halfway toward each neighbor. A point
+ |  is done once neither probe beats its neighbor, since from then on
+ |  the same probes would come back every round.
+ */
+void ray_find_surfaces(const double *x, const double *y, const double *density, int num, struct ray_search_unit *last, int *warm, struct ray_surface *out) {
+  struct ray_search_unit units[RAY_MAX_SAMPLES*RAY_MAX_LANES], probes[2*RAY_MAX_LANES];
+  struct ray_search_unit best[RAY_MAX_LANES], left[RAY_MAX_LANES], right[RAY_MAX_LANES];
+  struct atmos_coord coord;
+  double angles[RAY_MAX_SAMPLES*RAY_MAX_LANES], base;
+  double px[RAY_MAX_LANES], py[RAY_MAX_LANES], pd[RAY_MAX_LANES];
+  int pick[RAY_MAX_LANES];
+  int best_index, better;
+  int better_left, better_right, best_left, best_right;
+  int count, i, j, k, n, active;
+  if (num == 0) {
+    return;
+  }
+  
+  //look around the last surface first, where we have one
+  active = 0;
+  for (n=0; n < num; n++) {
+    if (!warm[n] || cold_search) {
+      continue;
+    }
+    //same angles the full scatter would take, so we end up in the same place whenever it would have found the same best
+    atmos_coords(x[n],y[n],&coord);
+    base = (0.5-(coord.ground/WINDOW_ARC_LENGTH)) * WINDOW_ANGLE;
+    k = (int)round((last[n].surf.norm[0] - base)/360.0*((double)RAY_MAX_SAMPLES)) - RAY_WARM_SAMPLES/2;
+    for (i=0; i < RAY_WARM_SAMPLES; i++) {
+      j = ((k+i)%RAY_MAX_SAMPLES + RAY_MAX_SAMPLES)%RAY_MAX_SAMPLES;
+      angles[active*RAY_WARM_SAMPLES+i] = (((double)j)/((double)RAY_MAX_SAMPLES))*360.0 + base;
+      if (angles[active*RAY_WARM_SAMPLES+i] > 360.0) {
+        angles[active*RAY_WARM_SAMPLES+i] -= 360.0;
+      }
+    }
+    px[active] = x[n];
+    py[active] = y[n];
+    pd[active] = density[n];
+    pick[active++] = n;
+  }
+  ray_search_build_units(px,py,pd,RAY_WARM_SAMPLES,units,angles,active*RAY_WARM_SAMPLES);
+  for (j=0; j < active; j++) {
+    n = pick[j];
+    for (i=0; i < RAY_WARM_SAMPLES; i++) {
+      if (i==0 || units[j*RAY_WARM_SAMPLES+i].score > units[j*RAY_WARM_SAMPLES+best_index].score) {
+        best_index = i;
+      }
+    }
+    if (
+      best_index == 0 || best_index == RAY_WARM_SAMPLES-1 ||
+      units[j*RAY_WARM_SAMPLES+best_index].score < RAY_WARM_DEGRADE*last[n].score
+    ) {
+      warm[n] = 0;
+      continue;
+    }
+    best[n] = units[j*RAY_WARM_SAMPLES+best_index];
+    right[n] = units[j*RAY_WARM_SAMPLES+best_index-1];
+    left[n] = units[j*RAY_WARM_SAMPLES+best_index+1];
+  }
+  
+  //scatter wide looking for initial best, for the rest
+  active = 0;
+  for (n=0; n < num; n++) {
+    if (warm[n] && !cold_search) {
+      continue;
+    }
+    atmos_coords(x[n],y[n],&coord);
+    base = (0.5-(coord.ground/WINDOW_ARC_LENGTH)) * WINDOW_ANGLE;
+    for (i=0; i < RAY_MAX_SAMPLES; i++) {
+      angles[active*RAY_MAX_SAMPLES+i] = (((double)i)/((double)RAY_MAX_SAMPLES))*360.0 + base;
+      if (angles[active*RAY_MAX_SAMPLES+i] > 360.0) {
+        angles[active*RAY_MAX_SAMPLES+i] -= 360.0;
+      }
+    }
+    px[active] = x[n];
+    py[active] = y[n];
+    pd[active] = density[n];
+    pick[active++] = n;
+  }
+  ray_search_build_units(px,py,pd,RAY_MAX_SAMPLES,units,angles,active*RAY_MAX_SAMPLES);
+  for (j=0; j < active; j++) {
+    n = pick[j];
+    for (i=0; i < RAY_MAX_SAMPLES; i++) {
+      if (i==0 || units[j*RAY_MAX_SAMPLES+i].score > units[j*RAY_MAX_SAMPLES+best_index].score) {
+        best_index = i;
+      }
+    }
+    //keep some notes (the scatter goes all the way around, so its ends are neighbors)
+    best[n] = units[j*RAY_MAX_SAMPLES+best_index];
+    right[n] = units[j*RAY_MAX_SAMPLES+(best_index+RAY_MAX_SAMPLES-1)%RAY_MAX_SAMPLES];
+    left[n] = units[j*RAY_MAX_SAMPLES+(best_index+1)%RAY_MAX_SAMPLES];
+  }
+  
+  //hone in on actual best point
+  for (n=0; n < num; n++) {
+    pick[n] = n;
+  }
+  active = num;
+  count = 0;
+  while (active > 0 && count < RAY_MAX_SAMPLES) {
+    //check to the right & to the left
+    for (j=0; j < active; j++) {
+      n = pick[j];
+      angles[j*2] = angle_midpoint(best[n].surf.norm[0],right[n].surf.norm[0]);
+      angles[j*2+1] = angle_midpoint(best[n].surf.norm[0],left[n].surf.norm[0]);
+      px[j] = x[n];
+      py[j] = y[n];
+      pd[j] = density[n];
+    }
+    ray_search_build_units(px,py,pd,2,probes,angles,active*2);
+    
+    i = 0;
+    for (j=0; j < active; j++) {
+      n = pick[j];
+      //did we find anything useful?
+      better = better_left = better_right = 0;
+      best_left = best_right = 0;
+      if (probes[j*2].score > right[n].score) {
+        better = 1;
+        better_right = 1;
+        if (probes[j*2].score > best[n].score) {
+          best_right = 1;
+        }
+      }
+      if (probes[j*2+1].score > left[n].score) {
+        better = 1;
+        better_left = 1;
+        if (probes[j*2+1].score > best[n].score) {
+          best_left = 1;
+        }
+      }
+      //what do we need to shuffle around?
+      if (best_right && !best_left) {
+        left[n] = best[n];
+        best[n] = probes[j*2];
+      } else if (best_left && !best_right) {
+        right[n] = best[n];
+        best[n] = probes[j*2+1];
+      } else if (best_right && best_left) {
+        if (probes[j*2].score >= probes[j*2+1].score) {
+          left[n] = best[n];
+          best[n] = probes[j*2];
+        } else {
+          right[n] = best[n];
+          best[n] = probes[j*2+1];
+        }
+      } else if (better_right || better_left) {
+        if (better_right) {
+          right[n] = probes[j*2];
+        }
+        if (better_left) {
+          left[n] = probes[j*2+1];
+        }
+      }
+      //keep going only with points which moved
+      if (better) {
+        pick[i++] = n;
+      }
+    }
+    active = i;
+    
+    //keep track of samples
+    count++;
+  }
+  
+  for (n=0; n < num; n++) {
+    out[n] = best[n].surf;
+    last[n] = best[n];
+    warm[n] = 1;
+  }
+  return;
+}
+/*
+ |  Between one frame and the next, the field only changes where the
+ |  bloops were stamped (in either frame), since everything else is
+ |  reset to the same baseline. So the sight line comes out the same,
+ |  bit for bit, up to the first node where a step could sample any
+ |  of that: we keep the last frame's nodes, along with what it takes
+ |  to carry on from each of them, and only trace from there.
+ |
+ |  This only works for a single Cartesian ray through fully simulated
+ |  frames (see `retrace_init()`), and the bloops have to be recorded
+ |  as they're stamped (see `bloop_stamps`).
+ */
+int retrace_init() {
+  if (
+    (bloop_stamps = (struct ray_stamp *)mem_calloc(MEM_BLOOP, sizeof(struct ray_stamp), BLOOP_NUM)) == NULL ||
+    (history.stamps = (struct ray_stamp *)mem_calloc(MEM_BLOOP, sizeof(struct ray_stamp), BLOOP_NUM)) == NULL ||
+    (history.nodes = (struct ray_node *)mem_calloc(MEM_RAY, sizeof(struct ray_node), RAY_MAX_NODES)) == NULL ||
+    (history.steps = (struct ray_step *)mem_calloc(MEM_RAY, sizeof(struct ray_step), RAY_MAX_NODES)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  history.num = 0;
+  return 0;
+}
+void retrace_free() {
+  mem_free(bloop_stamps);
+  mem_free(history.stamps);
+  mem_free(history.nodes);
+  mem_free(history.steps);
+  bloop_stamps = NULL;
+  memset(&history, 0, sizeof(struct ray_history));
+  return;
+}
+/*
+ |  Could a step at the given node (altitude & ground point) sample
+ |  anything this bloop's stamp changed? Outside its ellipse the stamp
+ |  multiplies by exactly 1, so that's all we need to stay clear of,
+ |  with a margin for how far from the node a step samples. The pixel
+ |  axes are turned from the altitude & ground axes by up to half the
+ |  window's angle, so a pixel spans up to (cos + sin of that angle)
+ |  /IMAGE_RES kilometers of either (`RETRACE_REACH` covers the whole
+ |  margin), and in the bloop's stretched space altitude counts `ratio`
+ |  times over.
+ */
+int retrace_hit(const struct ray_stamp *stamp, const struct atmos_coord *coord) {
+  double ratio, sh, sv, reach;
+  if (!stamp->stamped) {
+    return 0;
+  }
+  ratio = stamp->radh / stamp->radv;
+  sh = coord->ground - stamp->coord.ground;
+  sv = (coord->alt - stamp->coord.alt)*ratio;
+  reach = stamp->radh + (1.0 + ratio)*RETRACE_REACH;
+  return (sh*sh + sv*sv <= reach*reach);
+}
+//find how many of the last sight line's nodes are still good
+void retrace_check() {
+  struct atmos_coord coord;
+  int i, b;
+  for (i=0; i < history.num; i++) {
+    atmos_coords(history.nodes[i].x,history.nodes[i].y,&coord);
+    for (b=0; b < BLOOP_NUM; b++) {
+      if (retrace_hit(&(bloop_stamps[b]),&coord) || retrace_hit(&(history.stamps[b]),&coord)) {
+        history.keep = i;
+        return;
+      }
+    }
+  }
+  history.keep = history.num;
+  return;
+}
+//remember how to carry on from a ray's last node
+void retrace_record(struct atmos_ray *ray) {
+  struct ray_step *step = &(history.steps[ray->num-1]);
+  history.nodes[ray->num-1] = ray->end[0];
+  step->dir_c = ray->dir_c;
+  step->dir_p = ray->dir_p;
+  step->density = ray->density;
+  step->last = ray->last;
+  step->warm = ray->warm;
+  return;
+}
+//put back the good part of the last sight line, into a ray fresh from `ray_init()`
+int retrace_restore(struct atmos_ray *ray) {
+  struct ray_step *step;
+  struct ray_node *nodes;
+  int size;
+  if (history.keep == 0) {
+    retrace_record(ray);
+    return 0;
+  }
+  if (ray->buffsize <= history.keep) {
+    for (size=ray->buffsize; size <= history.keep; size *= 2);
+    if ((nodes = (struct ray_node *)mem_realloc(ray->nodes, sizeof(struct ray_node) * size)) == NULL) {
+      fprintf(stderr, "realloc(): %s\n", strerror(errno));
+      return -1;
+    }
+    ray->nodes = nodes;
+    ray->buffsize = size;
+  }
+  memcpy(ray->nodes, history.nodes, sizeof(struct ray_node)*history.keep);
+  ray->num = history.keep;
+  ray->end = &(ray->nodes[ray->num-1]);
+  step = &(history.steps[ray->num-1]);
+  ray->dir_c = step->dir_c;
+  ray->dir_p = step->dir_p;
+  ray->density = step->density;
+  ray->last = step->last;
+  ray->warm = step->warm;
+  return 0;
+}
+/*
+ |  Trace every lane of the packet another step. Lanes which have
+ |  ended (`active` is 0) are left alone. The density samples for all
+ |  the lanes are taken together, and while a lane is still close to
+ |  the reference lane, it refracts off the same surface instead of
+ |  searching for its own. The lanes only drift apart by a hair, and
+ |  the search is by far the most expensive part of a step; separate
+ |  searches that close together mostly add their own noise to the
+ |  difference between the lanes.
+ */
+int packet_walk(struct ray_packet *p, const int *active) {
+  struct atmos_ray *ray;
+  struct ray_node *node, *ref;
+  struct ray_surface surfaces[RAY_MAX_LANES], found[RAY_MAX_LANES];
+  struct vectorP3D prev_p[RAY_MAX_LANES];
+  double prev_d[RAY_MAX_LANES];
+  double xs[2*RAY_MAX_LANES], ys[2*RAY_MAX_LANES], ds[2*RAY_MAX_LANES];
+  double sx[RAY_MAX_LANES], sy[RAY_MAX_LANES], sd[RAY_MAX_LANES];
+  struct ray_search_unit last[RAY_MAX_LANES];
+  int warm[RAY_MAX_LANES];
+  double d1, d2;
+  double incoming_normal, outgoing_normal;
+  double incoming_density, outgoing_density;
+  double incident_angle, new_angle;
+  double step;
+  int lane[RAY_MAX_LANES], refract[RAY_MAX_LANES], shared[RAY_MAX_LANES];
+  int num, search, i, l;
+  
+  //add new nodes
+  num = 0;
+  for (l=0; l < p->lanes; l++) {
+    if (!active[l]) {
+      continue;
+    }
+    ray = &(p->ray[l]);
+    //remember old values
+    prev_d[l] = ray->density;
+    vectorP3D_assign(&(prev_p[l]),ray->dir_p);
+    node = &(ray->nodes[ray->num++]);
+    node->x = ray->end->x + ray->dir_c.x*RAY_STEP;
+    node->y = ray->end->y - ray->dir_c.z*RAY_STEP;
+    xs[num] = node->x;
+    ys[num] = node->y;
+    lane[num++] = l;
+    //check buffer size (which may move the nodes)
+    if (ray_buff(ray) == -1) {
+      return -1;
+    }
+    ray->end = &(ray->nodes[ray->num-1]);
+  }
+  atmos_val_batch(xs,ys,ds,num,INTERPOLATION_TYPE);
+  for (i=0; i < num; i++) {
+    p->ray[lane[i]].density = ds[i];
+  }
+  
+  //if no refraction, then a lane is done
+  for (l=0; l < p->lanes; l++) {
+    refract[l] = (active[l] && ray_sample_compare(prev_d[l],p->ray[l].density) != 0);
+  }
+  //find refractive surface angles, searching for the reference lane first
+  ref = p->ray[p->ref].end;
+  search = 0;
+  for (i=0; i < p->lanes; i++) {
+    l = (i == 0 ? p->ref : (i <= p->ref ? i-1 : i));
+    shared[l] = 0;
+    if (!refract[l]) {
+      continue;
+    }
+    node = p->ray[l].end;
+    if (l != p->ref && refract[p->ref] && hypot(node->x-ref->x,node->y-ref->y) <= RAY_PACKET_SHARE) {
+      shared[l] = 1;
+      continue;
+    }
+    sx[search] = node->x;
+    sy[search] = node->y;
+    sd[search] = p->ray[l].density;
+    last[search] = p->ray[l].last;
+    warm[search] = p->ray[l].warm;
+    lane[search++] = l;
+  }
+  ray_find_surfaces(sx,sy,sd,search,last,warm,found);
+  for (i=0; i < search; i++) {
+    surfaces[lane[i]] = found[i];
+    p->ray[lane[i]].last = last[i];
+    p->ray[lane[i]].warm = warm[i];
+  }
+  
+  //prepare refraction context
+  num = 0;
+  for (l=0; l < p->lanes; l++) {
+    if (!refract[l]) {
+      continue;
+    }
+    if (shared[l]) {
+      surfaces[l] = surfaces[p->ref];
+      p->ray[l].last = p->ray[p->ref].last;
+      p->ray[l].warm = p->ray[p->ref].warm;
+    }
+    node = p->ray[l].end;
+    step = sin((prev_p[l].y-surfaces[l].tan[1])*PI/180.0)*RAY_STEP;
+    ray_surface_point(node->x,node->y,surfaces[l].norm[0],step,&(xs[num*2]),&(ys[num*2]));
+    ray_surface_point(node->x,node->y,surfaces[l].norm[1],step,&(xs[num*2+1]),&(ys[num*2+1]));
+    lane[num++] = l;
+  }
+  atmos_val_batch(xs,ys,ds,num*2,INTERPOLATION_TYPE);
+  
+  for (i=0; i < num; i++) {
+    l = lane[i];
+    ray = &(p->ray[l]);
+    d1 = ds[i*2];
+    d2 = ds[i*2+1];
+    if (vector_compare(surfaces[l].tan[0],prev_p[l].y,surfaces[l].norm[0])) {
+      //incident ray is outside
+      incoming_normal = surfaces[l].norm[0];
+      incoming_density = d1;
+      outgoing_normal = surfaces[l].norm[1];
+      outgoing_density = d2;
+    } else {
+      //incident ray is inside
+      incoming_normal = surfaces[l].norm[1];
+      incoming_density = d2;
+      outgoing_normal = surfaces[l].norm[0];
+      outgoing_density = d1;
+    }
+    incident_angle = prev_p[l].y + 180.0 - incoming_normal;
+    //alter direction accord. to Snell's Law, with this lane's own constant
+    new_angle = snells_law(
+      incident_angle,
+      incoming_density,
+      outgoing_density,
+      p->gd[l]
+    ) + outgoing_normal;
+    
+    //save new direction
+    ray->dir_p.x = 0.0;
+    ray->dir_p.y = new_angle;
+    ray->dir_p.l = 1.0;
+    vectorC3D_assign(&(ray->dir_c),vectorP3D_cartesian(ray->dir_p));
+  }
+  return 0;
+}
+//trace every lane of the packet through the current density field, until each one leaves the window (progress bar is optional)
+int packet_trace(struct ray_packet *p, struct spb_instance *spb) {
+  int active[RAY_MAX_LANES];
+  int l, more, fed;
+  for (l=0; l < p->lanes; l++) {
+    if (ray_init(&(p->ray[l]),p->elevation) == -1) {
+      return -1;
+    }
+    active[l] = 1;
+  }
+  if (p->retrace) {
+    if (retrace_restore(&(p->ray[0])) == -1) {
+      return -1;
+    }
+  }
+  fed = (p->stream ? ray_consume(&(p->ray[p->ref]),0) : 0);
+  if (p->retrace && history.keep > 0 && history.keep == history.num) {
+    //none of it changed
+    return 0;
+  }
+  do {
+    if (packet_walk(p,active) == -1) {
+      return -1;
+    }
+    if (p->retrace) {
+      retrace_record(&(p->ray[0]));
+    }
+    if (p->stream) {
+      fed = ray_consume(&(p->ray[p->ref]),fed);
+    }
+    if (ENABLE_TURBULENCE && spb != NULL && spb->real_progress < spb->real_goal) {
+      spb_update(spb);
+    }
+    more = 0;
+    for (l=0; l < p->lanes; l++) {
+      active[l] = active[l] && p->ray[l].num < RAY_MAX_NODES && atmos_bounds(p->ray[l].end->x,p->ray[l].end->y);
+      more = more || active[l];
+    }
+  } while (more);
+  return 0;
+}
+/*
+ |  Trace the whole sight line through the current density field
+ |  (progress bar is optional). With `--dispersion`, it's traced as
+ |  the reference lane of a packet of wavelengths, and the other lanes
+ |  stay in `packet` until `packet_free()`.
+ */
+int ray_trace(struct spb_instance *spb) {
+  int l;
+  if (dispersion) {
+    packet.lanes = DISPERSION_NUM;
+    for (l=0; l < DISPERSION_NUM; l++) {
+      packet.gd[l] = gladstone_dale(DISPERSION_WAVELENGTHS[l]);
+      if (DISPERSION_WAVELENGTHS[l] == DISPERSION_REF_WAVELENGTH) {
+        packet.ref = l;
+      }
+    }
+  } else {
+    packet.lanes = 1;
+    packet.ref = 0;
+  }
+  packet.elevation = 0.0;
+  packet.gd[packet.ref] = GLADSTONEDALE_CONST;
+  packet.retrace = (history.nodes != NULL && packet.lanes == 1);
+  if (packet.retrace) {
+    retrace_check();
+  }
+  packet.stream = (ray_consumer_num > 0);
+  //pick up the last sight line's buffer, if it's still around
+  if (packet.ray[packet.ref].nodes == NULL) {
+    packet.ray[packet.ref] = sight;
+    memset(&sight, 0, sizeof(struct atmos_ray));
+  }
+  if (packet_trace(&packet,spb) == -1) {
+    return -1;
+  }
+  if (packet.retrace) {
+    history.num = packet.ray[0].num;
+    memcpy(history.stamps, bloop_stamps, sizeof(struct ray_stamp)*BLOOP_NUM);
+    history.reused += history.keep;
+    history.traced += history.num - history.keep;
+  }
+  //the sight line takes over the reference lane's nodes
+  sight = packet.ray[packet.ref];
+  memset(&(packet.ray[packet.ref]), 0, sizeof(struct atmos_ray));
+  return 0;
+}
+//mark a sight line node on the density map's sight line layer (a `ray_consumer`)
+void ray_render_node(const struct atmos_ray *ray, const struct ray_node *node, int index, void *data) {
+  double **ray_img = (double **)data;
+  double ox, oy;
+  int x, y;
+  output_coords(node->x,node->y,&ox,&oy);
+  x = (int)round(ox);
+  y = (int)round(oy);
+  if (x >= 0 && x < OUTPUT_WIDTH && y >= 0 && y < OUTPUT_HEIGHT) {
+    ray_img[y][x] = 1.0;
+  }
+  return;
+}
+/*
+ |  How many steps (`RAY_STEP` apart, from the given window point in
+ |  the given direction) a straight line is sure to stay inside the
+ |  window. The window is bounded by two circles (the ground & the
+ |  top of the window) and two radial lines (its left & right edges),
+ |  so where the line crosses each one is just a quadratic or linear
+ |  equation in the number of steps. The step right at the crossing is
+ |  held back, since it could go either way with rounding, so callers
+ |  still check the last step or two with `atmos_bounds()`.
+ */
+int line_clip(double x, double y, struct vectorC3D diff) {
+  double px, pz, dx, dz, ux, uz;
+  double a, b, c, disc, r, t, k, edge, den;
+  int side;
+  if (!atmos_bounds(x,y)) {
+    return 0;
+  }
+  //start & step in kilometers from the center of the Earth (see `atmos_coords()`)
+  px = (x/IMAGE_WIDTH)*(WINDOW_RIGHT-WINDOW_LEFT) + WINDOW_LEFT;
+  pz = ((IMAGE_HEIGHT-y)/IMAGE_HEIGHT)*(WINDOW_TOP-WINDOW_BOTTOM) + WINDOW_BOTTOM;
+  dx = diff.x*RAY_STEP*(WINDOW_RIGHT-WINDOW_LEFT)/IMAGE_WIDTH;
+  dz = diff.z*RAY_STEP*(WINDOW_TOP-WINDOW_BOTTOM)/IMAGE_HEIGHT;
+  k = INFINITY;
+  //ground & top of the window (the nearer crossing ahead of us, if any)
+  a = dx*dx + dz*dz;
+  b = 2.0*(px*dx + pz*dz);
+  for (side=0; side < 2; side++) {
+    r = EARTH_RADIUS + (side ? WINDOW_ALTITUDE : 0.0);
+    c = px*px + pz*pz - r*r;
+    disc = b*b - 4.0*a*c;
+    if (a == 0.0 || disc < 0.0) {
+      continue;
+    }
+    t = (-b - sqrt(disc))/(2.0*a);
+    if (t <= 0.0) {
+      t = (-b + sqrt(disc))/(2.0*a);
+    }
+    if (t > 0.0) {
+      k = fmin(k,t);
+    }
+  }
+  //left & right edges
+  for (side=0; side < 2; side++) {
+    edge = (90.0 + (side ? -0.5 : 0.5)*WINDOW_ANGLE)*PI/180.0;
+    ux = cos(edge);
+    uz = sin(edge);
+    den = dx*uz - dz*ux;
+    if (den == 0.0) {
+      continue;
+    }
+    t = (pz*ux - px*uz)/den;
+    if (t > 0.0 && (px+t*dx)*ux + (pz+t*dz)*uz > 0.0) {
+      k = fmin(k,t);
+    }
+  }
+  if (isinf(k)) {
+    return 0;
+  }
+  return (int)floor(k);
+}
+//render straight line (optionally as a dotted line) to temporary image buffer
+void line_draw(struct spb_instance *spb, double **img, double start_x, double start_y, struct vectorP3D angle, int dotted) {
+  struct vectorC3D diff;
+  double x = start_x;
+  double y = start_y;
+  double ox, oy;
+  int ix, iy;
+  int count, safe;
+  vectorC3D_assign(&diff,vectorP3D_cartesian(angle));
+  
+  //no need to check the bounds until we get near the edge
+  safe = line_clip(x,y,diff);
+  count = 0;
+  while (count < safe || atmos_bounds(x,y)) {
+    
+    output_coords(x,y,&ox,&oy);
+    ix = (int)round(ox);
+    iy = (int)round(oy);
+    if (
+      (ix >= 0 && ix < OUTPUT_WIDTH) &&
+      (iy >= 0 && iy < OUTPUT_HEIGHT) &&
+      //dashes are 4 output pixels long
+      (!dotted || ((int)((((double)count)*OUTPUT_WIDTH)/(4.0*IMAGE_WIDTH)))%2)
+    ) {
+      img[iy][ix] = 1.0;
+    }
+    
+    x += diff.x*RAY_STEP;
+    y -= diff.z*RAY_STEP;
+    count++;
+  }
+  if (ENABLE_TURBULENCE && spb != NULL && spb->real_progress < spb->real_goal) {
+    spb_update(spb);
+  }
+  return;
+}
+//measure the ray's deviation from straight at the given node (distance in km, anomaly in degrees)
+void ang_anom_calc(const struct atmos_ray *ray, const struct ray_node *node, double *dist, double *anom) {
+  struct vectorC3D c;
+  //transform node into coordinates relative to the straight line
+  c.x = node->x - ray->nodes[0].x;
+  c.y = 0.0;
+  c.z = ray->nodes[0].y - node->y;
+  vectorC3D_rotateY(&c,ray->start_p.y);
+  //calculate values
+  dist[0] = c.x/IMAGE_RES;
+  anom[0] = fabs(atan(c.z/c.x)*180.0/PI);
+  return;
+}
+//plot a sight line node on the angular anomaly chart (a `ray_consumer`)
+void ang_anom_node(const struct atmos_ray *ray, const struct ray_node *node, int index, void *data) {
+  double **img = (double **)data;
+  double dist, anom;
+  double chart_x, chart_y;
+  int x, y;
+  ang_anom_calc(ray,node,&dist,&anom);
+  //find position on chart image
+  chart_x = (dist/ANOM_WINDOW_WIDTH)*ANOM_CHART_WIDTH + ANOM_CHART_X;
+  chart_y = ANOM_CHART_HEIGHT - (anom/ANOM_WINDOW_HEIGHT)*ANOM_CHART_HEIGHT + ANOM_CHART_Y;
+  x = (int)round(chart_x);
+  y = (int)round(chart_y);
+  //if safe, mark a pixel
+  if ((x >= 0 && x < ANOM_IMAGE_WIDTH) && (y >= 0 && y < ANOM_IMAGE_HEIGHT)) {
+    img[y][x] = 1.0;
+  }
+  return;
+}
+
+/*
+ |  ============
+ |  FRAME OUTPUT
+ |  ============
+ */
+
+/*
+ |  Composite the density map at the simulation's own resolution. The
+ |  layers, from the bottom up:
+ |  1. density colors
+ |  2. contour lines
+ |  3. straight line reference
+ |  4. sight line
+ |  ... and everything outside the wedge-shaped window is black. The
+ |  per-pixel work is done a row at a time by a hot kernel.
+ */
+int density_map_render(struct SDL_Surface *s, double **ray_img, double **line_img) {
+  double *xs, *ys, *vals, *row;
+  int *above, *below, *contour, *inside, *swap;
+  int offset[3];
+  int x, y;
+  
+  //scratch rows for density & contour detection
+  if (
+    (xs = (double *)calloc(sizeof(double), IMAGE_WIDTH+1)) == NULL ||
+    (ys = (double *)calloc(sizeof(double), IMAGE_WIDTH+1)) == NULL ||
+    (vals = (double *)calloc(sizeof(double), IMAGE_WIDTH+1)) == NULL ||
+    (row = (double *)calloc(sizeof(double), IMAGE_WIDTH)) == NULL ||
+    (above = (int *)calloc(sizeof(int), IMAGE_WIDTH+1)) == NULL ||
+    (below = (int *)calloc(sizeof(int), IMAGE_WIDTH+1)) == NULL ||
+    (contour = (int *)calloc(sizeof(int), IMAGE_WIDTH)) == NULL ||
+    (inside = (int *)calloc(sizeof(int), IMAGE_WIDTH)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  offset[0] = s->format->Rshift/8;
+  offset[1] = s->format->Gshift/8;
+  offset[2] = s->format->Bshift/8;
+  
+  contour_sample_row(-0.5,xs,ys,vals,below);
+  for (y=0; y < IMAGE_HEIGHT; y++) {
+    //bottom corners of the previous row are top corners of this one
+    swap = above;
+    above = below;
+    below = swap;
+    contour_sample_row(((double)y)+0.5,xs,ys,vals,below);
+    contour_detect_row(above,below,contour);
+    atmos_row(y,row);
+    //are we inside the wedge-shaped window?
+    for (x=0; x < IMAGE_WIDTH; x++) {
+      inside[x] = atmos_bounds(x,y);
+    }
+    kernels.composite_row(&(((Uint8 *)s->pixels)[y*s->pitch]),offset,row,inside,contour,line_img[y],ray_img[y],IMAGE_WIDTH,color_ramp,COLOR_STOP_NUM);
+  }
+  free(xs);
+  free(ys);
+  free(vals);
+  free(row);
+  free(above);
+  free(below);
+  free(contour);
+  free(inside);
+  return 0;
+}
+//sample a row of output pixel corners: their density intervals, and whether they're inside the window
+void output_corner_row(int oy, double *xs, double *ys, double *vals, int *bands, int *inside) {
+  struct atmos_coord coord;
+  int ox;
+  for (ox=0; ox <= OUTPUT_WIDTH; ox++) {
+    xs[ox] = ((double)ox)*IMAGE_WIDTH/OUTPUT_WIDTH - 0.5;
+    ys[ox] = ((double)oy)*IMAGE_HEIGHT/OUTPUT_HEIGHT - 0.5;
+    atmos_coords_fast(xs[ox],ys[ox],&coord);
+    inside[ox] = atmos_coord_inside(&coord);
+  }
+  contour_sample_points(xs,ys,vals,bands,OUTPUT_WIDTH+1);
+  return;
+}
+/*
+ |  Supersample one output pixel, to find how much of it is inside
+ |  the window (`coverage`) and how strongly contour lines run through
+ |  it (`contour`, 1 for a line crossing all the way).
+ */
+void output_subsample(int ox, int oy, double *coverage, double *contour) {
+  const int n = OUTPUT_SUPERSAMPLE;
+  double xs[(OUTPUT_SUPERSAMPLE+1)*(OUTPUT_SUPERSAMPLE+1)];
+  double ys[(OUTPUT_SUPERSAMPLE+1)*(OUTPUT_SUPERSAMPLE+1)];
+  double vals[(OUTPUT_SUPERSAMPLE+1)*(OUTPUT_SUPERSAMPLE+1)];
+  int bands[(OUTPUT_SUPERSAMPLE+1)*(OUTPUT_SUPERSAMPLE+1)];
+  struct atmos_coord coord;
+  int i, j, k, inside, lines;
+  //grid of subsample corners
+  for (j=0; j <= n; j++) {
+    for (i=0; i <= n; i++) {
+      xs[j*(n+1)+i] = (ox + ((double)i)/n)*IMAGE_WIDTH/OUTPUT_WIDTH - 0.5;
+      ys[j*(n+1)+i] = (oy + ((double)j)/n)*IMAGE_HEIGHT/OUTPUT_HEIGHT - 0.5;
+    }
+  }
+  contour_sample_points(xs,ys,vals,bands,(n+1)*(n+1));
+  //check each subsample
+  inside = lines = 0;
+  for (j=0; j < n; j++) {
+    for (i=0; i < n; i++) {
+      k = j*(n+1)+i;
+      atmos_coords_fast((xs[k]+xs[k+1])/2.0,(ys[k]+ys[k+n+1])/2.0,&coord);
+      if (!atmos_coord_inside(&coord)) {
+        continue;
+      }
+      inside++;
+      if (!(bands[k] == bands[k+1] && bands[k+n+1] == bands[k+n+2] && bands[k] == bands[k+n+1])) {
+        lines++;
+      }
+    }
+  }
+  coverage[0] = ((double)inside)/(n*n);
+  //a line crossing the pixel runs through about `n` subsamples
+  contour[0] = fmin(1.0, ((double)lines)/n);
+  return;
+}
+/*
+ |  Composite the density map onto an output raster smaller than the
+ |  simulation's pixel grid. The density field is smooth at that
+ |  scale, so each output pixel takes its color from one sample at its
+ |  center. Contour lines & the edge of the window are thin, though,
+ |  so any output pixel where they show up (going by its corners) is
+ |  supersampled to find how much of it they cover.
+ */
+int density_map_render_scaled(struct SDL_Surface *s, double **ray_img, double **line_img) {
+  struct pixel pix;
+  double *xs, *ys, *vals;
+  int *above, *below, *in_above, *in_below, *swap;
+  double coverage, contour;
+  int ox, oy;
+  if (
+    (xs = (double *)calloc(sizeof(double), OUTPUT_WIDTH+1)) == NULL ||
+    (ys = (double *)calloc(sizeof(double), OUTPUT_WIDTH+1)) == NULL ||
+    (vals = (double *)calloc(sizeof(double), OUTPUT_WIDTH+1)) == NULL ||
+    (above = (int *)calloc(sizeof(int), OUTPUT_WIDTH+1)) == NULL ||
+    (below = (int *)calloc(sizeof(int), OUTPUT_WIDTH+1)) == NULL ||
+    (in_above = (int *)calloc(sizeof(int), OUTPUT_WIDTH+1)) == NULL ||
+    (in_below = (int *)calloc(sizeof(int), OUTPUT_WIDTH+1)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  output_corner_row(0,xs,ys,vals,below,in_below);
+  for (oy=0; oy < OUTPUT_HEIGHT; oy++) {
+    //bottom corners of the previous row are top corners of this one
+    swap = above;
+    above = below;
+    below = swap;
+    swap = in_above;
+    in_above = in_below;
+    in_below = swap;
+    output_corner_row(oy+1,xs,ys,vals,below,in_below);
+    //density at pixel centers
+    for (ox=0; ox < OUTPUT_WIDTH; ox++) {
+      xs[ox] = (ox+0.5)*IMAGE_WIDTH/OUTPUT_WIDTH - 0.5;
+      ys[ox] = (oy+0.5)*IMAGE_HEIGHT/OUTPUT_HEIGHT - 0.5;
+    }
+    atmos_val_batch(xs,ys,vals,OUTPUT_WIDTH,INTERPOLATION_TYPE);
+    for (ox=0; ox < OUTPUT_WIDTH; ox++) {
+      if (
+        in_above[ox] && in_above[ox+1] && in_below[ox] && in_below[ox+1] &&
+        above[ox] == above[ox+1] && below[ox] == below[ox+1] && above[ox] == below[ox]
+      ) {
+        //the usual case: all inside, no contour line
+        coverage = 1.0;
+        contour = 0.0;
+      } else if (!in_above[ox] && !in_above[ox+1] && !in_below[ox] && !in_below[ox+1]) {
+        //outside window, everything is black
+        coverage = 0.0;
+        contour = 0.0;
+      } else {
+        output_subsample(ox,oy,&coverage,&contour);
+      }
+      if (coverage > 0.0) {
+        //same layers as `density_map_render()`
+        density_to_color(&pix,vals[ox],ox,oy);
+        pix.r += contour*0.3;
+        pix.g += contour*0.3;
+        pix.b += contour*0.3;
+        pix.r += line_img[oy][ox]*1.0;
+        pix.g += line_img[oy][ox]*0.3;
+        pix.b += line_img[oy][ox]*0.0;
+        pix.r += ray_img[oy][ox];
+        pix.g += ray_img[oy][ox];
+        pix.b += ray_img[oy][ox];
+        //partly outside the window fades toward black
+        pix.r = fmin(1.0, pix.r)*coverage;
+        pix.g = fmin(1.0, pix.g)*coverage;
+        pix.b = fmin(1.0, pix.b)*coverage;
+      } else {
+        pix.r = pix.g = pix.b = 0.0;
+      }
+      pixel_insert(s,pix,ox,oy);
+    }
+  }
+  free(xs);
+  free(ys);
+  free(vals);
+  free(above);
+  free(below);
+  free(in_above);
+  free(in_below);
+  return 0;
+}
+//render the density map as a raster image, and save it
+int density_map_save(double **ray_img, double **line_img, const char *frame_file) {
+  struct SDL_Surface *s;
+  int res;
+  if ((s = mem_surface(SDL_CreateRGBSurface(0,OUTPUT_WIDTH,OUTPUT_HEIGHT,24,0,0,0,0))) == NULL) {
+    fprintf(stderr, "Failed to create SDL_Surface.\n");
+    return -1;
+  }
+  if (OUTPUT_WIDTH == IMAGE_WIDTH && OUTPUT_HEIGHT == IMAGE_HEIGHT) {
+    res = density_map_render(s,ray_img,line_img);
+  } else {
+    res = density_map_render_scaled(s,ray_img,line_img);
+  }
+  if (res == -1) {
+    return -1;
+  }
+  //output image file
+  if (png_save(s,frame_file) == -1) {
+    return -1;
+  }
+  mem_surface_free(s);
+  return 0;
+}
+/*
+ |  With `--svg`, the density map of each frame is saved as an SVG
+ |  file instead. Only the heat map stays a raster (a PNG next to the
+ |  SVG file, at the output size). Contour lines, the sight line &
+ |  the straight reference line are drawn on top as paths, in the
+ |  simulation's pixel coordinates, and everything is clipped to the
+ |  wedge-shaped window. So the lines stay sharp at any scale.
+ */
+//name of the heat map image that goes with an SVG frame
+void svg_heat_file(const char *frame_file, char *out) {
+  const char *dot = strrchr(frame_file, '.');
+  int len = (dot != NULL ? (int)(dot - frame_file) : (int)strlen(frame_file));
+  snprintf(out, MAX_STR, "%.*s.heat.png", len, frame_file);
+  return;
+}
+//check whether the given SVG frame & its heat map were completely written
+int svg_complete(const char *file) {
+  char heat_file[MAX_STR];
+  svg_heat_file(file,heat_file);
+  //the SVG file is renamed into place last
+  return (access(file, F_OK) == 0 && png_complete(heat_file));
+}
+//render just the density colors at the output size (to go under the SVG paths)
+int heat_map_render(struct SDL_Surface *s) {
+  struct pixel pix;
+  double *xs, *ys, *vals;
+  int ox, oy;
+  if (
+    (xs = (double *)calloc(sizeof(double), OUTPUT_WIDTH)) == NULL ||
+    (ys = (double *)calloc(sizeof(double), OUTPUT_WIDTH)) == NULL ||
+    (vals = (double *)calloc(sizeof(double), OUTPUT_WIDTH)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  for (oy=0; oy < OUTPUT_HEIGHT; oy++) {
+    //density at pixel centers
+    for (ox=0; ox < OUTPUT_WIDTH; ox++) {
+      xs[ox] = (ox+0.5)*IMAGE_WIDTH/OUTPUT_WIDTH - 0.5;
+      ys[ox] = (oy+0.5)*IMAGE_HEIGHT/OUTPUT_HEIGHT - 0.5;
+    }
+    atmos_val_batch(xs,ys,vals,OUTPUT_WIDTH,INTERPOLATION_TYPE);
+    for (ox=0; ox < OUTPUT_WIDTH; ox++) {
+      density_to_color(&pix,vals[ox],ox,oy);
+      pixel_insert(s,pix,ox,oy);
+    }
+  }
+  free(xs);
+  free(ys);
+  free(vals);
+  return 0;
+}
+/*
+ |  Contour lines are found with marching squares, over the same
+ |  pixel corner samples used for contour detection in the raster
+ |  output. Where a line crosses a pixel, it leaves a segment between
+ |  two of the pixel's edges. Each edge of the pixel grid has an ID:
+ |  `2*(y*(IMAGE_WIDTH+1)+x)` for the top edge of pixel (x,y), and
+ |  one more than that for its left edge. Since neighboring pixels
+ |  share edges, segments are then linked into polylines by ID.
+ */
+struct svg_segment {
+  long a, b; //edge IDs at either end
+  double ax, ay, bx, by; //end points
+};
+struct svg_contour {
+  struct svg_segment *segs;
+  int num, buffsize;
+};
+//add a segment to a contour line
+int svg_segment_add(struct svg_contour *c, long a, double ax, double ay, long b, double bx, double by) {
+  struct svg_segment *seg;
+  if (c->num == c->buffsize) {
+    c->buffsize = MAX(1024, c->buffsize*2);
+    if ((c->segs = (struct svg_segment *)realloc(c->segs, sizeof(struct svg_segment)*c->buffsize)) == NULL) {
+      fprintf(stderr, "realloc(): %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  seg = &(c->segs[c->num++]);
+  seg->a = a;
+  seg->ax = ax;
+  seg->ay = ay;
+  seg->b = b;
+  seg->bx = bx;
+  seg->by = by;
+  return 0;
+}
+/*
+ |  Add the segments of a contour line where it crosses pixel (x,y).
+ |  `v` is the density at the pixel's corners, clockwise from top
+ |  left. Pixel edges are numbered clockwise from the top too.
+ */
+int svg_contour_cell(struct svg_contour *c, double level, int x, int y, const double *v) {
+  //pairs of edges joined by a segment, for each combination of corners above the level
+  const int cases[16][4] = {
+    {-1,-1,-1,-1}, {3,2,-1,-1}, {2,1,-1,-1}, {3,1,-1,-1},
+    {0,1,-1,-1}, {3,0,2,1}, {0,2,-1,-1}, {3,0,-1,-1},
+    {3,0,-1,-1}, {0,2,-1,-1}, {0,1,3,2}, {0,1,-1,-1},
+    {3,1,-1,-1}, {2,1,-1,-1}, {3,2,-1,-1}, {-1,-1,-1,-1}
+  };
+  //corners of each edge (clockwise from top left), and the edge IDs
+  const int ends[4][2] = {{0,1}, {1,2}, {3,2}, {0,3}};
+  const double cx[4] = {x-0.5, x+0.5, x+0.5, x-0.5};
+  const double cy[4] = {y-0.5, y-0.5, y+0.5, y+0.5};
+  long ids[4];
+  double px[4], py[4], t;
+  int k, e, index, pairs[4];
+  ids[0] = 2*((long)y*(IMAGE_WIDTH+1)+x);
+  ids[1] = 2*((long)y*(IMAGE_WIDTH+1)+x+1)+1;
+  ids[2] = 2*((long)(y+1)*(IMAGE_WIDTH+1)+x);
+  ids[3] = ids[0]+1;
+  index = (v[0] > level)*8 + (v[1] > level)*4 + (v[2] > level)*2 + (v[3] > level);
+  memcpy(pairs, cases[index], sizeof(pairs));
+  //saddles: the table joins the two corners above the level through the middle, unless the middle is below it
+  if ((index == 5 || index == 10) && (v[0]+v[1]+v[2]+v[3])/4.0 <= level) {
+    memcpy(pairs, cases[15-index], sizeof(pairs));
+  }
+  //where the line crosses each edge
+  for (e=0; e < 4; e++) {
+    t = (level - v[ends[e][0]])/(v[ends[e][1]] - v[ends[e][0]]);
+    px[e] = (cx[ends[e][1]] - cx[ends[e][0]])*t + cx[ends[e][0]];
+    py[e] = (cy[ends[e][1]] - cy[ends[e][0]])*t + cy[ends[e][0]];
+  }
+  for (k=0; k < 4 && pairs[k] != -1; k += 2) {
+    if (svg_segment_add(c,ids[pairs[k]],px[pairs[k]],py[pairs[k]],ids[pairs[k+1]],px[pairs[k+1]],py[pairs[k+1]]) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+//find the segments of every contour line, in pixels at least partly inside the window (the rest gets clipped)
+int svg_contours_find(struct svg_contour *contours) {
+  struct atmos_coord coord;
+  double *xs, *ys, *above, *below, *swap_vals;
+  int *bands, *in_above, *in_below, *swap;
+  double v[4];
+  int x, y, i;
+  if (
+    (xs = (double *)calloc(sizeof(double), IMAGE_WIDTH+1)) == NULL ||
+    (ys = (double *)calloc(sizeof(double), IMAGE_WIDTH+1)) == NULL ||
+    (above = (double *)calloc(sizeof(double), IMAGE_WIDTH+1)) == NULL ||
+    (below = (double *)calloc(sizeof(double), IMAGE_WIDTH+1)) == NULL ||
+    (bands = (int *)calloc(sizeof(int), IMAGE_WIDTH+1)) == NULL ||
+    (in_above = (int *)calloc(sizeof(int), IMAGE_WIDTH+1)) == NULL ||
+    (in_below = (int *)calloc(sizeof(int), IMAGE_WIDTH+1)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  for (y=0; y <= IMAGE_HEIGHT; y++) {
+    //bottom corners of the previous row are top corners of this one
+    swap_vals = above;
+    above = below;
+    below = swap_vals;
+    swap = in_above;
+    in_above = in_below;
+    in_below = swap;
+    contour_sample_row(((double)y)-0.5,xs,ys,below,bands);
+    for (x=0; x <= IMAGE_WIDTH; x++) {
+      atmos_coords_fast(xs[x],ys[x],&coord);
+      in_below[x] = atmos_coord_inside(&coord);
+    }
+    if (y == 0) {
+      continue;
+    }
+    for (x=0; x < IMAGE_WIDTH; x++) {
+      if (!in_above[x] && !in_above[x+1] && !in_below[x] && !in_below[x+1]) {
+        continue;
+      }
+      v[0] = above[x];
+      v[1] = above[x+1];
+      v[2] = below[x+1];
+      v[3] = below[x];
+      for (i=0; i < CONTOUR_NUM; i++) {
+        if (svg_contour_cell(&(contours[i]),contour_list[i].density,x,y-1,v) == -1) {
+          return -1;
+        }
+      }
+    }
+  }
+  free(xs);
+  free(ys);
+  free(above);
+  free(below);
+  free(bands);
+  free(in_above);
+  free(in_below);
+  return 0;
+}
+//lookup table from edge ID to the (up to two) segments ending there
+struct svg_edge_slot {
+  long id; //or -1 if empty
+  int segs[2];
+};
+//find the table slot for the given edge ID (the empty slot where it would go, if it isn't there)
+struct svg_edge_slot *svg_edge_slot(struct svg_edge_slot *table, long mask, long id) {
+  long i = (id * 0x9E3779B97F4A7C15L) & mask;
+  while (table[i].id != -1 && table[i].id != id) {
+    i = (i+1) & mask;
+  }
+  return &(table[i]);
+}
+//the other segment ending at the given edge, or -1 if none
+int svg_edge_next(struct svg_edge_slot *table, long mask, long id, int seg) {
+  struct svg_edge_slot *slot = svg_edge_slot(table,mask,id);
+  if (slot->id == -1) {
+    return -1;
+  }
+  return (slot->segs[0] == seg ? slot->segs[1] : slot->segs[0]);
+}
+/*
+ |  Thin out the points of a polyline between `first` & `last` (which
+ |  are kept), so that it strays no further than SVG_TOLERANCE from
+ |  the original line (the Ramer-Douglas-Peucker algorithm).
+ */
+void svg_simplify(const double *xs, const double *ys, char *keep, int first, int last) {
+  double dx, dy, len, dist, max;
+  int i, far;
+  if (last - first < 2) {
+    return;
+  }
+  dx = xs[last] - xs[first];
+  dy = ys[last] - ys[first];
+  len = sqrt(dx*dx + dy*dy);
+  //find the point furthest from the chord
+  max = -1.0;
+  far = first;
+  for (i=first+1; i < last; i++) {
+    if (len > 0.0) {
+      dist = fabs(dx*(ys[first]-ys[i]) - dy*(xs[first]-xs[i]))/len;
+    } else {
+      dist = hypot(xs[i]-xs[first], ys[i]-ys[first]);
+    }
+    if (dist > max) {
+      max = dist;
+      far = i;
+    }
+  }
+  if (max > SVG_TOLERANCE) {
+    keep[far] = 1;
+    svg_simplify(xs,ys,keep,first,far);
+    svg_simplify(xs,ys,keep,far,last);
+  }
+  return;
+}
+//write a polyline as (part of) SVG path data, leaving out the points it doesn't need
+int svg_polyline_write(FILE *fp, const double *xs, const double *ys, int num) {
+  char *keep;
+  int i;
+  if ((keep = (char *)calloc(sizeof(char), num)) == NULL) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  keep[0] = keep[num-1] = 1;
+  svg_simplify(xs,ys,keep,0,num-1);
+  for (i=0; i < num; i++) {
+    if (keep[i]) {
+      fprintf(fp, "%s%.1lf,%.1lf", (i == 0 ? "M" : " "), xs[i], ys[i]);
+    }
+  }
+  free(keep);
+  return 0;
+}
+//link a contour line's segments into polylines, and write them out as one SVG path
+int svg_contour_write(FILE *fp, struct svg_contour *c) {
+  struct svg_edge_slot *table, *slot;
+  struct svg_segment *seg;
+  double *xs, *ys;
+  char *used;
+  long size, mask, edge;
+  int i, num, cur, next;
+  if (c->num == 0) {
+    return 0;
+  }
+  for (size=1; size < 4L*c->num; size *= 2);
+  mask = size-1;
+  if (
+    (table = (struct svg_edge_slot *)malloc(sizeof(struct svg_edge_slot)*size)) == NULL ||
+    (used = (char *)calloc(sizeof(char), c->num)) == NULL ||
+    (xs = (double *)calloc(sizeof(double), c->num+1)) == NULL ||
+    (ys = (double *)calloc(sizeof(double), c->num+1)) == NULL
+  ) {
+    fprintf(stderr, "malloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  for (i=0; i < size; i++) {
+    table[i].id = -1;
+    table[i].segs[0] = table[i].segs[1] = -1;
+  }
+  for (i=0; i < c->num; i++) {
+    slot = svg_edge_slot(table,mask,c->segs[i].a);
+    slot->id = c->segs[i].a;
+    slot->segs[slot->segs[0] == -1 ? 0 : 1] = i;
+    slot = svg_edge_slot(table,mask,c->segs[i].b);
+    slot->id = c->segs[i].b;
+    slot->segs[slot->segs[0] == -1 ? 0 : 1] = i;
+  }
+  fprintf(fp, "  <path vector-effect=\"non-scaling-stroke\" d=\"");
+  for (i=0; i < c->num; i++) {
+    if (used[i]) {
+      continue;
+    }
+    //walk back to the start of the line (or all the way around, if it's a loop)
+    cur = i;
+    edge = c->segs[i].a;
+    while ((next = svg_edge_next(table,mask,edge,cur)) != -1 && next != i) {
+      cur = next;
+      edge = (c->segs[cur].a == edge ? c->segs[cur].b : c->segs[cur].a);
+    }
+    //then forward to the end, marking the way
+    seg = &(c->segs[cur]);
+    xs[0] = (seg->a == edge ? seg->ax : seg->bx);
+    ys[0] = (seg->a == edge ? seg->ay : seg->by);
+    num = 1;
+    while (1) {
+      used[cur] = 1;
+      seg = &(c->segs[cur]);
+      edge = (seg->a == edge ? seg->b : seg->a);
+      xs[num] = (seg->a == edge ? seg->ax : seg->bx);
+      ys[num] = (seg->a == edge ? seg->ay : seg->by);
+      num++;
+      if ((next = svg_edge_next(table,mask,edge,cur)) == -1 || used[next]) {
+        break;
+      }
+      cur = next;
+    }
+    if (svg_polyline_write(fp,xs,ys,num) == -1) {
+      return -1;
+    }
+  }
+  fprintf(fp, "\"/>\n");
+  free(table);
+  free(used);
+  free(xs);
+  free(ys);
+  return 0;
+}
+//save the density map of the current frame as SVG (see above)
+int svg_frame_save(const char *frame_file) {
+  char heat_file[MAX_STR], temp[MAX_STR];
+  struct SDL_Surface *s;
+  struct svg_contour *contours;
+  struct atmos_coord coord;
+  struct vectorC3D diff;
+  double cx[4], cy[4], rx[2], ry[2];
+  double *xs, *ys, x, y;
+  const char *heat_name;
+  FILE *fp;
+  int i, count, safe;
+  
+  //heat map raster
+  svg_heat_file(frame_file,heat_file);
+  if ((s = mem_surface(SDL_CreateRGBSurface(0,OUTPUT_WIDTH,OUTPUT_HEIGHT,24,0,0,0,0))) == NULL) {
+    fprintf(stderr, "Failed to create SDL_Surface.\n");
+    return -1;
+  }
+  if (heat_map_render(s) == -1 || png_save(s,heat_file) == -1) {
+    return -1;
+  }
+  mem_surface_free(s);
+  heat_name = ((heat_name = strrchr(heat_file, '/')) != NULL ? heat_name+1 : heat_file);
+  
+  //contour line segments
+  if ((contours = (struct svg_contour *)calloc(sizeof(struct svg_contour), CONTOUR_NUM)) == NULL) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  if (svg_contours_find(contours) == -1) {
+    return -1;
+  }
+  
+  //corners of the window (clockwise from bottom left), and radii of its arcs in pixels
+  for (i=0; i < 4; i++) {
+    coord.ground = (i < 2 ? 0.0 : WINDOW_ARC_LENGTH);
+    coord.alt = (i == 1 || i == 2 ? WINDOW_ALTITUDE : 0.0);
+    atmos_window(&(cx[i]),&(cy[i]),&coord,NULL,NULL);
+  }
+  rx[0] = EARTH_RADIUS*IMAGE_WIDTH/(WINDOW_RIGHT-WINDOW_LEFT);
+  ry[0] = EARTH_RADIUS*IMAGE_HEIGHT/(WINDOW_TOP-WINDOW_BOTTOM);
+  rx[1] = (EARTH_RADIUS+WINDOW_ALTITUDE)*IMAGE_WIDTH/(WINDOW_RIGHT-WINDOW_LEFT);
+  ry[1] = (EARTH_RADIUS+WINDOW_ALTITUDE)*IMAGE_HEIGHT/(WINDOW_TOP-WINDOW_BOTTOM);
+  
+  snprintf(temp, MAX_STR, "%s.tmp", frame_file);
+  if ((fp = fopen(temp, "w")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    return -1;
+  }
+  fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  fprintf(fp, "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" width=\"%d\" height=\"%d\" viewBox=\"-0.5 -0.5 %d %d\" preserveAspectRatio=\"none\">\n", OUTPUT_WIDTH, OUTPUT_HEIGHT, IMAGE_WIDTH, IMAGE_HEIGHT);
+  fprintf(fp, "<clipPath id=\"window\">\n");
+  fprintf(fp, "  <path d=\"M%.3lf,%.3lf L%.3lf,%.3lf A%.3lf,%.3lf 0 0 1 %.3lf,%.3lf L%.3lf,%.3lf A%.3lf,%.3lf 0 0 0 %.3lf,%.3lf Z\"/>\n",
+    cx[0], cy[0], cx[1], cy[1], rx[1], ry[1], cx[2], cy[2], cx[3], cy[3], rx[0], ry[0], cx[0], cy[0]);
+  fprintf(fp, "</clipPath>\n");
+  //outside window, everything is black
+  fprintf(fp, "<rect x=\"-0.5\" y=\"-0.5\" width=\"%d\" height=\"%d\" fill=\"#000\"/>\n", IMAGE_WIDTH, IMAGE_HEIGHT);
+  fprintf(fp, "<g clip-path=\"url(#window)\">\n");
+  //density colors
+  fprintf(fp, "<image xlink:href=\"%s\" x=\"-0.5\" y=\"-0.5\" width=\"%d\" height=\"%d\" preserveAspectRatio=\"none\"/>\n", heat_name, IMAGE_WIDTH, IMAGE_HEIGHT);
+  //contour lines
+  fprintf(fp, "<g fill=\"none\" stroke=\"#fff\" stroke-opacity=\"0.3\" stroke-width=\"1\">\n");
+  for (i=0; i < CONTOUR_NUM; i++) {
+    if (svg_contour_write(fp,&(contours[i])) == -1) {
+      fclose(fp);
+      unlink(temp);
+      return -1;
+    }
+    free(contours[i].segs);
+  }
+  free(contours);
+  fprintf(fp, "</g>\n");
+  //straight line reference, out to where it leaves the window (see `line_draw()`)
+  vectorC3D_assign(&diff,vectorP3D_cartesian(sight.start_p));
+  x = sight.nodes[0].x;
+  y = sight.nodes[0].y;
+  safe = line_clip(x,y,diff);
+  for (count=1; count < safe || atmos_bounds(x + diff.x*RAY_STEP, y - diff.z*RAY_STEP); count++) {
+    x += diff.x*RAY_STEP;
+    y -= diff.z*RAY_STEP;
+  }
+  fprintf(fp, "<path fill=\"none\" stroke=\"#ff4d00\" stroke-width=\"1\" stroke-dasharray=\"4 4\" vector-effect=\"non-scaling-stroke\" d=\"M%.1lf,%.1lf L%.1lf,%.1lf\"/>\n", sight.nodes[0].x, sight.nodes[0].y, x, y);
+  //sight line
+  if (
+    (xs = (double *)calloc(sizeof(double), sight.num)) == NULL ||
+    (ys = (double *)calloc(sizeof(double), sight.num)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  for (i=0; i < sight.num; i++) {
+    xs[i] = sight.nodes[i].x;
+    ys[i] = sight.nodes[i].y;
+  }
+  fprintf(fp, "<path fill=\"none\" stroke=\"#fff\" stroke-width=\"1\" vector-effect=\"non-scaling-stroke\" d=\"");
+  if (svg_polyline_write(fp,xs,ys,sight.num) == -1) {
+    return -1;
+  }
+  fprintf(fp, "\"/>\n");
+  free(xs);
+  free(ys);
+  fprintf(fp, "</g>\n");
+  fprintf(fp, "</svg>\n");
+  if (fclose(fp) != 0 || rename(temp, frame_file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", frame_file, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+struct SDL_Surface *chart_base = NULL; //art for the angular anomaly chart, once loaded
+//this frame's temporary image buffers, which the sight line is drawn into as it's traced (see `frame_begin()`)
+double **frame_ray_img = NULL, **frame_line_img = NULL, **frame_anom_img = NULL;
+//free whichever of this frame's image buffers were made
+void frame_free() {
+  img_free(frame_ray_img,OUTPUT_HEIGHT);
+  img_free(frame_line_img,OUTPUT_HEIGHT);
+  img_free(frame_anom_img,ANOM_IMAGE_HEIGHT);
+  frame_ray_img = frame_line_img = frame_anom_img = NULL;
+  return;
+}
+/*
+ |  Set up this frame's image buffers, and have the sight line & its
+ |  angular anomaly drawn into them while `ray_trace()` goes. Then
+ |  `frame_render()` only adds the straight line & saves the images.
+ */
+int frame_begin() {
+  if ((frame_anom_img = img_init(ANOM_IMAGE_WIDTH,ANOM_IMAGE_HEIGHT)) == NULL) {
+    return -1;
+  }
+  //SVG frames draw the sight line as a path, so they only need the chart's buffer
+  if (!svg && (
+    (frame_ray_img = img_init(OUTPUT_WIDTH,OUTPUT_HEIGHT)) == NULL ||
+    (frame_line_img = img_init(OUTPUT_WIDTH,OUTPUT_HEIGHT)) == NULL
+  )) {
+    frame_free();
+    return -1;
+  }
+  ray_consumer_clear();
+  if (!svg && ray_consumer_add(ray_render_node,frame_ray_img) == -1) {
+    return -1;
+  }
+  if (ray_consumer_add(ang_anom_node,frame_anom_img) == -1) {
+    return -1;
+  }
+  return 0;
+}
+//render the density map & angular anomaly chart for this frame, and save them as images
+int frame_render(struct spb_instance *spb, const char *frame_file, const char *anom_file) {
+  struct SDL_Surface *anom = NULL;
+  struct pixel pix;
+  int x, y, res;
+  
+  //if the sight line wasn't drawn as it was traced (say, it came from the cache), draw it now
+  if (frame_anom_img == NULL) {
+    if (frame_begin() == -1) {
+      return -1;
+    }
+    ray_consume(&sight,0);
+  }
+  ray_consumer_clear();
+  if (!svg) {
+    line_draw(spb,frame_line_img,sight.nodes[0].x,sight.nodes[0].y,sight.start_p,1);
+  }
+  
+  //render image & output image file
+  if (svg) {
+    res = svg_frame_save(frame_file);
+  } else {
+    res = density_map_save(frame_ray_img,frame_line_img,frame_file);
+  }
+  if (res == -1) {
+    return -1;
+  }
+  
+  if (ENABLE_TURBULENCE && spb != NULL && spb->real_progress < spb->real_goal) {
+    spb_update(spb);
+  }
+  
+  //render image for angular anomaly chart (on a copy of the chart art, which we only load once)
+  if (chart_base == NULL && (chart_base = mem_surface(IMG_Load(ANOM_CHART_BASE))) == NULL) {
+    fprintf(stderr, "Failed to load '%s'.\n", ANOM_CHART_BASE);
+    return -1;
+  }
+  if ((anom = mem_surface(SDL_DuplicateSurface(chart_base))) == NULL) {
+    fprintf(stderr, "Failed to create SDL_Surface.\n");
+    return -1;
+  }
+  for (y=0; y < ANOM_IMAGE_HEIGHT; y++) {
+    for (x=0; x < ANOM_IMAGE_WIDTH; x++) {
+      if (frame_anom_img[y][x] > 0.0) {
+        pix.r = frame_anom_img[y][x]*1.0;
+        pix.g = frame_anom_img[y][x]*0.3;
+        pix.b = frame_anom_img[y][x]*0.0;
+        pixel_insert(anom,pix,x,y);
+      }
+    }
+  }
+  //output image file
+  if (png_save(anom,anom_file) == -1) {
+    return -1;
+  }
+  mem_surface_free(anom);
+  
+  //clean up
+  frame_free();
+  return 0;
+}
+//write one sight line node & its angular anomaly as a CSV line (a `ray_consumer`)
+void ang_anom_line(const struct atmos_ray *ray, const struct ray_node *node, int index, void *data) {
+  double dist, anom;
+  ang_anom_calc(ray,node,&dist,&anom);
+  fprintf((FILE *)data, "%d,%.9g,%.9g,%.9g,%.9g\n", index, node->x, node->y, dist, anom);
+  return;
+}
+//write this frame's sight line & angular anomaly as CSV
+void ang_anom_write(FILE *fp) {
+  int i;
+  fprintf(fp, "node,x,y,dist,anom\n");
+  for (i=0; i < sight.num; i++) {
+    ang_anom_line(&sight,&(sight.nodes[i]),i,fp);
+  }
+  return;
+}
+/*
+ |  Start this frame's CSV file, and have the sight line written to it
+ |  while `ray_trace()` goes (see `ang_anom_end()`).
+ */
+FILE *ang_anom_begin(const char *file) {
+  char temp[MAX_STR];
+  FILE *fp;
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if ((fp = fopen(temp, "w")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    return NULL;
+  }
+  fprintf(fp, "node,x,y,dist,anom\n");
+  ray_consumer_clear();
+  if (ray_consumer_add(ang_anom_line,fp) == -1) {
+    fclose(fp);
+    unlink(temp);
+    return NULL;
+  }
+  return fp;
+}
+//finish this frame's CSV file
+int ang_anom_end(const char *file, FILE *fp) {
+  char temp[MAX_STR];
+  ray_consumer_clear();
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if (fclose(fp) != 0 || rename(temp, file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+//save this frame's sight line & angular anomaly as numbers instead of images, once it's traced
+int ang_anom_save(const char *file) {
+  FILE *fp;
+  if ((fp = ang_anom_begin(file)) == NULL) {
+    return -1;
+  }
+  ray_consume(&sight,0);
+  return ang_anom_end(file,fp);
+}
+
+/*
+ |  =============
+ |  TARGET SOLVER
+ |  =============
+ */
+
+/*
+ |  With `--target`, each frame also answers: at what elevation does
+ |  the observer see a target at the given ground distance & altitude?
+ |  Light paths can be reversed, so that's the launch angle of the ray
+ |  from the observer which passes through the target. It's found by
+ |  the shooting method: bracket the launch angle, then close in with
+ |  Brent's method (secant & inverse quadratic steps, falling back to
+ |  bisection), tracing one shot per step. See:
+ |  - https://en.wikipedia.org/wiki/Brent%27s_method
+ |  
+ |  Every shot runs through the same frame's density field, and reuses
+ |  the same node buffer. A shot stops as soon as it passes the
+ |  target's ground distance, or leaves the window (so it can no
+ |  longer hit the target).
+ */
+struct target_solution {
+  double elevation; // apparent elevation of the target, in degrees above the observer's horizon
+  double straight; // elevation of the straight line to the target, in degrees
+  double miss; // kilometers above the target where the final shot passed
+  int traces; // shots it took
+  int hit; // whether a launch angle was found which reaches the target (within a ray step)
+};
+//trace one shot at the given launch elevation, and measure how far above the target it passes (negative for below)
+int target_shoot(struct ray_packet *shot, double elevation, double *miss) {
+  struct atmos_coord prev, coord;
+  struct ray_node *node;
+  double frac;
+  int active = 1;
+  shot->elevation = elevation;
+  if (ray_init(&(shot->ray[0]),elevation) == -1) {
+    return -1;
+  }
+  node = shot->ray[0].end;
+  atmos_coords(node->x,node->y,&prev);
+  do {
+    if (packet_walk(shot,&active) == -1) {
+      return -1;
+    }
+    node = shot->ray[0].end;
+    atmos_coords(node->x,node->y,&coord);
+    if (coord.ground >= target_ground) {
+      //altitude where it crossed the target's ground distance
+      frac = (target_ground - prev.ground)/(coord.ground - prev.ground);
+      miss[0] = prev.alt + (coord.alt - prev.alt)*frac - target_alt;
+      return 0;
+    }
+    prev = coord;
+  } while (shot->ray[0].num < RAY_MAX_NODES && atmos_coord_inside(&coord));
+  //left the window first, so judge it by where it left
+  miss[0] = coord.alt - target_alt;
+  return 0;
+}
+//elevation of the straight line from the observer to the target (measured in the window's pixels, like the sight line)
+double target_straight() {
+  struct atmos_coord coord;
+  double ox, oy, tx, ty;
+  coord.alt = scenario.observer_alt;
+  coord.ground = scenario.observer_ground;
+  atmos_window(&ox,&oy,&coord,NULL,NULL);
+  coord.alt = target_alt;
+  coord.ground = target_ground;
+  atmos_window(&tx,&ty,&coord,NULL,NULL);
+  return atan2(oy-ty,tx-ox)*180.0/PI - WINDOW_ANGLE*(0.5-(scenario.observer_ground/WINDOW_ARC_LENGTH));
+}
+//find the launch angle which hits the target in the current density field
+int target_solve(struct target_solution *sol) {
+  struct ray_packet shot;
+  double a, b, c, d, e, fa, fb, fc;
+  double p, q, r, s, tol, xm, step;
+  memset(&shot, 0, sizeof(struct ray_packet));
+  shot.lanes = 1;
+  shot.ref = 0;
+  shot.gd[0] = GLADSTONEDALE_CONST;
+  memset(sol, 0, sizeof(struct target_solution));
+  sol->straight = target_straight();
+  
+  //bracket the launch angle, walking out from the straight line in growing steps
+  a = sol->straight;
+  if (target_shoot(&shot,a,&fa) == -1) {
+    return -1;
+  }
+  sol->traces = 1;
+  b = a;
+  fb = fa;
+  step = (fa > 0.0 ? -TARGET_BRACKET_STEP : TARGET_BRACKET_STEP);
+  while (fa != 0.0 && (fa > 0.0) == (fb > 0.0)) {
+    a = b;
+    fa = fb;
+    b += step;
+    step *= 2.0;
+    if (fabs(b - sol->straight) > TARGET_MAX_ELEVATION) {
+      //nothing in range gets there
+      ray_release(&(shot.ray[0]));
+      sol->elevation = NAN;
+      sol->miss = fa;
+      return 0;
+    }
+    if (target_shoot(&shot,b,&fb) == -1) {
+      return -1;
+    }
+    sol->traces++;
+  }
+  
+  //close in with Brent's method
+  c = a;
+  fc = fa;
+  d = e = b - a;
+  while (sol->traces < TARGET_MAX_TRACES) {
+    if ((fb > 0.0) == (fc > 0.0)) {
+      c = a;
+      fc = fa;
+      d = e = b - a;
+    }
+    if (fabs(fc) < fabs(fb)) {
+      a = b;
+      b = c;
+      c = a;
+      fa = fb;
+      fb = fc;
+      fc = fa;
+    }
+    tol = 2.0*DBL_EPSILON*fabs(b) + 0.5*TARGET_ANGLE_TOLERANCE;
+    xm = 0.5*(c - b);
+    if (fabs(xm) <= tol || fabs(fb) <= TARGET_TOLERANCE) {
+      break;
+    }
+    if (fabs(e) >= tol && fabs(fa) > fabs(fb)) {
+      s = fb/fa;
+      if (a == c) {
+        //secant step
+        p = 2.0*xm*s;
+        q = 1.0 - s;
+      } else {
+        //inverse quadratic step
+        q = fa/fc;
+        r = fb/fc;
+        p = s*(2.0*xm*q*(q - r) - (b - a)*(r - 1.0));
+        q = (q - 1.0)*(r - 1.0)*(s - 1.0);
+      }
+      if (p > 0.0) {
+        q = -q;
+      }
+      p = fabs(p);
+      if (2.0*p < MIN(3.0*xm*q - fabs(tol*q), fabs(e*q))) {
+        e = d;
+        d = p/q;
+      } else {
+        //too far, so bisect instead
+        d = xm;
+        e = d;
+      }
+    } else {
+      d = xm;
+      e = d;
+    }
+    a = b;
+    fa = fb;
+    b += (fabs(d) > tol ? d : (xm >= 0.0 ? tol : -tol));
+    if (target_shoot(&shot,b,&fb) == -1) {
+      return -1;
+    }
+    sol->traces++;
+  }
+  ray_release(&(shot.ray[0]));
+  sol->elevation = b;
+  sol->miss = fb;
+  /*
+   |  The bracket can also close in on a jump instead of a root, such
+   |  as the edge between shots which hit the ground & shots which pass
+   |  over it, when the target is hidden behind the horizon. Shots are
+   |  only so precise, though, so anything within a step is a hit.
+   */
+  sol->hit = (fabs(fb) <= RAY_STEP/IMAGE_RES);
+  if (!sol->hit) {
+    sol->elevation = NAN;
+  }
+  return 0;
+}
+//solve for the target in the current density field, and save the result to a CSV file
+int target_save(const char *file) {
+  struct target_solution sol;
+  char temp[MAX_STR];
+  FILE *fp;
+  if (target_solve(&sol) == -1) {
+    return -1;
+  }
+  if (!sol.hit) {
+    fprintf(stderr, "\n'%s': the target can't be seen from the observer\n", file);
+  }
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if ((fp = fopen(temp, "w")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    return -1;
+  }
+  fprintf(fp, "elevation,straight,refraction,miss,traces\n");
+  fprintf(fp, "%.9g,%.9g,%.9g,%.9g,%d\n", sol.elevation, sol.straight, sol.elevation-sol.straight, sol.miss, sol.traces);
+  if (fclose(fp) != 0 || rename(temp, file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ |  ===================
+ |  ENSEMBLE STATISTICS
+ |  ===================
+ */
+
+/*
+ |  The P-square algorithm estimates a percentile on the fly with
+ |  just five markers, instead of storing every sample. See:
+ |  - https://www.cse.wustl.edu/~jain/papers/ftp/psqr.pdf
+ |  
+ |  It's poor with only a handful of samples, so the first few are
+ |  kept exactly, and the markers start out from those.
+ */
+#define P2_EXACT 32
+struct p2_quantile {
+  double p; //which percentile (between 0 and 1)
+  int count; //samples seen so far
+  double exact[P2_EXACT]; //first few samples
+  double q[5]; //marker heights
+  double n[5]; //actual marker positions
+  double np[5]; //desired marker positions
+  double dn[5]; //increments of desired positions
+};
+struct ensemble_stat {
+  int n; //samples seen so far
+  double mean, m2; //running mean & sum of squared differences
+  struct p2_quantile pct[ENSEMBLE_PCT_NUM];
+} *ensemble_stats;
+
+//sort a few numbers in place
+void sort_small(double *v, int num) {
+  double temp;
+  int i, j;
+  for (i=1; i < num; i++) {
+    temp = v[i];
+    for (j=i; j > 0 && v[j-1] > temp; j--) {
+      v[j] = v[j-1];
+    }
+    v[j] = temp;
+  }
+  return;
+}
+//start estimating the given percentile
+void p2_init(struct p2_quantile *e, double p) {
+  memset(e, 0, sizeof(struct p2_quantile));
+  e->p = p;
+  e->dn[0] = 0.0;
+  e->dn[1] = p/2.0;
+  e->dn[2] = p;
+  e->dn[3] = (1.0+p)/2.0;
+  e->dn[4] = 1.0;
+  return;
+}
+//feed one sample to percentile estimator
+void p2_add(struct p2_quantile *e, double x) {
+  double d, qp;
+  int i, k, dir;
+  //the first few samples are kept, and then become the markers
+  if (e->count < P2_EXACT) {
+    e->exact[e->count++] = x;
+    if (e->count == P2_EXACT) {
+      sort_small(e->exact,P2_EXACT);
+      for (i=0; i < 5; i++) {
+        e->np[i] = 1.0 + (P2_EXACT-1)*e->dn[i];
+        e->n[i] = MIN(P2_EXACT-4+i, MAX((i > 0 ? e->n[i-1]+1 : 1), round(e->np[i])));
+        e->q[i] = e->exact[(int)e->n[i]-1];
+      }
+    }
+    return;
+  }
+  e->count++;
+  //find which cell the sample falls in
+  if (x < e->q[0]) {
+    e->q[0] = x;
+    k = 0;
+  } else if (x >= e->q[4]) {
+    e->q[4] = x;
+    k = 3;
+  } else {
+    for (k=0; k < 3 && x >= e->q[k+1]; k++);
+  }
+  for (i=k+1; i < 5; i++) {
+    e->n[i] += 1.0;
+  }
+  for (i=0; i < 5; i++) {
+    e->np[i] += e->dn[i];
+  }
+  //nudge the middle markers toward their desired positions
+  for (i=1; i < 4; i++) {
+    d = e->np[i] - e->n[i];
+    if ((d >= 1.0 && e->n[i+1]-e->n[i] > 1.0) || (d <= -1.0 && e->n[i-1]-e->n[i] < -1.0)) {
+      dir = (d >= 0.0 ? 1 : -1);
+      //piecewise parabolic prediction
+      qp = e->q[i] + dir/(e->n[i+1]-e->n[i-1]) * (
+        (e->n[i]-e->n[i-1]+dir)*(e->q[i+1]-e->q[i])/(e->n[i+1]-e->n[i]) +
+        (e->n[i+1]-e->n[i]-dir)*(e->q[i]-e->q[i-1])/(e->n[i]-e->n[i-1])
+      );
+      if (e->q[i-1] < qp && qp < e->q[i+1]) {
+        e->q[i] = qp;
+      } else {
+        //fall back to linear prediction
+        e->q[i] += dir*(e->q[i+dir]-e->q[i])/(e->n[i+dir]-e->n[i]);
+      }
+      e->n[i] += dir;
+    }
+  }
+  return;
+}
+//current estimate of the percentile
+double p2_value(struct p2_quantile *e) {
+  double temp[P2_EXACT];
+  double pos;
+  int i;
+  if (e->count == 0) {
+    return NAN;
+  }
+  if (e->count < P2_EXACT) {
+    //still exact, so interpolate between neighboring ranks
+    memcpy(temp, e->exact, sizeof(double)*e->count);
+    sort_small(temp,e->count);
+    pos = e->p*(e->count-1);
+    i = MIN(e->count-2, (int)floor(pos));
+    if (i < 0) {
+      return temp[0];
+    }
+    return (temp[i+1]-temp[i])*(pos-i) + temp[i];
+  }
+  return e->q[2];
+}
+/*
+ |  Average the given ray's anomaly into distance bins (NAN where a
+ |  bin has no nodes). `sum` & `count` are scratch space, one per bin.
+ */
+void ensemble_curve(struct atmos_ray *ray, double *curve, double *sum, int *count) {
+  struct ray_node *node;
+  double dist, anom;
+  int bin, i;
+  memset(sum, 0, sizeof(double)*ENSEMBLE_BINS);
+  memset(count, 0, sizeof(int)*ENSEMBLE_BINS);
+  for (i=1; i < ray->num; i++) {
+    node = &(ray->nodes[i]);
+    ang_anom_calc(ray,node,&dist,&anom);
+    bin = (int)floor(dist/ENSEMBLE_BIN_WIDTH);
+    if (bin >= 0 && bin < ENSEMBLE_BINS && !isnan(anom)) {
+      sum[bin] += anom;
+      count[bin]++;
+    }
+  }
+  for (bin=0; bin < ENSEMBLE_BINS; bin++) {
+    curve[bin] = (count[bin] > 0 ? sum[bin]/count[bin] : NAN);
+  }
+  return;
+}
+/*
+ |  Save the anomaly curve of every wavelength in the packet to a CSV
+ |  file, one row per distance bin (see `--dispersion`). Everything
+ |  but the reference lane's column comes from `packet`, so this has
+ |  to happen before `packet_free()`.
+ */
+int dispersion_save(const char *file) {
+  char temp[MAX_STR];
+  double *curves, *sum;
+  int *count;
+  int bin, l;
+  FILE *fp;
+  if (
+    (curves = (double *)calloc(sizeof(double), packet.lanes*ENSEMBLE_BINS)) == NULL ||
+    (sum = (double *)calloc(sizeof(double), ENSEMBLE_BINS)) == NULL ||
+    (count = (int *)calloc(sizeof(int), ENSEMBLE_BINS)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  for (l=0; l < packet.lanes; l++) {
+    ensemble_curve((l == packet.ref ? &sight : &(packet.ray[l])),&(curves[l*ENSEMBLE_BINS]),sum,count);
+  }
+  free(sum);
+  free(count);
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if ((fp = fopen(temp, "w")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    free(curves);
+    return -1;
+  }
+  fprintf(fp, "dist");
+  for (l=0; l < packet.lanes; l++) {
+    fprintf(fp, ",anom_%.0fnm", DISPERSION_WAVELENGTHS[l]);
+  }
+  fprintf(fp, "\n");
+  for (bin=0; bin < ENSEMBLE_BINS; bin++) {
+    fprintf(fp, "%.9g", (bin+0.5)*ENSEMBLE_BIN_WIDTH);
+    for (l=0; l < packet.lanes; l++) {
+      fprintf(fp, ",%.9g", curves[l*ENSEMBLE_BINS+bin]);
+    }
+    fprintf(fp, "\n");
+  }
+  free(curves);
+  if (fclose(fp) != 0 || rename(temp, file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+/*
+ |  Simulate one turbulence realization on its own random stream,
+ |  and average its anomaly curve into distance bins (see
+ |  `ensemble_curve()`). `curve` holds one row of bins per frame.
+ */
+int ensemble_realize(int k, double *curve) {
+  double *sum;
+  int *count;
+  int frame;
+  if (
+    (sum = (double *)calloc(sizeof(double), ENSEMBLE_BINS)) == NULL ||
+    (count = (int *)calloc(sizeof(int), ENSEMBLE_BINS)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  //a tiled field's scratch file would be shared with the other workers, so make our own
+  if (tile_cache > 0 && atmos_data != NULL) {
+    atmos_data_free();
+    if (atmos_data_alloc() == -1) {
+      return -1;
+    }
+  }
+  rng_stream(scenario.seed,k);
+  if (bloop_init() == -1) {
+    return -1;
+  }
+  for (frame=1; frame <= scenario.frames; frame++) {
+    atmos_reset();
+    if (ENABLE_TURBULENCE) {
+      bloop_apply_all(frame,NULL);
+    }
+    if (ray_trace(NULL) == -1) {
+      return -1;
+    }
+    ensemble_curve(&sight,&(curve[(frame-1)*ENSEMBLE_BINS]),sum,count);
+    ray_free();
+  }
+  mem_free(bloop_list);
+  free(sum);
+  free(count);
+  return 0;
+}
+//fold one realization's curve into the running statistics
+void ensemble_merge(double *curve) {
+  struct ensemble_stat *stat;
+  double val, delta;
+  int i, j;
+  for (i=0; i < scenario.frames*ENSEMBLE_BINS; i++) {
+    val = curve[i];
+    if (isnan(val)) {
+      continue;
+    }
+    stat = &(ensemble_stats[i]);
+    //Welford's method for mean & variance
+    stat->n++;
+    delta = val - stat->mean;
+    stat->mean += delta/stat->n;
+    stat->m2 += delta*(val - stat->mean);
+    for (j=0; j < ENSEMBLE_PCT_NUM; j++) {
+      p2_add(&(stat->pct[j]),val);
+    }
+  }
+  return;
+}
+//save ensemble statistics as CSV
+int ensemble_save(const char *file) {
+  struct ensemble_stat *stat;
+  char temp[MAX_STR];
+  FILE *fp;
+  int frame, bin, j;
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if ((fp = fopen(temp, "w")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    return -1;
+  }
+  fprintf(fp, "frame,dist,n,mean,var");
+  for (j=0; j < ENSEMBLE_PCT_NUM; j++) {
+    fprintf(fp, ",p%02d", (int)round(ENSEMBLE_PCT[j]*100.0));
+  }
+  fprintf(fp, "\n");
+  for (frame=1; frame <= scenario.frames; frame++) {
+    for (bin=0; bin < ENSEMBLE_BINS; bin++) {
+      stat = &(ensemble_stats[(frame-1)*ENSEMBLE_BINS+bin]);
+      fprintf(fp, "%d,%.9g,%d,%.9g,%.9g", frame, (bin+0.5)*ENSEMBLE_BIN_WIDTH, stat->n,
+        (stat->n > 0 ? stat->mean : NAN), (stat->n > 1 ? stat->m2/(stat->n-1) : NAN));
+      for (j=0; j < ENSEMBLE_PCT_NUM; j++) {
+        fprintf(fp, ",%.9g", p2_value(&(stat->pct[j])));
+      }
+      fprintf(fp, "\n");
+    }
+  }
+  if (fclose(fp) != 0 || rename(temp, file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+/*
+ |  Run the given number of realizations, each one in a forked
+ |  worker process with its own copy of the density field. Results
+ |  come back through pipes and are merged strictly in realization
+ |  order, so the statistics don't depend on the number of workers.
+ */
+int ensemble_run(int realizations, int workers) {
+  struct spb_instance spb;
+  pid_t *pids;
+  int *fds;
+  int fd[2];
+  double *curve;
+  size_t size, done;
+  ssize_t res;
+  int started, merged, slot, status, i, j;
+  size = sizeof(double)*scenario.frames*ENSEMBLE_BINS;
+  if (
+    (ensemble_stats = (struct ensemble_stat *)calloc(sizeof(struct ensemble_stat), scenario.frames*ENSEMBLE_BINS)) == NULL ||
+    (curve = (double *)malloc(size)) == NULL ||
+    (pids = (pid_t *)calloc(sizeof(pid_t), workers)) == NULL ||
+    (fds = (int *)calloc(sizeof(int), workers)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  for (i=0; i < scenario.frames*ENSEMBLE_BINS; i++) {
+    for (j=0; j < ENSEMBLE_PCT_NUM; j++) {
+      p2_init(&(ensemble_stats[i].pct[j]),ENSEMBLE_PCT[j]);
+    }
+  }
+  fprintf(stdout, "Running %d realizations on %d workers\n", realizations, workers);
+  spb.real_goal = realizations;
+  spb.bar_goal = 20;
+  spb_init(&spb,"","realizations");
+  started = merged = 0;
+  while (merged < realizations) {
+    //keep every worker busy
+    while (started < realizations && started-merged < workers) {
+      if (pipe(fd) != 0) {
+        fprintf(stderr, "pipe(): %s\n", strerror(errno));
+        return -1;
+      }
+      fflush(stdout);
+      fflush(stderr);
+      slot = started % workers;
+      if ((pids[slot] = fork()) == -1) {
+        fprintf(stderr, "fork(): %s\n", strerror(errno));
+        return -1;
+      }
+      if (pids[slot] == 0) {
+        //worker process
+        close(fd[0]);
+        if (ensemble_realize(started,curve) == -1) {
+          _exit(1);
+        }
+        for (done=0; done < size; done += res) {
+          if ((res = write(fd[1], (char *)curve + done, size - done)) <= 0) {
+            _exit(1);
+          }
+        }
+        _exit(0);
+      }
+      close(fd[1]);
+      fds[slot] = fd[0];
+      started++;
+    }
+    //collect the next realization in order
+    slot = merged % workers;
+    for (done=0; done < size; done += res) {
+      if ((res = read(fds[slot], (char *)curve + done, size - done)) <= 0) {
+        break;
+      }
+    }
+    close(fds[slot]);
+    if (waitpid(pids[slot], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || done < size) {
+      fprintf(stderr, "Realization %d failed\n", merged);
+      return -1;
+    }
+    ensemble_merge(curve);
+    merged++;
+    spb.real_progress = merged;
+    spb_update(&spb);
+  }
+  if (ensemble_save(ENSEMBLE_FILE) == -1) {
+    return -1;
+  }
+  fprintf(stdout, "Saved ensemble statistics to '%s'\n", ENSEMBLE_FILE);
+  free(ensemble_stats);
+  free(curve);
+  free(pids);
+  free(fds);
+  return 0;
+}
+
+/*
+ |  =========
+ |  KEYFRAMES
+ |  =========
+ */
+
+/*
+ |  With `--keyframe-step N`, only every Nth output frame is simulated
+ |  in full, and each frame in between is blended from the keyframes
+ |  on either side of it. The sight line is still traced through the
+ |  blended field as usual. Bloops multiply the density, so we blend
+ |  in log-density: each sample goes from one keyframe to the next by
+ |  the same factor every frame. That's exact wherever no bloop is
+ |  changing, and the cosine swell of a bloop is smooth enough that
+ |  it's close everywhere else.
+ |
+ |  The blend works on whichever field is simulated (the polar grid
+ |  with `--polar`), so the whole field has to be in memory; we can't
+ |  keep copies of a tiled one.
+ */
+struct keyframe {
+  int frame; // output frame held here, or 0 if none yet
+  double *field;
+} keyframes[2];
+double *keyframe_blend; // the blended field, kept while checking it against a full simulation
+size_t keyframe_samples; // size of the simulated field
+//how far blended frames were from fully simulated ones (see `--keyframe-check`)
+struct keyframe_stats {
+  int blended, simulated; // frames of each kind
+  int checked;
+  double field_max, field_rms; // relative density error, worst of any frame
+  double anom_max; // degrees
+} keyframe_stats;
+
+//the simulated field, as one array
+double *keyframe_field() {
+  return (FIELD_TYPE == ATMOS_FIELD_POLAR ? polar_data : atmos_data);
+}
+//keyframe at or before the given output frame (the last frame always is one)
+int keyframe_of(int frame) {
+  return (frame == OUTPUT_FRAMES ? frame : ((frame-1)/keyframe_step)*keyframe_step + 1);
+}
+//keyframe after the given output frame (or the last frame of the animation)
+int keyframe_next(int frame) {
+  return MIN(keyframe_of(frame) + keyframe_step, OUTPUT_FRAMES);
+}
+//number of full simulations it takes to make frames `first` through `last`
+int keyframe_sims(int first, int last) {
+  int frame, num = 0;
+  for (frame=first; frame <= last; frame++) {
+    if (frame == keyframe_of(frame) || keyframe_check) {
+      num++;
+    }
+  }
+  //the keyframes either side of the range, if they're outside it
+  if (first != keyframe_of(first)) {
+    num++;
+  }
+  if (last != keyframe_of(last)) {
+    num++;
+  }
+  return num;
+}
+//allocate the keyframes
+int keyframe_init() {
+  int i;
+  if (FIELD_TYPE == ATMOS_FIELD_CARTESIAN && tile_cache > 0) {
+    fprintf(stderr, "`--keyframe-step` needs the whole density field in memory (not tiles)\n");
+    return -1;
+  }
+  keyframe_samples = (FIELD_TYPE == ATMOS_FIELD_POLAR ? (size_t)POLAR_WIDTH*POLAR_HEIGHT : (size_t)IMAGE_WIDTH*IMAGE_HEIGHT);
+  for (i=0; i < 2; i++) {
+    keyframes[i].frame = 0;
+    if ((keyframes[i].field = (double *)mem_calloc(MEM_FIELD, sizeof(double), keyframe_samples)) == NULL) {
+      fprintf(stderr, "calloc(): %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  if (keyframe_check && (keyframe_blend = (double *)mem_calloc(MEM_FIELD, sizeof(double), keyframe_samples)) == NULL) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  memset(&keyframe_stats, 0, sizeof(struct keyframe_stats));
+  return 0;
+}
+void keyframe_free() {
+  mem_free(keyframes[0].field);
+  mem_free(keyframes[1].field);
+  mem_free(keyframe_blend);
+  keyframes[0].field = keyframes[1].field = keyframe_blend = NULL;
+  return;
+}
+/*
+ |  Make sure one of the two slots holds the given keyframe, simulating
+ |  it if need be (which leaves it in the field, too), without giving
+ |  up the slot holding `keep`. Returns the slot.
+ */
+int keyframe_load(int frame, int keep, struct spb_instance *spb) {
+  int i;
+  for (i=0; i < 2; i++) {
+    if (keyframes[i].frame == frame) {
+      return i;
+    }
+  }
+  i = (keyframes[0].frame == keep ? 1 : 0);
+  frame_simulate(frame,spb);
+  memcpy(keyframes[i].field, keyframe_field(), sizeof(double)*keyframe_samples);
+  keyframes[i].frame = frame;
+  keyframe_stats.simulated++;
+  return i;
+}
+//fill the field for the given output frame, from its keyframes
+int keyframe_frame(int frame, struct spb_instance *spb) {
+  double *field, *a, *b, w;
+  size_t i;
+  int k0, k1, s0, s1;
+  k0 = keyframe_of(frame);
+  k1 = keyframe_next(frame);
+  s0 = keyframe_load(k0, k1, spb);
+  if (frame == k0) {
+    memcpy(keyframe_field(), keyframes[s0].field, sizeof(double)*keyframe_samples);
+    return 0;
+  }
+  s1 = keyframe_load(k1, k0, spb);
+  //blend in log-density (falling back to linear where it's zero)
+  w = ((double)(frame-k0))/((double)(k1-k0));
+  field = keyframe_field();
+  a = keyframes[s0].field;
+  b = keyframes[s1].field;
+  for (i=0; i < keyframe_samples; i++) {
+    if (a[i] == b[i]) {
+      field[i] = a[i];
+    } else if (a[i] > 0.0 && b[i] > 0.0) {
+      field[i] = a[i]*exp(w*log(b[i]/a[i]));
+    } else {
+      field[i] = (b[i]-a[i])*w + a[i];
+    }
+  }
+  keyframe_stats.blended++;
+  return 0;
+}
+/*
+ |  Simulate a blended frame in full after all, and compare the two:
+ |  the density field, and the sight line's anomaly curve (binned as
+ |  for ensemble statistics). This has to happen while the blended
+ |  frame's sight line is still around, and leaves the field & sight
+ |  line of the full simulation behind.
+ */
+int keyframe_compare(int frame, struct spb_instance *spb) {
+  double *field, *curves, *sum, err, rms, max, anom;
+  size_t i;
+  int *count, bin;
+  if (
+    (curves = (double *)calloc(sizeof(double), 2*ENSEMBLE_BINS)) == NULL ||
+    (sum = (double *)calloc(sizeof(double), ENSEMBLE_BINS)) == NULL ||
+    (count = (int *)calloc(sizeof(int), ENSEMBLE_BINS)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  field = keyframe_field();
+  memcpy(keyframe_blend, field, sizeof(double)*keyframe_samples);
+  ensemble_curve(&sight,curves,sum,count);
+  ray_free();
+  packet_free();
+  frame_simulate(frame,spb);
+  if (ray_trace(spb) == -1) {
+    free(curves);
+    free(sum);
+    free(count);
+    return -1;
+  }
+  ensemble_curve(&sight,&(curves[ENSEMBLE_BINS]),sum,count);
+  //density field
+  max = rms = 0.0;
+  for (i=0; i < keyframe_samples; i++) {
+    if (field[i] > 0.0) {
+      err = fabs(keyframe_blend[i] - field[i])/field[i];
+      max = fmax(max, err);
+      rms += err*err;
+    }
+  }
+  rms = sqrt(rms/keyframe_samples);
+  //anomaly curve
+  anom = 0.0;
+  for (bin=0; bin < ENSEMBLE_BINS; bin++) {
+    if (!isnan(curves[bin]) && !isnan(curves[ENSEMBLE_BINS+bin])) {
+      anom = fmax(anom, fabs(curves[bin] - curves[ENSEMBLE_BINS+bin]));
+    }
+  }
+  fprintf(stdout, "Frame %d blended: density error max %.3le, RMS %.3le (relative); anomaly error max %.3le degrees\n", frame, max, rms, anom);
+  keyframe_stats.checked++;
+  keyframe_stats.field_max = fmax(keyframe_stats.field_max, max);
+  keyframe_stats.field_rms = fmax(keyframe_stats.field_rms, rms);
+  keyframe_stats.anom_max = fmax(keyframe_stats.anom_max, anom);
+  free(curves);
+  free(sum);
+  free(count);
+  return 0;
+}
+//sum up what the keyframes saved, and what they cost
+void keyframe_report(FILE *fp) {
+  fprintf(fp, "Keyframes: %d simulated, %d blended\n", keyframe_stats.simulated, keyframe_stats.blended);
+  if (keyframe_stats.checked > 0) {
+    fprintf(fp, "Blended vs. simulated (%d frames): density error max %.3le, RMS %.3le (relative); anomaly error max %.3le degrees\n", keyframe_stats.checked, keyframe_stats.field_max, keyframe_stats.field_rms, keyframe_stats.anom_max);
+  }
+  return;
+}
+
+/*
+ |  =============
+ |  CHECKPOINTING
+ |  =============
+ */
+
+/*
+ |  The checkpoint file holds everything that depends on the order
+ |  of random numbers, so an interrupted run can pick up where it
+ |  left off without regenerating anything. The run configuration
+ |  is stored alongside, so we don't resume with mismatched data.
+ */
+struct checkpoint_header {
+  char magic[8]; // "ATMSCKPT"
+  int version;
+  //run configuration
+  double window_arc_length, window_altitude, image_res;
+  double bloops_per_frame;
+  int frames, rng_seed, bloop_num;
+  int image_width, image_height;
+  //RNG state after generating bloops
+  unsigned long rng_draws;
+};
+//fill header with the current configuration
+void checkpoint_header_init(struct checkpoint_header *h) {
+  memset(h, 0, sizeof(struct checkpoint_header));
+  memcpy(h->magic, "ATMSCKPT", 8);
+  h->version = CHECKPOINT_VERSION;
+  h->window_arc_length = WINDOW_ARC_LENGTH;
+  h->window_altitude = WINDOW_ALTITUDE;
+  h->image_res = IMAGE_RES;
+  h->bloops_per_frame = scenario.bloops_per_frame;
+  h->frames = scenario.frames;
+  h->rng_seed = scenario.seed;
+  h->bloop_num = BLOOP_NUM;
+  h->image_width = IMAGE_WIDTH;
+  h->image_height = IMAGE_HEIGHT;
+  h->rng_draws = rng_draws;
+  return;
+}
+//save bloop list & RNG state to checkpoint file
+int checkpoint_save(const char *file) {
+  struct checkpoint_header h;
+  char temp[MAX_STR];
+  FILE *fp;
+  checkpoint_header_init(&h);
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if ((fp = fopen(temp, "wb")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    return -1;
+  }
+  if (
+    fwrite(&h, sizeof(struct checkpoint_header), 1, fp) != 1 ||
+    fwrite(bloop_list, sizeof(struct atmos_bloop), BLOOP_NUM, fp) != BLOOP_NUM
+  ) {
+    fprintf(stderr, "fwrite() on '%s': %s\n", temp, strerror(errno));
+    fclose(fp);
+    unlink(temp);
+    return -1;
+  }
+  if (fclose(fp) != 0 || rename(temp, file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+//load bloop list & RNG state from checkpoint file, after making sure it belongs to this configuration
+int checkpoint_load(const char *file) {
+  struct checkpoint_header h, expect;
+  FILE *fp;
+  if ((fp = fopen(file, "rb")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", file, strerror(errno));
+    return -1;
+  }
+  checkpoint_header_init(&expect);
+  if (fread(&h, sizeof(struct checkpoint_header), 1, fp) != 1) {
+    fprintf(stderr, "Checkpoint '%s' is truncated\n", file);
+    fclose(fp);
+    return -1;
+  }
+  if (memcmp(h.magic, expect.magic, 8) != 0 || h.version != expect.version) {
+    fprintf(stderr, "'%s' is not a version %d checkpoint file\n", file, CHECKPOINT_VERSION);
+    fclose(fp);
+    return -1;
+  }
+  if (
+    h.window_arc_length != expect.window_arc_length ||
+    h.window_altitude != expect.window_altitude ||
+    h.image_res != expect.image_res ||
+    h.bloops_per_frame != expect.bloops_per_frame ||
+    h.frames != expect.frames ||
+    h.rng_seed != expect.rng_seed ||
+    h.bloop_num != expect.bloop_num ||
+    h.image_width != expect.image_width ||
+    h.image_height != expect.image_height
+  ) {
+    fprintf(stderr, "Checkpoint '%s' was made with different simulation parameters\n", file);
+    fclose(fp);
+    return -1;
+  }
+  if ((bloop_list = (struct atmos_bloop *)mem_calloc(MEM_BLOOP, sizeof(struct atmos_bloop), BLOOP_NUM)) == NULL) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    fclose(fp);
+    return -1;
+  }
+  if (fread(bloop_list, sizeof(struct atmos_bloop), BLOOP_NUM, fp) != BLOOP_NUM) {
+    fprintf(stderr, "Checkpoint '%s' is truncated\n", file);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  rng_seek(scenario.seed, h.rng_draws);
+  return 0;
+}
+
+/*
+ |  ================
+ |  PROFILE BATCHES
+ |  ================
+ */
+
+/*
+ |  `--profile-batch` runs the whole scenario once for every profile in
+ |  the database, one after another in the same process. The bloops
+ |  are generated once, so every profile sees the same turbulence, and
+ |  each profile only costs rebuilding the baseline table from the
+ |  mapped file. The binned anomaly curves (see `ensemble_curve()`) go
+ |  to PROFILE_BATCH_FILE as one row per profile, frame & bin.
+ */
+int profile_batch_run() {
+  const struct atmos_profile_entry *entry;
+  char temp[MAX_STR];
+  double *curve, *sum;
+  int *count;
+  uint64_t p;
+  int frame, bin;
+  FILE *fp;
+  if (
+    (curve = (double *)calloc(sizeof(double), ENSEMBLE_BINS)) == NULL ||
+    (sum = (double *)calloc(sizeof(double), ENSEMBLE_BINS)) == NULL ||
+    (count = (int *)calloc(sizeof(int), ENSEMBLE_BINS)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  if (bloop_init() == -1) {
+    return -1;
+  }
+  snprintf(temp, MAX_STR, "%s.tmp", PROFILE_BATCH_FILE);
+  if ((fp = fopen(temp, "w")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    return -1;
+  }
+  fprintf(fp, "profile,frame,dist,anom\n");
+  for (p=0; p < profile_db.header->count; p++) {
+    entry = &(profile_db.index[p]);
+    if (profile_select(entry->id) == -1) {
+      fclose(fp);
+      unlink(temp);
+      return -1;
+    }
+    for (frame=1; frame <= scenario.frames; frame++) {
+      atmos_reset();
+      if (ENABLE_TURBULENCE) {
+        bloop_apply_all(frame,NULL);
+      }
+      if (FIELD_TYPE == ATMOS_FIELD_POLAR && atmos_cartesian()) {
+        polar_resample();
+      }
+      if (ray_trace(NULL) == -1) {
+        fclose(fp);
+        unlink(temp);
+        return -1;
+      }
+      ensemble_curve(&sight,curve,sum,count);
+      ray_free();
+      for (bin=0; bin < ENSEMBLE_BINS; bin++) {
+        fprintf(fp, "%llu,%d,%.9g,%.9g\n", (unsigned long long)entry->id, frame, (bin+0.5)*ENSEMBLE_BIN_WIDTH, curve[bin]);
+      }
+      if (!ENABLE_TURBULENCE) {
+        break;
+      }
+    }
+    fprintf(stdout, "Profile %llu (%llu of %llu)\n", (unsigned long long)entry->id, (unsigned long long)p+1, (unsigned long long)profile_db.header->count);
+  }
+  mem_free(bloop_list);
+  free(curve);
+  free(sum);
+  free(count);
+  if (fclose(fp) != 0 || rename(temp, PROFILE_BATCH_FILE) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", PROFILE_BATCH_FILE, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  fprintf(stdout, "Saved anomaly curves of %llu profile(s) to '%s'\n", (unsigned long long)profile_db.header->count, PROFILE_BATCH_FILE);
+  return 0;
+}
+
+/*
+ |  ============
+ |  RENDER CACHE
+ |  ============
+ */
+
+/*
+ |  With `--cache`, each frame's simulated state is saved to
+ |  CACHE_FRAME_FOLDER: the density field's difference from the
+ |  baseline gradient, and the sight line's nodes. `--replay` then
+ |  renders the frames again from those files, without simulating any
+ |  turbulence or tracing any rays, so the look of the output (color
+ |  ramp, contours, chart layout, output size, `--svg`) can be changed
+ |  cheaply. A cache file holds:
+ |  
+ |    [header]   struct cache_header
+ |    [rows]     for each row of the field, top row first: the scale
+ |               (double), the first column & number of columns
+ |               stored (int32 each), then that many differences
+ |               from the baseline, as int16 multiples of the scale
+ |    [nodes]    `nodes` x struct ray_node
+ |  
+ |  Only the span of each row which turbulence touched is stored, and
+ |  each row is scaled to its own largest difference, so the error is
+ |  at most 1/65534 of that.
+ */
+struct cache_header {
+  char magic[8]; // "ATMSRPLY"
+  int version;
+  int frame;
+  //run configuration
+  double window_arc_length, window_altitude, image_res;
+  int image_width, image_height;
+  //baseline (the cache only stores the field's difference from it)
+  int profile; // whether it came from a sounding profile (see `--profile`)
+  uint64_t profile_id, profile_sum;
+  //sight line (starting direction as plain doubles, so the header has no padding to leak)
+  double start_x, start_y, start_l;
+  int nodes;
+};
+//fill header with the current configuration
+void cache_header_init(struct cache_header *h, int frame) {
+  memset(h, 0, sizeof(struct cache_header));
+  memcpy(h->magic, "ATMSRPLY", 8);
+  h->version = CACHE_VERSION;
+  h->frame = frame;
+  h->window_arc_length = WINDOW_ARC_LENGTH;
+  h->window_altitude = WINDOW_ALTITUDE;
+  h->image_res = IMAGE_RES;
+  h->image_width = IMAGE_WIDTH;
+  h->image_height = IMAGE_HEIGHT;
+  h->profile = (profile_file != NULL);
+  h->profile_id = (profile_file != NULL ? profile_id : 0);
+  h->profile_sum = profile_sum;
+  return;
+}
+//baseline gradient for one row of the Cartesian field (same values as `atmos_fill_baseline()`)
+void atmos_baseline_row(int y, double *out) {
+  struct atmos_coord coord;
+  int x;
+  for (x=0; x < IMAGE_WIDTH; x++) {
+    atmos_coords(x,y,&coord);
+    baseline_alt[x] = coord.alt;
+  }
+  kernels.baseline_row(out,baseline_alt,IMAGE_WIDTH,atmos_grade,atmos_grade_num);
+  return;
+}
+//save this frame's density field & sight line to the cache
+int cache_save(const char *file, int frame) {
+  struct cache_header h;
+  char temp[MAX_STR];
+  double *row, *base, scale, max;
+  int16_t *q;
+  int32_t span[2];
+  int x, y, first, last;
+  FILE *fp;
+  if (
+    (row = (double *)calloc(sizeof(double), IMAGE_WIDTH)) == NULL ||
+    (base = (double *)calloc(sizeof(double), IMAGE_WIDTH)) == NULL ||
+    (q = (int16_t *)calloc(sizeof(int16_t), IMAGE_WIDTH)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  cache_header_init(&h,frame);
+  h.start_x = sight.start_p.x;
+  h.start_y = sight.start_p.y;
+  h.start_l = sight.start_p.l;
+  h.nodes = sight.num;
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if ((fp = fopen(temp, "wb")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    return -1;
+  }
+  if (fwrite(&h, sizeof(struct cache_header), 1, fp) != 1) {
+    fprintf(stderr, "fwrite() on '%s': %s\n", temp, strerror(errno));
+    fclose(fp);
+    unlink(temp);
+    return -1;
+  }
+  for (y=0; y < IMAGE_HEIGHT; y++) {
+    atmos_row(y,row);
+    atmos_baseline_row(y,base);
+    max = 0.0;
+    for (x=0; x < IMAGE_WIDTH; x++) {
+      max = fmax(max, fabs(row[x]-base[x]));
+    }
+    scale = (max > 0.0 ? max/32767.0 : 1.0);
+    first = IMAGE_WIDTH;
+    last = -1;
+    for (x=0; x < IMAGE_WIDTH; x++) {
+      q[x] = (int16_t)lround((row[x]-base[x])/scale);
+      if (q[x] != 0) {
+        first = MIN(first,x);
+        last = x;
+      }
+    }
+    span[0] = (last >= first ? first : 0);
+    span[1] = (last >= first ? last-first+1 : 0);
+    if (
+      fwrite(&scale, sizeof(double), 1, fp) != 1 ||
+      fwrite(span, sizeof(int32_t), 2, fp) != 2 ||
+      fwrite(&(q[span[0]]), sizeof(int16_t), span[1], fp) != span[1]
+    ) {
+      fprintf(stderr, "fwrite() on '%s': %s\n", temp, strerror(errno));
+      fclose(fp);
+      unlink(temp);
+      return -1;
+    }
+  }
+  if (fwrite(sight.nodes, sizeof(struct ray_node), sight.num, fp) != sight.num) {
+    fprintf(stderr, "fwrite() on '%s': %s\n", temp, strerror(errno));
+    fclose(fp);
+    unlink(temp);
+    return -1;
+  }
+  free(row);
+  free(base);
+  free(q);
+  if (fclose(fp) != 0 || rename(temp, file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+//restore a frame's density field & sight line from the cache, after making sure it belongs to this configuration
+int cache_load(const char *file, int frame) {
+  struct cache_header h, expect;
+  double *span, scale;
+  int16_t *q;
+  int32_t cols[2];
+  int x, y, i, len;
+  FILE *fp;
+  if ((fp = fopen(file, "rb")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", file, strerror(errno));
+    return -1;
+  }
+  cache_header_init(&expect,frame);
+  if (fread(&h, sizeof(struct cache_header), 1, fp) != 1) {
+    fprintf(stderr, "Cache file '%s' is truncated\n", file);
+    fclose(fp);
+    return -1;
+  }
+  if (memcmp(h.magic, expect.magic, 8) != 0 || h.version != expect.version) {
+    fprintf(stderr, "'%s' is not a version %d cache file\n", file, CACHE_VERSION);
+    fclose(fp);
+    return -1;
+  }
+  if (
+    h.frame != expect.frame ||
+    h.window_arc_length != expect.window_arc_length ||
+    h.window_altitude != expect.window_altitude ||
+    h.image_res != expect.image_res ||
+    h.image_width != expect.image_width ||
+    h.image_height != expect.image_height ||
+    h.nodes < 1
+  ) {
+    fprintf(stderr, "Cache file '%s' was made with different simulation parameters\n", file);
+    fclose(fp);
+    return -1;
+  }
+  if (h.profile != expect.profile || h.profile_id != expect.profile_id || h.profile_sum != expect.profile_sum) {
+    fprintf(stderr, "Cache file '%s' was made with a different baseline profile (see `--profile`)\n", file);
+    fclose(fp);
+    return -1;
+  }
+  if ((q = (int16_t *)calloc(sizeof(int16_t), IMAGE_WIDTH)) == NULL) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    fclose(fp);
+    return -1;
+  }
+  //the baseline, plus whatever the turbulence changed
+  atmos_reset();
+  for (y=0; y < IMAGE_HEIGHT; y++) {
+    if (
+      fread(&scale, sizeof(double), 1, fp) != 1 ||
+      fread(cols, sizeof(int32_t), 2, fp) != 2 ||
+      cols[0] < 0 || cols[1] < 0 || cols[0]+cols[1] > IMAGE_WIDTH ||
+      fread(q, sizeof(int16_t), cols[1], fp) != cols[1]
+    ) {
+      fprintf(stderr, "Cache file '%s' is truncated or corrupt\n", file);
+      fclose(fp);
+      free(q);
+      return -1;
+    }
+    for (x=0; x < cols[1]; x += len) {
+      span = atmos_span(cols[0]+x,y,&len);
+      len = MIN(len, cols[1]-x);
+      for (i=0; i < len; i++) {
+        span[i] += q[x+i]*scale;
+      }
+    }
+  }
+  free(q);
+  //sight line
+  ray_free();
+  if ((sight.nodes = (struct ray_node *)mem_calloc(MEM_RAY, sizeof(struct ray_node), h.nodes)) == NULL) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    fclose(fp);
+    return -1;
+  }
+  if (fread(sight.nodes, sizeof(struct ray_node), h.nodes, fp) != h.nodes) {
+    fprintf(stderr, "Cache file '%s' is truncated\n", file);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  sight.buffsize = sight.num = h.nodes;
+  sight.end = &(sight.nodes[sight.num-1]);
+  sight.start_p.x = h.start_x;
+  sight.start_p.y = h.start_y;
+  sight.start_p.l = h.start_l;
+  return 0;
+}
+//render every frame again from the cache, without simulating anything
+int replay_run() {
+  struct spb_instance spb;
+  int frame_digits = (int)ceil(log10(scenario.frames));
+  char frame_fmt_str[MAX_STR], frame_file[MAX_STR];
+  char anom_fmt_str[MAX_STR], anom_file[MAX_STR];
+  char cache_fmt_str[MAX_STR], cache_file[MAX_STR];
+  char dump_fmt_str[MAX_STR], dump_file[MAX_STR];
+  char data_fmt_str[MAX_STR], data_file[MAX_STR];
+  int frame;
+  snprintf(frame_fmt_str, MAX_STR, "%s/%%0%dd.%s", FRAME_FOLDER, frame_digits, (svg ? "svg" : "png"));
+  snprintf(anom_fmt_str, MAX_STR, "%s/%%0%dd.png", ANOM_FRAME_FOLDER, frame_digits);
+  snprintf(cache_fmt_str, MAX_STR, "%s/%%0%dd.rpl", CACHE_FRAME_FOLDER, frame_digits);
+  snprintf(dump_fmt_str, MAX_STR, "%s/%%0%dd.fld", DUMP_FRAME_FOLDER, frame_digits);
+  snprintf(data_fmt_str, MAX_STR, "%s/%%0%dd.csv", ANOM_DATA_FOLDER, frame_digits);
+  if (headless) {
+    mkdir_safe(ANOM_DATA_FOLDER);
+  } else {
+    mkdir_safe(FRAME_FOLDER);
+    mkdir_safe(ANOM_FRAME_FOLDER);
+  }
+  if (dump) {
+    mkdir_safe(DUMP_FRAME_FOLDER);
+  }
+  spb.real_goal = scenario.frames;
+  spb.bar_goal = 20;
+  spb_init(&spb,"","frames");
+  for (frame=1; frame <= scenario.frames; frame++) {
+    snprintf(frame_file, MAX_STR, frame_fmt_str, frame);
+    snprintf(anom_file, MAX_STR, anom_fmt_str, frame);
+    snprintf(cache_file, MAX_STR, cache_fmt_str, frame);
+    snprintf(dump_file, MAX_STR, dump_fmt_str, frame);
+    snprintf(data_file, MAX_STR, data_fmt_str, frame);
+    if (cache_load(cache_file,frame) == -1) {
+      fprintf(stderr, "Cannot replay; run with `--cache` first\n");
+      return -1;
+    }
+    if (dump && atmos_dump(dump_file,frame) == -1) {
+      return -1;
+    }
+    if (headless) {
+      if (ang_anom_save(data_file) == -1) {
+        return -1;
+      }
+    } else {
+      if (frame_render(&spb,frame_file,anom_file) == -1) {
+        return -1;
+      }
+    }
+    ray_free();
+    spb.real_progress++;
+    spb_update(&spb);
+  }
+  return 0;
+}
+
+/*
+ |  ==================
+ |  REGRESSION HARNESS
+ |  ==================
+ */
+
+/*
+ |  `--regress write FILE` runs a small fixed scenario, and saves a
+ |  golden file with each frame's anomaly curve (binned like
+ |  `--ensemble`), the mean & RMS of each frame's density field,
+ |  and how long the simulation took. `--regress
+ |  check FILE` runs the same scenario (with whatever other options
+ |  are given, like `--stamp-table` or `--polar`) and compares the
+ |  results against the golden file within REGRESS_ANOM_TOL &
+ |  REGRESS_FIELD_TOL, along with the speedup. The file is plain
+ |  text:
+ |  
+ |    atmos_sim-regress VERSION
+ |    size IMAGE_WIDTH IMAGE_HEIGHT
+ |    scenario SEED FRAMES BLOOPS_PER_FRAME
+ |    bins BINS
+ |    seconds ELAPSED
+ |    field FRAME MEAN RMS               (one line per frame)
+ |    curve FRAME BIN_0 ... BIN_N-1      (one line per frame)
+ */
+struct regress_field {
+  double mean, rms; // kg/m^3
+};
+struct regress_result {
+  int width, height, bins;
+  struct atmos_scenario scenario;
+  double seconds; //simulation time, not counting setup or measuring the results
+  struct regress_field *fields; //one per frame
+  double *curves; //one row of bins per frame
+};
+//allocate per-frame results
+int regress_alloc(struct regress_result *r) {
+  if (
+    (r->fields = (struct regress_field *)calloc(sizeof(struct regress_field), r->scenario.frames)) == NULL ||
+    (r->curves = (double *)calloc(sizeof(double), (size_t)r->scenario.frames*r->bins)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+//free per-frame results
+void regress_free(struct regress_result *r) {
+  free(r->fields);
+  free(r->curves);
+  return;
+}
+//moments of the density field on the pixel grid
+void regress_field_calc(struct regress_field *f, double *row) {
+  double sum = 0.0, sum2 = 0.0, n = (double)IMAGE_WIDTH*IMAGE_HEIGHT;
+  int x, y;
+  for (y=0; y < IMAGE_HEIGHT; y++) {
+    atmos_row(y,row);
+    for (x=0; x < IMAGE_WIDTH; x++) {
+      sum += row[x];
+      sum2 += row[x]*row[x];
+    }
+  }
+  f->mean = sum/n;
+  f->rms = sqrt(sum2/n);
+  return;
+}
+//run the fixed scenario with the current options
+int regress_simulate(struct regress_result *r) {
+  double *row, *sum;
+  int *count;
+  double start;
+  int frame;
+  r->width = IMAGE_WIDTH;
+  r->height = IMAGE_HEIGHT;
+  r->bins = ENSEMBLE_BINS;
+  r->scenario = scenario;
+  r->seconds = 0.0;
+  if (regress_alloc(r) == -1) {
+    return -1;
+  }
+  if (
+    (row = (double *)calloc(sizeof(double), IMAGE_WIDTH)) == NULL ||
+    (sum = (double *)calloc(sizeof(double), ENSEMBLE_BINS)) == NULL ||
+    (count = (int *)calloc(sizeof(int), ENSEMBLE_BINS)) == NULL
+  ) {
+    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+    return -1;
+  }
+  start = clock_seconds();
+  if (bloop_init() == -1) {
+    return -1;
+  }
+  r->seconds += clock_seconds() - start;
+  for (frame=1; frame <= scenario.frames; frame++) {
+    start = clock_seconds();
+    atmos_reset();
+    if (ENABLE_TURBULENCE) {
+      bloop_apply_all(frame,NULL);
+    }
+    if (FIELD_TYPE == ATMOS_FIELD_POLAR) {
+      polar_resample();
+    }
+    if (ray_trace(NULL) == -1) {
+      return -1;
+    }
+    ensemble_curve(&sight,&(r->curves[(frame-1)*r->bins]),sum,count);
+    ray_free();
+    r->seconds += clock_seconds() - start;
+    regress_field_calc(&(r->fields[frame-1]),row);
+    fprintf(stdout, "Frame %d of %d\n", frame, scenario.frames);
+  }
+  mem_free(bloop_list);
+  free(row);
+  free(sum);
+  free(count);
+  return 0;
+}
+//save results as a golden file
+int regress_save(const char *file, struct regress_result *r) {
+  char temp[MAX_STR];
+  FILE *fp;
+  int frame, bin;
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if ((fp = fopen(temp, "w")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    return -1;
+  }
+  fprintf(fp, "atmos_sim-regress %d\n", REGRESS_VERSION);
+  fprintf(fp, "size %d %d\n", r->width, r->height);
+  fprintf(fp, "scenario %u %d %.17g\n", r->scenario.seed, r->scenario.frames, r->scenario.bloops_per_frame);
+  fprintf(fp, "bins %d\n", r->bins);
+  fprintf(fp, "seconds %.6lf\n", r->seconds);
+  for (frame=0; frame < r->scenario.frames; frame++) {
+    fprintf(fp, "field %d %.17g %.17g\n", frame+1, r->fields[frame].mean, r->fields[frame].rms);
+  }
+  for (frame=0; frame < r->scenario.frames; frame++) {
+    fprintf(fp, "curve %d", frame+1);
+    for (bin=0; bin < r->bins; bin++) {
+      fprintf(fp, " %.17g", r->curves[frame*r->bins+bin]);
+    }
+    fprintf(fp, "\n");
+  }
+  if (fclose(fp) != 0 || rename(temp, file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+//read a golden file
+int regress_load(const char *file, struct regress_result *r) {
+  FILE *fp;
+  int version, frame, bin, index, ok;
+  memset(r, 0, sizeof(struct regress_result));
+  if ((fp = fopen(file, "r")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", file, strerror(errno));
+    return -1;
+  }
+  ok = (
+    fscanf(fp, " atmos_sim-regress %d", &version) == 1 && version == REGRESS_VERSION &&
+    fscanf(fp, " size %d %d", &(r->width), &(r->height)) == 2 &&
+    fscanf(fp, " scenario %u %d %lf", &(r->scenario.seed), &(r->scenario.frames), &(r->scenario.bloops_per_frame)) == 3 &&
+    fscanf(fp, " bins %d", &(r->bins)) == 1 &&
+    fscanf(fp, " seconds %lf", &(r->seconds)) == 1 &&
+    r->scenario.frames > 0 && r->bins > 0 &&
+    regress_alloc(r) == 0
+  );
+  for (frame=0; ok && frame < r->scenario.frames; frame++) {
+    ok = (
+      fscanf(fp, " field %d %lf %lf", &index, &(r->fields[frame].mean), &(r->fields[frame].rms)) == 3 &&
+      index == frame+1
+    );
+  }
+  for (frame=0; ok && frame < r->scenario.frames; frame++) {
+    ok = (fscanf(fp, " curve %d", &index) == 1 && index == frame+1);
+    for (bin=0; ok && bin < r->bins; bin++) {
+      ok = (fscanf(fp, " %lf", &(r->curves[frame*r->bins+bin])) == 1);
+    }
+  }
+  fclose(fp);
+  if (!ok) {
+    fprintf(stderr, "'%s' is not a version %d regression golden file\n", file, REGRESS_VERSION);
+    return -1;
+  }
+  return 0;
+}
+/*
+ |  Largest difference between two anomaly curves, over the bins they
+ |  both have. `unmatched` counts bins which only one of them has
+ |  (where the sight lines end at different distances).
+ */
+double regress_curve_err(const double *a, const double *b, int bins, int *unmatched) {
+  double err = 0.0;
+  int bin;
+  for (bin=0; bin < bins; bin++) {
+    if (isnan(a[bin]) != isnan(b[bin])) {
+      unmatched[0]++;
+    } else if (!isnan(a[bin])) {
+      err = fmax(err, fabs(a[bin] - b[bin]));
+    }
+  }
+  return err;
+}
+/*
+ |  Write or check a golden file (see above). Returns 0 if all went
+ |  well, 1 if the results are out of tolerance, or -1 on error.
+ */
+int regress_run(regress_mode mode, const char *file) {
+  struct regress_result res, gold;
+  struct regress_field *f, *g;
+  double field_err, anom_err, err;
+  int frame, fail, unmatched, total;
+  if (mode == REGRESS_CHECK && regress_load(file,&gold) == -1) {
+    return -1;
+  }
+  if (regress_simulate(&res) == -1) {
+    return -1;
+  }
+  if (mode == REGRESS_WRITE) {
+    if (regress_save(file,&res) == -1) {
+      return -1;
+    }
+    fprintf(stdout, "Saved golden results to '%s' (%.2lfs)\n", file, res.seconds);
+    regress_free(&res);
+    return 0;
+  }
+  if (
+    gold.width != res.width || gold.height != res.height || gold.bins != res.bins ||
+    gold.scenario.seed != res.scenario.seed || gold.scenario.frames != res.scenario.frames ||
+    gold.scenario.bloops_per_frame != res.scenario.bloops_per_frame
+  ) {
+    fprintf(stderr, "'%s' was written for a different window or scenario\n", file);
+    return -1;
+  }
+  field_err = anom_err = 0.0;
+  total = 0;
+  for (frame=0; frame < res.scenario.frames; frame++) {
+    f = &(res.fields[frame]);
+    g = &(gold.fields[frame]);
+    err = fmax(fabs(f->mean - g->mean)/fabs(g->mean), fabs(f->rms - g->rms)/fabs(g->rms));
+    field_err = fmax(field_err, err);
+    fprintf(stdout, "Frame %d: density field relative error %.3le, ", frame+1, err);
+    unmatched = 0;
+    err = regress_curve_err(&(res.curves[frame*res.bins]),&(gold.curves[frame*res.bins]),res.bins,&unmatched);
+    anom_err = fmax(anom_err, err);
+    total += unmatched;
+    fprintf(stdout, "anomaly error %.3le degrees", err);
+    if (unmatched > 0) {
+      fprintf(stdout, " (%d bin(s) reached by only one of the sight lines)", unmatched);
     }
+    fprintf(stdout, "\n");
   }
-  return;
+  fail = (field_err > REGRESS_FIELD_TOL || anom_err > REGRESS_ANOM_TOL || total > 0);
+  fprintf(stdout, "Density field: max relative error %.3le (tolerance %.1le)\n", field_err, REGRESS_FIELD_TOL);
+  fprintf(stdout, "Angular anomaly: max error %.3le degrees (tolerance %.1le), %d unmatched bin(s)\n", anom_err, REGRESS_ANOM_TOL, total);
+  fprintf(stdout, "Time: %.2lfs vs. %.2lfs golden (%.2lfx speedup)\n", res.seconds, gold.seconds, gold.seconds/res.seconds);
+  fprintf(stdout, "%s\n", (fail ? "FAIL" : "PASS"));
+  regress_free(&res);
+  regress_free(&gold);
+  return fail;
 }
 
 /*
- |  =============================
- |  CONTOUR LINES FOR DENSITY MAP
- |  =============================
+ |  ========
+ |  SHARDING
+ |  ========
  */
 
-//initialize contour list
-int contour_init() {
-  struct atmos_contour *contour;
+/*
+ |  `--frames A:B` renders only frames A through B, so one animation
+ |  can be spread over several processes or machines (`--shard I/N`
+ |  picks the I-th of N even ranges). Every run generates the bloops
+ |  from the same counter-based random stream (see `rng_stream()`),
+ |  which gives the same turbulence on any machine without a
+ |  checkpoint to share. Each shard writes a manifest into
+ |  MANIFEST_FOLDER when it finishes:
+ |  
+ |    atmos_sim-manifest VERSION
+ |    size IMAGE_WIDTH IMAGE_HEIGHT
+ |    scenario SEED FRAMES BLOOPS_PER_FRAME
+ |    bloops CHECKSUM                    (of the whole bloop list)
+ |    range A B
+ |    frame N SECONDS FILES              (one per frame, then...)
+ |    file CHECKSUM BYTES PATH           (... one per output file)
+ |  
+ |  Frames which a previous run already finished (see `--resume`) are
+ |  listed with 0 seconds. Once every shard's outputs & manifest are
+ |  gathered into one tree, `--merge` checks that the manifests belong
+ |  to this configuration & the same bloops, that together they cover
+ |  every frame exactly once, and that every output file is still
+ |  what its shard wrote.
+ */
+//checksum of the bloop list, to tell whether two runs simulated the same turbulence
+uint64_t bloop_checksum() {
+  return checksum_update(CHECKSUM_INIT, bloop_list, sizeof(struct atmos_bloop)*BLOOP_NUM);
+}
+//start this shard's manifest (as a temp file, renamed once the shard is done)
+FILE *manifest_open(const char *file) {
+  char temp[MAX_STR];
+  FILE *fp;
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if ((fp = fopen(temp, "w")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", temp, strerror(errno));
+    return NULL;
+  }
+  fprintf(fp, "atmos_sim-manifest %d\n", MANIFEST_VERSION);
+  fprintf(fp, "size %d %d\n", IMAGE_WIDTH, IMAGE_HEIGHT);
+  fprintf(fp, "scenario %u %d %.17g\n", scenario.seed, scenario.frames, scenario.bloops_per_frame);
+  fprintf(fp, "bloops %016llx\n", (unsigned long long)bloop_checksum());
+  fprintf(fp, "profile %d %llu %016llx\n", (profile_file != NULL), (profile_file != NULL ? profile_id : 0ULL), (unsigned long long)profile_sum);
+  fprintf(fp, "range %d %d\n", frame_first, frame_last);
+  return fp;
+}
+//add a finished frame & its output files to the manifest
+int manifest_frame(FILE *fp, int frame, double seconds, const char **files, int num) {
+  uint64_t checksum;
+  long size;
   int i;
-  double interval = ((double)DENSITY_MAX) / ((double)CONTOUR_NUM);
-  double density;
-  if ((contour_list = (struct atmos_contour *)calloc(sizeof(struct atmos_contour), CONTOUR_NUM)) == NULL) {
-    fprintf(stderr, "calloc(): %s\n", strerror(errno));
-    return -1;
+  fprintf(fp, "frame %d %.3lf %d\n", frame, seconds, num);
+  for (i=0; i < num; i++) {
+    if (checksum_file(files[i],&checksum,&size) == -1) {
+      return -1;
+    }
+    fprintf(fp, "file %016llx %ld %s\n", (unsigned long long)checksum, size, files[i]);
   }
-  fprintf(stdout,"Density contour lines (kg/m^3):\n");
-  for (i=0; i < CONTOUR_NUM; i++) {
-    density = ((double)(i+1)) * interval;
-    contour = &(contour_list[i]);
-    contour->density = density;
-    fprintf(stdout,"\t%02d)  %0.3lf\n",i,density);
+  return 0;
+}
+//finish the manifest
+int manifest_close(FILE *fp, const char *file) {
+  char temp[MAX_STR];
+  snprintf(temp, MAX_STR, "%s.tmp", file);
+  if (fclose(fp) != 0 || rename(temp, file) != 0) {
+    fprintf(stderr, "saving '%s': %s\n", file, strerror(errno));
+    unlink(temp);
+    return -1;
   }
   return 0;
 }
-//return 1 if given pixel is on a contour line, otherwise 0
-int contour_detect(int x, int y) {
-  struct atmos_contour *contour;
-  double tl, tr, bl, br;
-  int i, itl, itr, ibl, ibr;
-  double prev, curr;
-  /*
-   |  take a sample at each corner of this pixel, halfway between
-   |  it and the neighboring pixels
-   */
-  tl = atmos_val(((double)x)-0.5,((double)y)-0.5,INTERPOLATION_TYPE);
-  tr = atmos_val(((double)x)+0.5,((double)y)-0.5,INTERPOLATION_TYPE);
-  bl = atmos_val(((double)x)-0.5,((double)y)+0.5,INTERPOLATION_TYPE);
-  br = atmos_val(((double)x)+0.5,((double)y)+0.5,INTERPOLATION_TYPE);
-  //corner indices in contour array will be negative until initialized
-  itl = itr = ibl = ibr = -1;
-  //find corner indices
-  curr = -1.0;
-  for (i=0; i < CONTOUR_NUM; i++) {
-    contour = &(contour_list[i]);
-    prev = curr;
-    curr = contour->density;
-    if (tl > prev && tl <= curr) {
-      itl = i;
-    }
-    if (tr > prev && tr <= curr) {
-      itr = i;
-    }
-    if (bl > prev && bl <= curr) {
-      ibl = i;
-    }
-    if (br > prev && br <= curr) {
-      ibr = i;
-    }
-    //are we done yet?
-    if (itl >= 0 && itr >= 0 && ibl >= 0 && ibr >= 0) {
-      break;
-    }
+/*
+ |  Check one shard's manifest against this configuration, and mark
+ |  the frames it covers in `covered` (counting up its files &
+ |  seconds). Returns 0 if it checks out, 1 if not, -1 on error.
+ */
+int manifest_check(const char *file, uint64_t bloops, char *covered, int *files, double *seconds) {
+  struct atmos_scenario s;
+  unsigned long long expect, checksum, prof_id, prof_sum;
+  char path[MAX_STR];
+  uint64_t actual;
+  long size, actual_size;
+  double frame_seconds;
+  int version, width, height, prof, first, last, frame, num, i, ok, fail = 0;
+  FILE *fp;
+  if ((fp = fopen(file, "r")) == NULL) {
+    fprintf(stderr, "fopen() on '%s': %s\n", file, strerror(errno));
+    return -1;
+  }
+  ok = (
+    fscanf(fp, " atmos_sim-manifest %d", &version) == 1 && version == MANIFEST_VERSION &&
+    fscanf(fp, " size %d %d", &width, &height) == 2 &&
+    fscanf(fp, " scenario %u %d %lf", &(s.seed), &(s.frames), &(s.bloops_per_frame)) == 3 &&
+    fscanf(fp, " bloops %llx", &expect) == 1 &&
+    fscanf(fp, " profile %d %llu %llx", &prof, &prof_id, &prof_sum) == 3 &&
+    fscanf(fp, " range %d %d", &first, &last) == 2
+  );
+  if (!ok) {
+    fprintf(stderr, "'%s' is not a version %d shard manifest\n", file, MANIFEST_VERSION);
+    fclose(fp);
+    return -1;
   }
-  /*
-   |  if all four corners lie within the same density interval, then
-   |  no contour line runs through this pixel
-   */
   if (
-    (itl == itr)
-    && (ibl == ibr)
-    && (itl == ibl)
-    //&& (itr == ibr) //this last comparison can be inferred
+    width != IMAGE_WIDTH || height != IMAGE_HEIGHT ||
+    s.seed != scenario.seed || s.frames != scenario.frames || s.bloops_per_frame != scenario.bloops_per_frame ||
+    first < 1 || last > scenario.frames || first > last
   ) {
-    return 0;
-  } else {
+    fprintf(stderr, "'%s' was made with different simulation parameters\n", file);
+    fclose(fp);
     return 1;
   }
-}
-
-/*
- |  ================
- |  ATMOSPHERE LOGIC
- |  ================
- */
-
-//calculate standard density gradient for the given point
-double atmos_baseline(double x, double y) {
-  struct atmos_coord coord;
-  double frac;
-  struct atmos_grade_stop *floor, *ceil;
-  int i;
-  atmos_coords(x,y,&coord);
-  
-  //check for extremes
-  if (coord.alt < atmos_grade[0].alt) {
-    return atmos_grade[0].density;
+  if (prof != (profile_file != NULL) || prof_id != (profile_file != NULL ? profile_id : 0ULL) || prof_sum != profile_sum) {
+    fprintf(stderr, "'%s' was made with a different baseline profile (see `--profile`)\n", file);
+    fclose(fp);
+    return 1;
   }
-  if (coord.alt > atmos_grade[ATMOS_STOP_NUM-1].alt) {
-    return atmos_grade[ATMOS_STOP_NUM-1].density;
+  if (expect != bloops) {
+    fprintf(stderr, "'%s' simulated different turbulence (bloop checksum %016llx, expected %016llx)\n", file, expect, (unsigned long long)bloops);
+    fclose(fp);
+    return 1;
   }
-  
-  //find place in gradient stops
-  for (i=0; i < ATMOS_STOP_NUM; i++) {
-    floor = &(atmos_grade[i]);
-    if (i == (ATMOS_STOP_NUM-1)) {
-      ceil = &(atmos_grade[i]);
-    } else {
-      ceil = &(atmos_grade[i+1]);
+  for (frame=first; frame <= last; frame++) {
+    if (fscanf(fp, " frame %d %lf %d", &i, &frame_seconds, &num) != 3 || i != frame) {
+      fprintf(stderr, "'%s' is truncated or corrupt\n", file);
+      fclose(fp);
+      return -1;
     }
-    if (coord.alt >= floor->alt && coord.alt <= ceil->alt) {
-      frac = (coord.alt - floor->alt)/(ceil->alt - floor->alt);
-      return (ceil->density - floor->density)*frac + floor->density;
+    if (covered[frame-1]) {
+      fprintf(stderr, "Frame %d is in more than one shard ('%s' overlaps another)\n", frame, file);
+      fail = 1;
+    }
+    covered[frame-1] = 1;
+    seconds[0] += frame_seconds;
+    for (i=0; i < num; i++) {
+      if (fscanf(fp, " file %llx %ld %1023s", &checksum, &size, path) != 3) {
+        fprintf(stderr, "'%s' is truncated or corrupt\n", file);
+        fclose(fp);
+        return -1;
+      }
+      if (checksum_file(path,&actual,&actual_size) == -1) {
+        fail = 1;
+      } else if (actual != checksum || actual_size != size) {
+        fprintf(stderr, "'%s' doesn't match its shard's manifest ('%s')\n", path, file);
+        fail = 1;
+      }
+      files[0]++;
     }
   }
-  //return 1.0 - (coord.alt/WINDOW_ALTITUDE);
-  return 0.0;
+  fclose(fp);
+  return fail;
 }
-//initialize stuff
-int atmos_init() {
-  int x, y, i, halfway;
-  double n1x, n1y, h1x, h1y, h2x, h2y, n2x, n2y;
-  double frac;
-  
-  //atmospheric density gradient
-  /*
-   |  This plot relates altitude vs. density of Earth's
-   |  atmosphere:
-   |  - https://commons.wikimedia.org/wiki/File:Comparison_US_standard_atmosphere_1962.svg
-   |  
-   |  This is the plot curve in SVG notation, if X axis
-   |  is altitude in km and Y axis is density in kg/m^3:
-   |  
-   |    d="M 0,1.28 C 5,0.60 11,0.31 15,0.20 19,0.08 22,0.02 37,0.00"
-   |  
-   |  ... or, in other words:
-   |  
-   |  node: 0,1.28
-   |    [handle]: 5,0.60
-   |    [handle]: 11,0.31
-   |  node: 15,0.20
-   |    [handle]: 19,0.08
-   |    [handle]: 22,0.02
-   |  node: 37,0.00
-   */
-  halfway = ATMOS_STOP_NUM/2;
-  for (i=0; i < ATMOS_STOP_NUM; i++) {
-    if (i < halfway) {
-      frac = (((double)i) / ((double)(halfway-1)));
-      n1x = 00.0; n1y = 1.28;
-      h1x = 05.0; h1y = 0.60;
-      h2x = 11.0; h2y = 0.31;
-      n2x = 15.0; n2y = 0.20;
-    } else {
-      frac = (((double)(i - halfway)) / ((double)(ATMOS_STOP_NUM-1-halfway)));
-      n1x = 15.0; n1y = 0.20;
-      h1x = 19.0; h1y = 0.08;
-      h2x = 22.0; h2y = 0.02;
-      n2x = 37.0; n2y = 0.00;
-    }
-    atmos_grade[i].alt = bezier_cubic(n1x,h1x,h2x,n2x,frac);
-    atmos_grade[i].density = bezier_cubic(n1y,h1y,h2y,n2y,frac);
+//check every shard's manifest, and that together they make up the whole animation
+int merge_run() {
+  char file[MAX_STR], *covered;
+  struct dirent *entry;
+  double seconds = 0.0;
+  uint64_t bloops;
+  int shards = 0, files = 0, fail = 0, frame, res;
+  size_t len;
+  DIR *dir;
+  //the bloops every shard should have made
+  rng_stream(scenario.seed, 0);
+  if (bloop_init() == -1) {
+    return -1;
   }
-  
-  //atmospheric density field
-  if ((atmos = (double **)calloc(sizeof(double *), IMAGE_HEIGHT)) == NULL) {
+  bloops = bloop_checksum();
+  if ((covered = (char *)calloc(sizeof(char), scenario.frames)) == NULL) {
     fprintf(stderr, "calloc(): %s\n", strerror(errno));
     return -1;
   }
-  for (y=0; y < IMAGE_HEIGHT; y++) {
-    if ((atmos[y] = (double *)calloc(sizeof(double), IMAGE_WIDTH)) == NULL) {
-      fprintf(stderr, "calloc(): %s\n", strerror(errno));
-      return -1;
+  if ((dir = opendir(MANIFEST_FOLDER)) == NULL) {
+    fprintf(stderr, "opendir() on '%s': %s\n", MANIFEST_FOLDER, strerror(errno));
+    return -1;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    len = strlen(entry->d_name);
+    if (len < 4 || strcmp(&(entry->d_name[len-4]), ".txt") != 0) {
+      continue;
     }
-    for (x=0; x < IMAGE_WIDTH; x++) {
-      atmos[y][x] = atmos_baseline(x,y);
+    snprintf(file, MAX_STR, "%s/%s", MANIFEST_FOLDER, entry->d_name);
+    if ((res = manifest_check(file,bloops,covered,&files,&seconds)) == -1) {
+      closedir(dir);
+      return -1;
     }
+    fail |= res;
+    shards++;
   }
-  
-  return 0;
-}
-//free atmospheric density field
-void atmos_free() {
-  int y;
-  for (y=0; y < IMAGE_HEIGHT; y++) {
-    free(atmos[y]);
+  closedir(dir);
+  for (frame=1; frame <= scenario.frames; frame++) {
+    if (!covered[frame-1]) {
+      fprintf(stderr, "Frame %d isn't in any finished shard\n", frame);
+      fail = 1;
+    }
   }
-  free(atmos);
+  free(covered);
+  fprintf(stdout, "Merge: %d shards, %d files, %.1lf seconds of rendering: %s\n", shards, files, seconds, (fail ? "FAIL" : "OK"));
+  return fail;
 }
 
 /*
- |  ===============
- |  OPTICAL PHYSICS
- |  ===============
+ |  ==================
+ |  SIMULATION SERVICE
+ |  ==================
  */
-
 /*
- |  This function takes density and returns the absolute refractive
- |  index for air. See:
- |  - https://en.wikipedia.org/wiki/Gladstone%E2%80%93Dale_relation
- |  - https://webmineral.com/help/Gladstone-Dale.shtml
- |  - https://en.wikipedia.org/wiki/Refractive_index
+ |  With `--serve`, we stay running and take scenarios over a Unix
+ |  domain socket, so the geometry, baseline field, contour lines &
+ |  chart art only have to be set up once. Each connection sends one
+ |  line: a command, followed by any settings to change from the
+ |  compiled-in parameters.
  |  
- |  (See definition of `GLADSTONEDALE_CONST` in this code above for
- |  a citation on that number.)
- */
-long double density_to_ior(long double density) {
-  return 1.0 + (density * (long double)GLADSTONEDALE_CONST);
-}
-/*
- |  This function takes an incident angle & two densities, and
- |  gives a refraction angle. See:
- |  - https://en.wikipedia.org/wiki/Snell%27s_law
+ |    curve  [seed=N] [bloops=N] [frames=N] [alt=KM] [ground=KM]
+ |    frames [seed=N] [bloops=N] [frames=N] [alt=KM] [ground=KM]
+ |    quit
  |  
- |  Also note:
- |  - d1 is the previous medium
- |  - d2 is the new medium
- |  - These are converted to refractive indices using the
- |    Gladstone-Dale constant for air. See above.
- */
-long double snells_law(long double th, long double d1, long double d2) {
-  long double val;
-  long double n1, n2;
-  n1 = density_to_ior(d1);
-  n2 = density_to_ior(d2);
-  val = (n1/n2)*sinl(th*PI/180.0);
-  if (fabsl(val) <= 1.0) {
-    return asinl(val)*180.0/PI;
-  } else {
-    /*
-     |  Total internal reflection. See:
-     |  - https://en.wikipedia.org/wiki/Snell%27s_law#Total_internal_reflection_and_critical_angle
-     |  - https://en.wikipedia.org/wiki/Total_internal_reflection
-     */
-    return 180.0 - th;
-  }
-}
-
-/*
- |  ==========
- |  RAYTRACING
- |  ==========
+ |  `bloops` is bloops per frame, and `alt` & `ground` place the
+ |  observer. Results are sent back as each frame finishes: `curve`
+ |  sends "frame N" followed by that frame's sight line in the same
+ |  CSV format as `--headless`, and `frames` renders the usual images
+ |  and sends "frame N FRAME_FILE ANOM_FILE". The reply ends with
+ |  "done", or with "error MESSAGE" if something went wrong.
  */
+typedef enum {
+  SERVE_CURVE = 0,
+  SERVE_FRAMES = 1,
+  SERVE_QUIT = 2
+} serve_command;
 
-//allocate memory buffer
-int ray_init() {
-  struct atmos_coord coord;
-  struct ray_node *node;
-  //initialize buffer
-  sight.buffsize = 256;
-  sight.num = 0;
-  if ((sight.nodes = (struct ray_node *)calloc(sizeof(struct ray_node), sight.buffsize)) == NULL) {
-    fprintf(stderr, "calloc(): %s\n", strerror(errno));
+//read a finite number from a setting, with nothing trailing it
+int serve_number(const char *val, double *num) {
+  char *end;
+  errno = 0;
+  num[0] = strtod(val, &end);
+  if (end == val || *end != '\0' || errno != 0 || !isfinite(num[0])) {
     return -1;
   }
-  //drop first node
-  node = &(sight.nodes[sight.num++]);
-  sight.end = node;
-  coord.alt = 0.1;
-  coord.ground = 0.4;
-  atmos_window(&(node->x),&(node->y),&coord,NULL,NULL);
-  sight.dir_p.x = 0.0;
-  sight.dir_p.y = WINDOW_ANGLE*(0.5-(coord.ground/WINDOW_ARC_LENGTH));
-  sight.dir_p.l = 1.0;
-  vectorC3D_assign(&(sight.dir_c),vectorP3D_cartesian(sight.dir_p));
-  vectorP3D_assign(&(sight.start_p),sight.dir_p);
-  sight.density = atmos_val(node->x,node->y,INTERPOLATION_TYPE);
   return 0;
 }
-//manage potentially growing buffer
-int ray_buff() {
-  if (sight.num == sight.buffsize) {
-    sight.buffsize = sight.buffsize*2;
-    if ((sight.nodes = (struct ray_node *)realloc(sight.nodes, sizeof(struct ray_node) * sight.buffsize)) == NULL) {
-      fprintf(stderr, "realloc(): %s\n", strerror(errno));
+//read a request into the scenario settings (error message goes in `err`)
+int serve_parse(char *line, serve_command *cmd, char *err) {
+  char *tok, *val, *end;
+  unsigned long seed;
+  long frames;
+  double num;
+  tok = strtok(line, " \t\r\n");
+  if (tok == NULL) {
+    snprintf(err, MAX_STR, "empty request");
+    return -1;
+  }
+  if (strcmp(tok, "curve") == 0) {
+    cmd[0] = SERVE_CURVE;
+  } else if (strcmp(tok, "frames") == 0) {
+    cmd[0] = SERVE_FRAMES;
+  } else if (strcmp(tok, "quit") == 0) {
+    cmd[0] = SERVE_QUIT;
+  } else {
+    snprintf(err, MAX_STR, "unknown command '%s'", tok);
+    return -1;
+  }
+  while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+    if ((val = strchr(tok, '=')) == NULL) {
+      snprintf(err, MAX_STR, "expected NAME=VALUE, got '%s'", tok);
+      return -1;
+    }
+    *(val++) = '\0';
+    if (strcmp(tok, "seed") == 0) {
+      errno = 0;
+      seed = strtoul(val, &end, 10);
+      if (!isdigit((unsigned char)val[0]) || *end != '\0' || errno != 0 || seed > UINT_MAX) {
+        snprintf(err, MAX_STR, "bad seed '%s'", val);
+        return -1;
+      }
+      scenario.seed = (unsigned int)seed;
+    } else if (strcmp(tok, "frames") == 0) {
+      errno = 0;
+      frames = strtol(val, &end, 10);
+      if (end == val || *end != '\0' || errno != 0 || frames < 1 || frames > SERVE_MAX_FRAMES) {
+        snprintf(err, MAX_STR, "bad frame count '%s' (at most %d)", val, SERVE_MAX_FRAMES);
+        return -1;
+      }
+      scenario.frames = (int)frames;
+    } else if (strcmp(tok, "bloops") == 0 || strcmp(tok, "alt") == 0 || strcmp(tok, "ground") == 0) {
+      if (serve_number(val,&num) == -1) {
+        snprintf(err, MAX_STR, "bad number '%s' for '%s'", val, tok);
+        return -1;
+      }
+      if (tok[0] == 'b') {
+        scenario.bloops_per_frame = num;
+      } else if (tok[0] == 'a') {
+        scenario.observer_alt = num;
+      } else {
+        scenario.observer_ground = num;
+      }
+    } else {
+      snprintf(err, MAX_STR, "unknown setting '%s'", tok);
       return -1;
     }
   }
+  //checked as a double, so a large product can't overflow `bloop_count()`
+  if (scenario.bloops_per_frame * (double)scenario.frames > SERVE_MAX_BLOOPS) {
+    snprintf(err, MAX_STR, "too many bloops (at most %d over all frames)", SERVE_MAX_BLOOPS);
+    return -1;
+  }
+  if (
+    scenario.frames < 1 || scenario.bloops_per_frame < 0.0 ||
+    scenario.observer_alt < 0.0 || scenario.observer_alt > WINDOW_ALTITUDE ||
+    scenario.observer_ground < 0.0 || scenario.observer_ground > WINDOW_ARC_LENGTH
+  ) {
+    snprintf(err, MAX_STR, "settings out of range");
+    return -1;
+  }
+  if (cmd[0] == SERVE_FRAMES && (headless || !atmos_cartesian())) {
+    snprintf(err, MAX_STR, "rendering is turned off (see `--headless`)");
+    return -1;
+  }
   return 0;
 }
-//clear ray struct
-void ray_free() {
-  free(sight.nodes);
-  sight.nodes = NULL;
-  sight.buffsize = 0;
-  sight.num = 0;
-  sight.end = NULL;
-  return;
-}
-//take sample of density field at given distance & direction from given node point
-double ray_surface_sample(double x, double y, double a, double dist) {
-  struct vectorP3D p;
-  struct vectorC3D c;
-  p.x = 0.0;
-  p.y = a;
-  p.l = dist;
-  vectorC3D_assign(&c,vectorP3D_cartesian(p));
-  return atmos_val(x+c.x,y-c.z,INTERPOLATION_TYPE);
-}
-//determine which side of contour the sample is on
-int ray_sample_compare(double contour, double sample) {
-  double diff = fabs(contour - sample);
-  if (diff <= RAY_SAMPLE_TOLERANCE) {
-    return 0;
-  } else if (sample < contour) {
+//simulate the current scenario, sending results back as we go
+int serve_scenario(FILE *out, serve_command cmd) {
+  char frame_fmt_str[MAX_STR], frame_file[MAX_STR];
+  char anom_fmt_str[MAX_STR], anom_file[MAX_STR];
+  int frame_digits = (int)ceil(log10(scenario.frames));
+  int frame, fail = 0;
+  snprintf(frame_fmt_str, MAX_STR, "%s/%%0%dd.%s", FRAME_FOLDER, frame_digits, (svg ? "svg" : "png"));
+  snprintf(anom_fmt_str, MAX_STR, "%s/%%0%dd.png", ANOM_FRAME_FOLDER, frame_digits);
+  if (cmd == SERVE_FRAMES) {
+    mkdir_safe(FRAME_FOLDER);
+    mkdir_safe(ANOM_FRAME_FOLDER);
+  }
+  BLOOP_NUM = bloop_count();
+  rng_seek(scenario.seed, 0);
+  if (bloop_init() == -1) {
     return -1;
-  } else {
-    return +1;
   }
-}
-//build search unit struct from given thinner surface normal
-void ray_search_build_unit(double x, double y, struct ray_search_unit *unit, double normal, double density) {
-  int i;
-  unit->surf.norm[0] = normal;
-  unit->surf.tan[0] = normal+90.0;
-  unit->surf.norm[1] = normal+180.0;
-  unit->surf.tan[1] = normal+270.0;
-  //let's make sure things don't get out of hand
-  for (i=0; i<2; i++) {
-    if (unit->surf.tan[i] > 360.0) {
-      unit->surf.tan[i] -= 360.0;
-    }
-    if (unit->surf.norm[i] > 360.0) {
-      unit->surf.norm[i] -= 360.0;
-    }
-  }
-  //fill rest of values
-  for (i=0; i<2; i++) {
-    unit->tan[i] = ray_surface_sample(x,y,unit->surf.tan[i],RAY_STEP/3.0);
-    unit->norm[i] = ray_surface_sample(x,y,unit->surf.norm[i],RAY_STEP/3.0);
-  }
-  //give it a match score
-  unit->score = 0.0;
-  unit->score += density - unit->norm[0]; //big neg. diff = more points
-  unit->score += unit->norm[1] - density; //big pos. diff = more points
-  unit->score -= fabs(density - unit->tan[0]); //any diff = less points
-  unit->score -= fabs(density - unit->tan[1]); //any diff = less points
-  return;
-}
-//find surface angle at given point
-struct ray_surface ray_find_surface(double x, double y) {
-  struct ray_search_unit units[RAY_MAX_SAMPLES], best, left, right, probe1, probe2;
-  struct atmos_coord coord;
-  double density = sight.density;
-  double angle, base;
-  int best_index, better;
-  int better_left, better_right, best_left, best_right;
-  int count, i;
-  
-  //scatter wide looking for initial best
-  atmos_coords(x,y,&coord);
-  base = (0.5-(coord.ground/WINDOW_ARC_LENGTH)) * WINDOW_ANGLE;
-  for (i=0; i < RAY_MAX_SAMPLES; i++) {
-    angle = (((double)i)/((double)RAY_MAX_SAMPLES))*360.0 + base;
-    if (angle > 360.0) {
-      angle -= 360.0;
+  for (frame=1; frame <= scenario.frames; frame++) {
+    atmos_reset();
+    if (ENABLE_TURBULENCE) {
+      bloop_apply_all(frame,NULL);
+    }
+    if (FIELD_TYPE == ATMOS_FIELD_POLAR && atmos_cartesian()) {
+      polar_resample();
+    }
+    if (ray_trace(NULL) == -1) {
+      fail = 1;
+      break;
     }
-    ray_search_build_unit(x,y,&(units[i]),angle,density);
-    if (i==0 || units[i].score > units[best_index].score) {
-      best_index = i;
+    if (cmd == SERVE_FRAMES) {
+      snprintf(frame_file, MAX_STR, frame_fmt_str, frame);
+      snprintf(anom_file, MAX_STR, anom_fmt_str, frame);
+      if (frame_render(NULL,frame_file,anom_file) == -1) {
+        ray_free();
+        fail = 1;
+        break;
+      }
+      fprintf(out, "frame %d %s %s\n", frame, frame_file, anom_file);
+    } else {
+      fprintf(out, "frame %d\n", frame);
+      ang_anom_write(out);
+    }
+    fflush(out);
+    ray_free();
+    if (!ENABLE_TURBULENCE) {
+      break;
     }
   }
-  //keep some notes
-  best = units[best_index];
-  right = units[best_index-1];
-  left = units[best_index+1];
+  //the bloops go either way, so a failed request doesn't hold on to them
+  mem_free(bloop_list);
+  bloop_list = NULL;
+  return (fail ? -1 : 0);
+}
+//listen on the given socket until we're asked to quit
+int serve_run(const char *path) {
+  struct sockaddr_un addr;
+  struct atmos_scenario defaults = scenario;
+  serve_command cmd;
+  char line[MAX_STR], err[MAX_STR];
+  FILE *in, *out;
+  int sock, conn, quit;
   
-  //hone in on actual best point
-  count = 0;
-  do {
-    //first check to the right
-    angle = (best.surf.norm[0] + right.surf.norm[0])/2.0;
-    ray_search_build_unit(x,y,&probe1,angle,density);
-    //then check to the left
-    angle = (best.surf.norm[0] + left.surf.norm[0])/2.0;
-    ray_search_build_unit(x,y,&probe2,angle,density);
-    
-    //did we find anything useful?
-    better = 0;
-    better_left = better_right = 0;
-    best_left = best_right = 0;
-    if (probe1.score > right.score) {
-      better = 1;
-      better_right = 1;
-      if (probe1.score > best.score) {
-        best_right = 1;
-      }
-    }
-    if (probe2.score > left.score) {
-      better = 1;
-      better_left = 1;
-      if (probe2.score > best.score) {
-        best_left = 1;
-      }
-    }
-    //what do we need to shuffle around?
-    if (best_right && !best_left) {
-      left = best;
-      best = probe1;
-    } else if (best_left && !best_right) {
-      right = best;
-      best = probe2;
-    } else if (best_right && best_left) {
-      if (probe1.score >= probe2.score) {
-        left = best;
-        best = probe1;
-      } else {
-        right = best;
-        best = probe2;
-      }
-    } else if (better_right || better_left) {
-      if (better_right) {
-        right = probe1;
-      }
-      if (better_left) {
-        left = probe2;
-      }
+  //keep a copy of the baseline field, so every frame can start from it
+  if (FIELD_TYPE == ATMOS_FIELD_CARTESIAN && tile_cache == 0) {
+    if ((atmos_base = (double *)mem_calloc(MEM_FIELD, sizeof(double), (size_t)IMAGE_WIDTH*IMAGE_HEIGHT)) == NULL) {
+      fprintf(stderr, "calloc(): %s\n", strerror(errno));
+      return -1;
     }
-    
-    //keep track of samples
-    count++;
-  } while (count < RAY_MAX_SAMPLES || (better != 0 && count < RAY_MAX_SAMPLES));
-  
-  return best.surf;
-}
-//trace the ray another step
-void ray_walk() {
-  struct ray_node *prev, *node;
-  struct ray_surface surface;
-  struct vectorC3D prev_c;
-  struct vectorP3D prev_p;
-  double prev_d, curr_d;
-  double d1, d2;
-  double incoming_normal, outgoing_normal;
-  double incoming_density, outgoing_density;
-  double incident_angle, new_angle;
-  double step;
-  int cmp;
-  
-  //remember old values
-  prev = sight.end;
-  prev_d = sight.density;
-  vectorC3D_assign(&prev_c,sight.dir_c);
-  vectorP3D_assign(&prev_p,sight.dir_p);
-  //add new node
-  node = &(sight.nodes[sight.num++]);
-  node->x = prev->x + sight.dir_c.x*RAY_STEP;
-  node->y = prev->y - sight.dir_c.z*RAY_STEP;
-  sight.end = node;
-  sight.density = atmos_val(node->x,node->y,INTERPOLATION_TYPE);
-  curr_d = sight.density;
-  //check buffer size
-  ray_buff();
-  
-  //if no refraction, then we're done
-  cmp = ray_sample_compare(prev_d,curr_d);
-  if (cmp == 0) {
-    return;
+    memcpy(atmos_base, atmos_data, sizeof(double)*IMAGE_WIDTH*IMAGE_HEIGHT);
   }
-  //find refractive surface angle
-  surface = ray_find_surface(node->x,node->y);
-  
-  //prepare refraction context
-  step = sin((prev_p.y-surface.tan[1])*PI/180.0)*RAY_STEP;
-  d1 = ray_surface_sample(node->x,node->y,surface.norm[0],step);
-  d2 = ray_surface_sample(node->x,node->y,surface.norm[1],step);
-  if (vector_compare(surface.tan[0],prev_p.y,surface.norm[0])) {
-    //incident ray is outside
-    incoming_normal = surface.norm[0];
-    incoming_density = d1;
-    outgoing_normal = surface.norm[1];
-    outgoing_density = d2;
-  } else {
-    //incident ray is inside
-    incoming_normal = surface.norm[1];
-    incoming_density = d2;
-    outgoing_normal = surface.norm[0];
-    outgoing_density = d1;
-  }
-  incident_angle = prev_p.y + 180.0 - incoming_normal;
-  //alter direction accord. to Snell's Law
-  new_angle = snells_law(
-    incident_angle,
-    incoming_density,
-    outgoing_density
-  ) + outgoing_normal;
   
-  //save new direction
-  sight.dir_p.x = 0.0;
-  sight.dir_p.y = new_angle;
-  sight.dir_p.l = 1.0;
-  vectorC3D_assign(&(sight.dir_c),vectorP3D_cartesian(sight.dir_p));
-  return;
-}
-//render sight line to temporary image buffer
-void ray_render(struct spb_instance *spb, double **ray_img) {
-  int x, y, i;
-  struct ray_node *node;
-  for (i=0; i < sight.num; i++) {
-    node = &(sight.nodes[i]);
-    x = (int)round(node->x);
-    y = (int)round(node->y);
-    if (x >= 0 && x < IMAGE_WIDTH && y >= 0 && y < IMAGE_HEIGHT) {
-      ray_img[y][x] = 1.0;
-    }
-    if (ENABLE_TURBULENCE && spb->real_progress < spb->real_goal) {
-      spb_update(spb);
-    }
+  //open the socket
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path '%s' is too long\n", path);
+    return -1;
   }
-  return;
-}
-//render straight line (optionally as a dotted line) to temporary image buffer
-void line_draw(struct spb_instance *spb, double **img, double start_x, double start_y, struct vectorP3D angle, int dotted) {
-  struct vectorC3D diff;
-  double x = sight.nodes[0].x;
-  double y = sight.nodes[0].y;
-  int ix, iy;
-  int count;
-  vectorC3D_assign(&diff,vectorP3D_cartesian(sight.start_p));
+  strcpy(addr.sun_path, path);
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    fprintf(stderr, "socket(): %s\n", strerror(errno));
+    return -1;
+  }
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) != 0 || listen(sock, SOMAXCONN) != 0) {
+    fprintf(stderr, "binding '%s': %s\n", path, strerror(errno));
+    close(sock);
+    return -1;
+  }
+  //a client hanging up early shouldn't take us down with it
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stdout, "Listening on '%s'\n", path);
+  fflush(stdout);
   
-  count = 0;
-  while (atmos_bounds(x,y)) {
-    
-    ix = (int)round(x);
-    iy = (int)round(y);
-    if (
-      (ix >= 0 && ix < IMAGE_WIDTH) &&
-      (iy >= 0 && iy < IMAGE_HEIGHT) &&
-      (!dotted || (count/4)%2)
-    ) {
-      img[iy][ix] = 1.0;
+  //take one request per connection
+  quit = 0;
+  while (!quit) {
+    if ((conn = accept(sock, NULL, NULL)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "accept(): %s\n", strerror(errno));
+      break;
     }
-    
-    x += diff.x*RAY_STEP;
-    y -= diff.z*RAY_STEP;
-    count++;
-    if (ENABLE_TURBULENCE && spb->real_progress < spb->real_goal) {
-      spb_update(spb);
+    if ((in = fdopen(conn, "r")) == NULL || (out = fdopen(dup(conn), "w")) == NULL) {
+      fprintf(stderr, "fdopen(): %s\n", strerror(errno));
+      close(conn);
+      continue;
     }
-  }
-  return;
-}
-//measure sight line's deviation from straight and plot on angular anomaly chart
-void ang_anom(struct spb_instance *spb, double **img) {
-  struct vectorC3D c;
-  struct ray_node *node;
-  double ax, ay, dist, anom;
-  double chart_x, chart_y;
-  int i, x, y;
-  ax = sight.nodes[0].x;
-  ay = sight.nodes[0].y;
-  for (i=0; i < sight.num; i++) {
-    node = &(sight.nodes[i]);
-    //transform node into coordinates relative to the straight line
-    c.x = node->x - ax;
-    c.y = 0.0;
-    c.z = ay - node->y;
-    vectorC3D_rotateY(&c,sight.start_p.y);
-    //calculate values
-    dist = c.x/IMAGE_RES;
-    anom = fabs(atan(c.z/c.x)*180.0/PI);
-    //find position on chart image
-    chart_x = (dist/ANOM_WINDOW_WIDTH)*ANOM_CHART_WIDTH + ANOM_CHART_X;
-    chart_y = ANOM_CHART_HEIGHT - (anom/ANOM_WINDOW_HEIGHT)*ANOM_CHART_HEIGHT + ANOM_CHART_Y;
-    x = (int)round(chart_x);
-    y = (int)round(chart_y);
-    //if safe, mark a pixel
-    if ((x >= 0 && x < ANOM_IMAGE_WIDTH) && (y >= 0 && y < ANOM_IMAGE_HEIGHT)) {
-      img[y][x] = 1.0;
-    }
-    if (ENABLE_TURBULENCE && spb->real_progress < spb->real_goal) {
-      spb_update(spb);
+    scenario = defaults;
+    if (fgets(line, MAX_STR, in) == NULL) {
+      snprintf(err, MAX_STR, "no request");
+      fprintf(out, "error %s\n", err);
+    } else if (serve_parse(line,&cmd,err) == -1) {
+      fprintf(out, "error %s\n", err);
+    } else if (cmd == SERVE_QUIT) {
+      fprintf(out, "done\n");
+      quit = 1;
+    } else if (serve_scenario(out,cmd) == -1) {
+      fprintf(out, "error simulation failed\n");
+    } else {
+      fprintf(out, "done\n");
     }
+    fclose(out);
+    fclose(in);
   }
-  return;
+  close(sock);
+  unlink(path);
+  scenario = defaults;
+  return 0;
 }
 
 /*
@@ -1101,168 +6141,507 @@ void ang_anom(struct spb_instance *spb, double **img) {
  |  =============
  */
 
+//read command-line options
+int args_parse(int argc, char **argv) {
+  static char profile_path[MAX_STR];
+  const char *sep;
+  char *end;
+  double mb;
+  int i;
+  for (i=1; i < argc; i++) {
+    if (strcmp(argv[i], "--resume") == 0) {
+      resume = 1;
+    } else if (strcmp(argv[i], "--headless") == 0) {
+      headless = 1;
+    } else if (strcmp(argv[i], "--ensemble") == 0 && i+1 < argc) {
+      ensemble = atoi(argv[++i]);
+      if (ensemble < 1) {
+        fprintf(stderr, "`--ensemble` needs at least one realization\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--jobs") == 0 && i+1 < argc) {
+      jobs = atoi(argv[++i]);
+      if (jobs < 1) {
+        fprintf(stderr, "`--jobs` needs at least one worker\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--polar") == 0) {
+      FIELD_TYPE = ATMOS_FIELD_POLAR;
+    } else if (strcmp(argv[i], "--stamp-table") == 0 && i+1 < argc) {
+      bloop_table_size = atoi(argv[++i]);
+      if (bloop_table_size < 2) {
+        fprintf(stderr, "`--stamp-table` needs at least 2 entries\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--output-size") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &output_width, &output_height) != 2 || output_width < 1 || output_height < 1) {
+        fprintf(stderr, "`--output-size` needs a size like 4521x1018\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--svg") == 0) {
+      svg = 1;
+    } else if (strcmp(argv[i], "--dispersion") == 0) {
+      dispersion = 1;
+    } else if (strcmp(argv[i], "--profile") == 0 && i+1 < argc) {
+      profile_file = argv[++i];
+      if ((sep = strrchr(profile_file, ':')) == NULL || sscanf(sep+1, "%llu", &profile_id) != 1) {
+        fprintf(stderr, "`--profile` needs a database & profile ID, like soundings.prof:1234\n");
+        return -1;
+      }
+      //keep just the file name
+      snprintf(profile_path, MAX_STR, "%.*s", (int)(sep-profile_file), profile_file);
+      profile_file = profile_path;
+    } else if (strcmp(argv[i], "--profile-batch") == 0 && i+1 < argc) {
+      profile_file = argv[++i];
+      profile_batch = 1;
+    } else if (strcmp(argv[i], "--profile-build") == 0 && i+2 < argc) {
+      profile_text = argv[i+1];
+      profile_file = argv[i+2];
+      i += 2;
+    } else if (strcmp(argv[i], "--target") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf:%lf", &target_ground, &target_alt) != 2) {
+        fprintf(stderr, "`--target` needs a ground distance & altitude in kilometers, like 300:0.5\n");
+        return -1;
+      }
+      if (target_ground <= scenario.observer_ground || target_ground > WINDOW_ARC_LENGTH || target_alt < 0.0 || target_alt > WINDOW_ALTITUDE) {
+        fprintf(stderr, "`--target` has to be inside the window, and farther along the ground than the observer\n");
+        return -1;
+      }
+      target = 1;
+    } else if (strcmp(argv[i], "--serve") == 0 && i+1 < argc) {
+      serve = argv[++i];
+    } else if (strcmp(argv[i], "--tiles") == 0 && i+1 < argc) {
+      tile_cache = atoi(argv[++i]);
+      if (tile_cache < 1) {
+        fprintf(stderr, "`--tiles` needs at least one tile in memory\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--fps-mult") == 0 && i+1 < argc) {
+      fps_mult = atoi(argv[++i]);
+      if (fps_mult < 1) {
+        fprintf(stderr, "`--fps-mult` needs at least one output frame per time step\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--keyframe-step") == 0 && i+1 < argc) {
+      keyframe_step = atoi(argv[++i]);
+      if (keyframe_step < 1) {
+        fprintf(stderr, "`--keyframe-step` needs a step of at least one frame\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--keyframe-check") == 0) {
+      keyframe_check = 1;
+    } else if (strcmp(argv[i], "--full-retrace") == 0) {
+      full_retrace = 1;
+    } else if (strcmp(argv[i], "--cold-search") == 0) {
+      cold_search = 1;
+    } else if (strcmp(argv[i], "--perf") == 0) {
+      perf = 1;
+    } else if (strcmp(argv[i], "--mem-limit") == 0 && i+1 < argc) {
+      mb = strtod(argv[++i], &end);
+      if (end == argv[i] || *end != '\0' || !(mb > 0.0) || mb*1048576.0 >= (double)SIZE_MAX) {
+        fprintf(stderr, "`--mem-limit` needs a number of megabytes above zero (got '%s')\n", argv[i]);
+        return -1;
+      }
+      mem_limit = MAX((size_t)(mb * 1048576.0), 1);
+    } else if (strcmp(argv[i], "--regress") == 0 && i+2 < argc) {
+      if (strcmp(argv[i+1], "write") == 0) {
+        regress = REGRESS_WRITE;
+      } else if (strcmp(argv[i+1], "check") == 0) {
+        regress = REGRESS_CHECK;
+      } else {
+        fprintf(stderr, "`--regress` needs `write` or `check`\n");
+        return -1;
+      }
+      regress_file = argv[i+2];
+      scenario.frames = REGRESS_FRAMES;
+      i += 2;
+    } else if (strcmp(argv[i], "--isa") == 0 && i+1 < argc) {
+      isa = argv[++i];
+    } else if (strcmp(argv[i], "--frames") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%d:%d", &frame_first, &frame_last) != 2 || frame_first < 1 || frame_last < frame_first) {
+        fprintf(stderr, "`--frames` needs a range like 1:25\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--shard") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%d/%d", &shard_index, &shard_count) != 2 || shard_index < 1 || shard_index > shard_count) {
+        fprintf(stderr, "`--shard` needs a shard like 2/4\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--merge") == 0) {
+      merge = 1;
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      cache = 1;
+    } else if (strcmp(argv[i], "--replay") == 0) {
+      replay = 1;
+    } else if (strcmp(argv[i], "--dump") == 0) {
+      dump = 1;
+    } else if (strcmp(argv[i], "--dump-f32") == 0) {
+      dump = 1;
+      DUMP_TYPE = ATMOS_DUMP_F32;
+    } else {
+      fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+      fprintf(stderr, "Usage: %s [--resume] [--headless] [--polar] [--stamp-table N] [--tiles N] [--mem-limit MB] [--perf] [--cold-search] [--full-retrace] [--isa NAME] [--fps-mult N] [--keyframe-step N [--keyframe-check]] [--output-size WxH] [--svg] [--dispersion] [--target GROUND:ALT] [--profile DB:ID | --profile-batch DB | --profile-build TEXT DB] [--dump | --dump-f32] [--cache | --replay] [--frames A:B | --shard I/N | --merge] [--ensemble K [--jobs N] | --serve SOCKET | --regress write|check FILE]\n", argv[0]);
+      return -1;
+    }
+  }
+  if (shard_count > 0) {
+    //split the animation into even ranges of frames
+    if (frame_first > 0) {
+      fprintf(stderr, "`--shard` and `--frames` can't be used together\n");
+      return -1;
+    }
+    frame_first = (int)(((long)(shard_index-1)*scenario.frames)/shard_count) + 1;
+    frame_last = (int)(((long)shard_index*scenario.frames)/shard_count);
+    if (frame_last < frame_first) {
+      fprintf(stderr, "`--shard` asks for more shards than there are frames (%d)\n", scenario.frames);
+      return -1;
+    }
+  }
+  if (frame_last > scenario.frames) {
+    fprintf(stderr, "`--frames` goes past the last frame (%d)\n", scenario.frames);
+    return -1;
+  }
+  if (cache && replay) {
+    fprintf(stderr, "`--cache` and `--replay` can't be used together\n");
+    return -1;
+  }
+  if (dispersion && (ensemble > 0 || serve != NULL || regress != REGRESS_OFF || replay)) {
+    fprintf(stderr, "`--dispersion` only works when rendering an animation\n");
+    return -1;
+  }
+  if (target && (ensemble > 0 || serve != NULL || regress != REGRESS_OFF || replay)) {
+    fprintf(stderr, "`--target` only works when rendering an animation\n");
+    return -1;
+  }
+  if ((fps_mult > 1 || keyframe_step > 1) && (ensemble > 0 || serve != NULL || regress != REGRESS_OFF || replay || profile_batch || frame_first > 0 || merge)) {
+    fprintf(stderr, "`--fps-mult` and `--keyframe-step` only work when rendering a whole animation\n");
+    return -1;
+  }
+  if (keyframe_check && keyframe_step == 1) {
+    fprintf(stderr, "`--keyframe-check` needs `--keyframe-step`\n");
+    return -1;
+  }
+  if (perf && (ensemble > 0 || serve != NULL || regress != REGRESS_OFF || replay || profile_batch)) {
+    fprintf(stderr, "`--perf` only works when rendering an animation\n");
+    return -1;
+  }
+  if (profile_batch && (ensemble > 0 || serve != NULL || regress != REGRESS_OFF || replay || frame_first > 0)) {
+    fprintf(stderr, "`--profile-batch` can't be combined with other kinds of run\n");
+    return -1;
+  }
+  if (replay) {
+    //the cache holds the field on the pixel grid, whichever grid it was simulated on
+    FIELD_TYPE = ATMOS_FIELD_CARTESIAN;
+  }
+  return 0;
+}
+
 int main(int argc, char **argv) {
   struct spb_instance spb;
-  struct SDL_Surface *s = NULL, *anom = NULL;
-  struct pixel pix;
-  struct atmos_bloop *bloop;
-  double **ray_img, **line_img, **anom_img;
-  int x, y, i;
   //animation stuff
-  int current_frame;
-  int frame_digits = (int)ceil(log10(FRAMES));
+  int current_frame, first, last;
+  int frame_digits;
   char frame_fmt_str[MAX_STR];
   char frame_file[MAX_STR];
   char anom_fmt_str[MAX_STR];
   char anom_file[MAX_STR];
+  char dump_fmt_str[MAX_STR];
+  char dump_file[MAX_STR];
+  char data_fmt_str[MAX_STR];
+  char data_file[MAX_STR];
+  char cache_fmt_str[MAX_STR];
+  char cache_file[MAX_STR];
+  char disp_fmt_str[MAX_STR];
+  char disp_file[MAX_STR];
+  char target_fmt_str[MAX_STR];
+  char target_file[MAX_STR];
+  char heat_file[MAX_STR];
+  char manifest_file[MAX_STR];
+  const char *outputs[8];
+  FILE *manifest = NULL;
+  FILE *data_fp = NULL;
+  double start;
+  int output_num;
   
   //initialize stuff
+  if (args_parse(argc,argv) == -1) {
+    return 1;
+  }
   global_init();
   fprintf(stdout, "WINDOW_ANGLE: %lf\nIMAGE_WIDTH: %d\nIMAGE_HEIGHT: %d\n",WINDOW_ANGLE,IMAGE_WIDTH,IMAGE_HEIGHT);
-  srand(RNG_SEED);
-  snprintf(frame_fmt_str, MAX_STR, "%s/%%0%dd.png", FRAME_FOLDER, frame_digits);
+  frame_digits = (int)ceil(log10(OUTPUT_FRAMES));
+  if (kernels_init(isa) == -1) {
+    return 1;
+  }
+  fprintf(stdout, "Hot kernels: %s\n", kernels.name);
+  color_ramp_init();
+  //every run draws its bloops from stream 0, so shards & whole runs make the same ones
+  rng_stream(scenario.seed, 0);
+  snprintf(frame_fmt_str, MAX_STR, "%s/%%0%dd.%s", FRAME_FOLDER, frame_digits, (svg ? "svg" : "png"));
   snprintf(anom_fmt_str, MAX_STR, "%s/%%0%dd.png", ANOM_FRAME_FOLDER, frame_digits);
-  if (
-    atmos_init() == -1 ||
-    bloop_init() == -1 ||
-    contour_init() == -1
-  ) {
+  snprintf(dump_fmt_str, MAX_STR, "%s/%%0%dd.fld", DUMP_FRAME_FOLDER, frame_digits);
+  snprintf(data_fmt_str, MAX_STR, "%s/%%0%dd.csv", ANOM_DATA_FOLDER, frame_digits);
+  snprintf(cache_fmt_str, MAX_STR, "%s/%%0%dd.rpl", CACHE_FRAME_FOLDER, frame_digits);
+  snprintf(disp_fmt_str, MAX_STR, "%s/%%0%dd.csv", DISPERSION_FOLDER, frame_digits);
+  snprintf(target_fmt_str, MAX_STR, "%s/%%0%dd.csv", TARGET_FOLDER, frame_digits);
+  if (profile_text != NULL) {
+    //convert text soundings, instead of simulating
+    return (atmos_profile_build(profile_text,profile_file) == 0 ? 0 : 1);
+  }
+  if (profile_file != NULL) {
+    if (atmos_profile_open(profile_file,&profile_db) == -1) {
+      return 1;
+    }
+    profile_sum = checksum_update(CHECKSUM_INIT, profile_db.map, profile_db.map_size);
+  }
+  if (merge) {
+    //check the shards' manifests, instead of simulating
+    return (merge_run() == 0 ? 0 : 1);
+  }
+  if (mem_preflight() == -1) {
+    return 1;
+  }
+  if (atmos_init() == -1) {
+    return 1;
+  }
+  if (bloop_table_size > 0 && bloop_table_init(bloop_table_size) == -1) {
+    return 1;
+  }
+  if (regress != REGRESS_OFF) {
+    //compare against golden results, instead of an animation
+    if (regress_run(regress,regress_file) != 0) {
+      return 1;
+    }
+    atmos_free();
+    return 0;
+  }
+  if (profile_batch) {
+    //every sounding in the database, instead of an animation
+    if (profile_batch_run() == -1) {
+      return 1;
+    }
+    atmos_free();
+    atmos_profile_close(&profile_db);
+    return 0;
+  }
+  if (ensemble > 0) {
+    //statistics across many turbulence realizations, instead of an animation
+    if (jobs == 0) {
+      jobs = MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    if (ensemble_run(ensemble,jobs) == -1) {
+      return 1;
+    }
+    atmos_free();
+    return 0;
+  }
+  if (replay) {
+    //render again from a previous run's cache, instead of simulating
+    if (contour_init() == -1 || replay_run() == -1) {
+      return 1;
+    }
+    atmos_free();
+    free(contour_list);
+    return 0;
+  }
+  if (serve != NULL) {
+    //take scenarios from other programs, instead of an animation
+    if (contour_init() == -1 || serve_run(serve) == -1) {
+      return 1;
+    }
+    atmos_free();
+    return 0;
+  }
+  if (frame_first > 0) {
+    //every shard makes the same bloops, without sharing a checkpoint
+    if (bloop_init() == -1) {
+      return 1;
+    }
+  } else if (resume) {
+    //pick up the bloops we generated last time
+    if (checkpoint_load(CHECKPOINT_FILE) == -1) {
+      fprintf(stderr, "Cannot resume; run again without `--resume` to start over\n");
+      return 1;
+    }
+  } else {
+    if (bloop_init() == -1 || checkpoint_save(CHECKPOINT_FILE) == -1) {
+      return 1;
+    }
+  }
+  if (contour_init() == -1) {
     return 1;
   }
   //make sure output folders exists
-  mkdir_safe(FRAME_FOLDER);
-  mkdir_safe(ANOM_FRAME_FOLDER);
+  if (headless) {
+    mkdir_safe(ANOM_DATA_FOLDER);
+  } else {
+    mkdir_safe(FRAME_FOLDER);
+    mkdir_safe(ANOM_FRAME_FOLDER);
+  }
+  if (dump) {
+    mkdir_safe(DUMP_FRAME_FOLDER);
+  }
+  if (cache) {
+    mkdir_safe(CACHE_FRAME_FOLDER);
+  }
+  if (dispersion) {
+    mkdir_safe(DISPERSION_FOLDER);
+  }
+  if (target) {
+    mkdir_safe(TARGET_FOLDER);
+  }
+  if (perf) {
+    perf_init();
+  }
+  if (keyframe_step > 1 && keyframe_init() == -1) {
+    return 1;
+  }
+  if (retrace_enabled() && retrace_init() == -1) {
+    return 1;
+  }
+  first = (frame_first > 0 ? frame_first : 1);
+  last = (frame_last > 0 ? frame_last : OUTPUT_FRAMES);
+  if (frame_first > 0) {
+    mkdir_safe(MANIFEST_FOLDER);
+    snprintf(manifest_file, MAX_STR, "%s/%0*d-%0*d.txt", MANIFEST_FOLDER, frame_digits, first, frame_digits, last);
+    if ((manifest = manifest_open(manifest_file)) == NULL) {
+      return 1;
+    }
+  }
   
   if (ENABLE_TURBULENCE) {
-    spb.real_goal = BLOOP_NUM*FRAMES;
+    spb.real_goal = BLOOP_NUM*(keyframe_step > 1 ? keyframe_sims(first,last) : last-first+1);
     spb.bar_goal = 20;
     spb_init(&spb,"",NULL);
   }
-  for (current_frame=1; current_frame <= FRAMES; current_frame++) {
+  for (current_frame=first; current_frame <= last; current_frame++) {
+    snprintf(frame_file, MAX_STR, frame_fmt_str, current_frame);
+    snprintf(anom_file, MAX_STR, anom_fmt_str, current_frame);
+    snprintf(dump_file, MAX_STR, dump_fmt_str, current_frame);
+    snprintf(data_file, MAX_STR, data_fmt_str, current_frame);
+    snprintf(cache_file, MAX_STR, cache_fmt_str, current_frame);
+    snprintf(disp_file, MAX_STR, disp_fmt_str, current_frame);
+    snprintf(target_file, MAX_STR, target_fmt_str, current_frame);
+    start = clock_seconds();
     
-    //start with atmosphere baseline
-    for (y=0; y < IMAGE_HEIGHT; y++) {
-      for (x=0; x < IMAGE_WIDTH; x++) {
-        atmos[y][x] = atmos_baseline(x,y);
+    //everything this frame writes (for the shard's manifest)
+    output_num = 0;
+    if (headless) {
+      outputs[output_num++] = data_file;
+    } else {
+      outputs[output_num++] = frame_file;
+      if (svg) {
+        svg_heat_file(frame_file,heat_file);
+        outputs[output_num++] = heat_file;
       }
+      outputs[output_num++] = anom_file;
+    }
+    if (dump) {
+      outputs[output_num++] = dump_file;
+    }
+    if (cache) {
+      outputs[output_num++] = cache_file;
+    }
+    if (dispersion) {
+      outputs[output_num++] = disp_file;
+    }
+    if (target) {
+      outputs[output_num++] = target_file;
     }
     
-    if (ENABLE_TURBULENCE) {
-      //apply bloops
-      for (i=0; i < BLOOP_NUM; i++) {
-        bloop = &(bloop_list[i]);
-        bloop_apply(current_frame,bloop);
-        spb.real_progress++;
+    //skip frames which a previous run already finished
+    if (
+      resume &&
+      (headless ? access(data_file, F_OK) == 0 : (svg ? svg_complete(frame_file) : png_complete(frame_file)) && png_complete(anom_file)) &&
+      (!dump || atmos_dump_complete(dump_file)) &&
+      (!cache || access(cache_file, F_OK) == 0) &&
+      (!dispersion || access(disp_file, F_OK) == 0) &&
+      (!target || access(target_file, F_OK) == 0)
+    ) {
+      if (manifest != NULL && manifest_frame(manifest,current_frame,0.0,outputs,output_num) == -1) {
+        return 1;
+      }
+      if (ENABLE_TURBULENCE) {
+        if (keyframe_step == 1 || current_frame == keyframe_of(current_frame)) {
+          spb.real_progress += BLOOP_NUM;
+        }
         spb_update(&spb);
+      } else {
+        break;
       }
+      continue;
     }
     
-    //trace sight line
-    if (ray_init() == -1) {
-      return 1;
-    }
-    do {
-      ray_walk();
-      if (ENABLE_TURBULENCE && spb.real_progress < spb.real_goal) {
-        spb_update(&spb);
+    //simulate atmosphere for this frame (or blend it from the keyframes around it)
+    if (keyframe_step > 1) {
+      if (keyframe_frame(current_frame,&spb) == -1) {
+        return 1;
       }
-    } while (sight.num < RAY_MAX_NODES && atmos_bounds(sight.end->x,sight.end->y));
+    } else {
+      frame_simulate(current_frame,&spb);
+    }
     
-    //render sight line to its own temporary image buffer
-    if (
-      (ray_img = img_init(IMAGE_WIDTH,IMAGE_HEIGHT)) == NULL ||
-      (line_img = img_init(IMAGE_WIDTH,IMAGE_HEIGHT)) == NULL ||
-      (anom_img = img_init(ANOM_IMAGE_WIDTH,ANOM_IMAGE_HEIGHT)) == NULL
-    ) {
-      return 1;
+    //bring polar field back to the pixel grid for output
+    if (FIELD_TYPE == ATMOS_FIELD_POLAR && atmos_cartesian()) {
+      perf_start(PERF_RESAMPLE);
+      polar_resample();
+      perf_stop(PERF_RESAMPLE, (double)IMAGE_WIDTH*IMAGE_HEIGHT);
     }
-    ray_render(&spb,ray_img);
-    line_draw(&spb,line_img,sight.nodes[0].x,sight.nodes[0].y,sight.start_p,1);
     
-    //render angular anomaly chart of sight line
-    ang_anom(&spb,anom_img);
+    //save raw density field
+    if (dump && atmos_dump(dump_file,current_frame) == -1) {
+      return 1;
+    }
     
-    //we can free this now, it takes a decent amount of memory
-    ray_free();
+    //trace sight line, drawing it (or writing it out) node by node as we go
+    if (headless) {
+      if ((data_fp = ang_anom_begin(data_file)) == NULL) {
+        return 1;
+      }
+    } else if (frame_begin() == -1) {
+      return 1;
+    }
+    perf_start(PERF_TRACE);
+    if (ray_trace(&spb) == -1) {
+      return 1;
+    }
+    perf_stop(PERF_TRACE, sight.num);
     
-    //render image
-    if ((s = SDL_CreateRGBSurface(0,IMAGE_WIDTH,IMAGE_HEIGHT,24,0,0,0,0)) == NULL) {
-      fprintf(stderr, "Failed to create SDL_Surface.\n");
-      return -1;
+    //save what it takes to render this frame again
+    if (cache && cache_save(cache_file,current_frame) == -1) {
+      return 1;
     }
-    for (y=0; y < IMAGE_HEIGHT; y++) {
-      for (x=0; x < IMAGE_WIDTH; x++) {
-        //are we inside the wedge-shaped window?
-        if (atmos_bounds(x,y)) {
-          
-          /*
-           |  LAYER 1
-           |  density colors
-           */
-          density_to_color(&pix,atmos[y][x],x,y);
-          
-          /*
-           |  LAYER 2
-           |  contour lines
-           */
-          if (contour_detect(x,y)) {
-            pix.r += 0.3;
-            pix.g += 0.3;
-            pix.b += 0.3;
-          }
-          
-          /*
-           |  LAYER 3
-           |  straight line reference
-           */
-          pix.r += line_img[y][x]*1.0;
-          pix.g += line_img[y][x]*0.3;
-          pix.b += line_img[y][x]*0.0;
-          
-          /*
-           |  LAYER 4
-           |  sight line
-           */
-          pix.r += ray_img[y][x];
-          pix.g += ray_img[y][x];
-          pix.b += ray_img[y][x];
-          
-        } else {
-          //outside window, everything is black
-          pix.r = pix.g = pix.b = 0.0;
-        }
-        //all done, let's render this pixel
-        pixel_insert(s,pix,x,y);
+    
+    //write this frame's output
+    perf_start(PERF_RENDER);
+    if (headless) {
+      if (ang_anom_end(data_file,data_fp) == -1) {
+        return 1;
+      }
+    } else {
+      if (frame_render(&spb,frame_file,anom_file) == -1) {
+        return 1;
       }
     }
-    //output image file
-    snprintf(frame_file, MAX_STR, frame_fmt_str, current_frame);
-    IMG_SavePNG(s,frame_file);
-    SDL_FreeSurface(s);
-    
-    if (ENABLE_TURBULENCE && spb.real_progress < spb.real_goal) {
-      spb_update(&spb);
+    perf_stop(PERF_RENDER, (headless ? 0.0 : (double)OUTPUT_WIDTH*OUTPUT_HEIGHT));
+    if (dispersion && dispersion_save(disp_file) == -1) {
+      return 1;
+    }
+    if (target && target_save(target_file) == -1) {
+      return 1;
     }
     
-    //render image for angular anomaly chart
-    if ((anom = IMG_Load(ANOM_CHART_BASE)) == NULL) {
-      fprintf(stderr, "Failed to create SDL_Surface.\n");
-      return -1;
+    //see how far off a blended frame was
+    if (keyframe_check && current_frame != keyframe_of(current_frame) && keyframe_compare(current_frame,&spb) == -1) {
+      return 1;
     }
-    for (y=0; y < ANOM_IMAGE_HEIGHT; y++) {
-      for (x=0; x < ANOM_IMAGE_WIDTH; x++) {
-        if (anom_img[y][x] > 0.0) {
-          pix.r = anom_img[y][x]*1.0;
-          pix.g = anom_img[y][x]*0.3;
-          pix.b = anom_img[y][x]*0.0;
-          pixel_insert(anom,pix,x,y);
-        }
-      }
+    
+    //the other lanes take a decent amount of memory (the sight line's buffer is kept for the next frame)
+    packet_free();
+    
+    if (manifest != NULL && manifest_frame(manifest,current_frame,clock_seconds()-start,outputs,output_num) == -1) {
+      return 1;
     }
-    //output image file
-    snprintf(anom_file, MAX_STR, anom_fmt_str, current_frame);
-    IMG_SavePNG(anom,anom_file);
-    SDL_FreeSurface(anom);
     
     if (!ENABLE_TURBULENCE) {
       break;
@@ -1270,17 +6649,35 @@ int main(int argc, char **argv) {
     if (ENABLE_TURBULENCE && spb.real_progress < spb.real_goal) {
       spb_update(&spb);
     }
-    
-    //clean up
-    img_free(ray_img,IMAGE_HEIGHT);
-    img_free(line_img,IMAGE_HEIGHT);
-    img_free(anom_img,ANOM_IMAGE_HEIGHT);
+  }
+  
+  //this shard is done
+  if (manifest != NULL && manifest_close(manifest,manifest_file) == -1) {
+    return 1;
+  }
+  if (keyframe_step > 1) {
+    keyframe_report(stdout);
+  }
+  if (retrace_enabled()) {
+    fprintf(stdout, "Sight line: %ld node(s) kept from earlier frames, %ld traced\n", history.reused, history.traced);
+  }
+  mem_report(stdout);
+  if (perf) {
+    perf_report(stdout);
+    perf_free();
   }
   
   //clean up
+  ray_free();
+  retrace_free();
+  keyframe_free();
   atmos_free();
-  free(bloop_list);
+  mem_free(bloop_table);
+  mem_free(bloop_q);
+  mem_free(bloop_sh2);
+  mem_free(bloop_list);
   free(contour_list);
+  atmos_profile_close(&profile_db);
   return 0;
 }
 